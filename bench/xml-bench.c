@@ -0,0 +1,413 @@
+// Benchmark harness for the tree parser.
+//
+// usage: xml-bench [-n ITERATIONS] FILE...
+//
+// Every file is measured in a child process of its own so the peak RSS is that
+// of one document. Each measures xml_load and xml_unload, then looks up every
+// element through xml_element_get_child and the last attribute of every
+// element through xml_attribute_get. Results go to stdout as one JSON object:
+//
+//   {"scan": "avx2", "iterations": 5, "documents": [{"file": ..., ...}, ...]}
+//
+// Times are the median of the iterations, load_best_ms the fastest load.
+// allocations and allocated_bytes count the malloc, calloc and realloc calls of
+// one load; they are null unless built with XML_BENCH_COUNT_ALLOCATIONS and
+// linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc (see Makefile).
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "xml-parser.h"
+#include "xml-scan.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DEFAULT_ITERATIONS 5
+
+#ifdef XML_BENCH_COUNT_ALLOCATIONS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+static size_t bench_allocations;
+static size_t bench_allocated_bytes;
+
+void *__wrap_malloc(size_t size) {
+    bench_allocations++;
+    bench_allocated_bytes += size;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    bench_allocations++;
+    bench_allocated_bytes += count * size;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    bench_allocations++;
+    bench_allocated_bytes += size;
+    return __real_realloc(pointer, size);
+}
+#endif
+
+typedef struct BenchResult {
+    size_t bytes;
+    size_t elements;
+    size_t attributes;
+    size_t max_depth;
+
+    double load_best_ns;
+    double load_ns; // median
+    double unload_ns;
+    double get_child_ns; // per call
+    double attribute_get_ns;
+    size_t get_child_calls;
+    size_t attribute_get_calls;
+
+    int counted_allocations;
+    size_t allocations;
+    size_t allocated_bytes;
+    long peak_rss_kb;
+} BenchResult;
+
+static double bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+static int bench_compare(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double bench_median(double *samples, size_t count) {
+    qsort(samples, count, sizeof(double), bench_compare);
+    if (count % 2 == 1) {
+        return samples[count / 2];
+    }
+    return (samples[count / 2 - 1] + samples[count / 2]) / 2;
+}
+
+// Every element of the document in pre-order, the root first
+static XMLElement **bench_collect(XMLElement *root, size_t *count, size_t *max_depth) {
+    size_t capacity = 1024;
+    size_t size = 0;
+    XMLElement **elements = malloc(capacity * sizeof(XMLElement *));
+    if (elements == NULL) {
+        return NULL;
+    }
+
+    size_t depth = 1;
+    *max_depth = 1;
+    XMLElement *element = root;
+    while (element != NULL) {
+        if (size == capacity) {
+            capacity *= 2;
+            XMLElement **grown = realloc(elements, capacity * sizeof(XMLElement *));
+            if (grown == NULL) {
+                free(elements);
+                return NULL;
+            }
+            elements = grown;
+        }
+        elements[size++] = element;
+
+        if (element->children != NULL) {
+            element = element->children;
+            depth++;
+            if (depth > *max_depth) {
+                *max_depth = depth;
+            }
+            continue;
+        }
+        while (element != root && element->next_sibling == NULL) {
+            element = element->parent;
+            depth--;
+        }
+        element = element == root ? NULL : element->next_sibling;
+    }
+
+    *count = size;
+    return elements;
+}
+
+// Looks up every element by name from its parent. The result is kept so the
+// calls are not optimized out.
+static size_t bench_get_child(XMLElement **elements, size_t count) {
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++) {
+        found += xml_element_get_child(elements[i]->parent, elements[i]->name) != NULL;
+    }
+    return found;
+}
+
+// Looks up the last attribute of every element by name
+static size_t bench_attribute_get(XMLElement **elements, size_t count) {
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *name = elements[i]->attributes[elements[i]->attributes_size - 1].name;
+        found += xml_attribute_get(elements[i], name) != NULL;
+    }
+    return found;
+}
+
+static int bench_file(const char *path, int iterations, BenchResult *result) {
+    memset(result, 0, sizeof(BenchResult));
+
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        perror(path);
+        return -1;
+    }
+    result->bytes = (size_t)info.st_size;
+
+    double *loads = malloc((size_t)iterations * sizeof(double));
+    double *unloads = malloc((size_t)iterations * sizeof(double));
+    if (loads == NULL || unloads == NULL) {
+        free(loads);
+        free(unloads);
+        return -1;
+    }
+
+    // the first load warms the page cache and is the one allocations are
+    // counted for
+#ifdef XML_BENCH_COUNT_ALLOCATIONS
+    bench_allocations = 0;
+    bench_allocated_bytes = 0;
+#endif
+    XMLFile *file = xml_load(path);
+#ifdef XML_BENCH_COUNT_ALLOCATIONS
+    result->counted_allocations = 1;
+    result->allocations = bench_allocations;
+    result->allocated_bytes = bench_allocated_bytes;
+#endif
+    if (file == NULL) {
+        fprintf(stderr, "%s: failed to load\n", path);
+        free(loads);
+        free(unloads);
+        return -1;
+    }
+
+    size_t count = 0;
+    XMLElement **elements = bench_collect(file->root, &count, &result->max_depth);
+    if (elements == NULL) {
+        xml_unload(file);
+        free(loads);
+        free(unloads);
+        return -1;
+    }
+    result->elements = count;
+
+    // the attribute lookups run over a list of their own, so they do not pay
+    // for walking past the elements without attributes
+    size_t with_attributes = 0;
+    for (size_t i = 0; i < count; i++) {
+        result->attributes += (size_t)elements[i]->attributes_size;
+        if (elements[i]->attributes_size > 0) {
+            with_attributes++;
+        }
+    }
+    XMLElement **attributed = malloc((with_attributes > 0 ? with_attributes : 1) * sizeof(XMLElement *));
+    if (attributed == NULL) {
+        free(elements);
+        xml_unload(file);
+        free(loads);
+        free(unloads);
+        return -1;
+    }
+    for (size_t i = 0, next = 0; i < count; i++) {
+        if (elements[i]->attributes_size > 0) {
+            attributed[next++] = elements[i];
+        }
+    }
+
+    // every lookup is of a name that exists
+    size_t found = 0;
+    result->get_child_calls = count - 1;
+    double start = bench_now();
+    for (int i = 0; i < iterations; i++) {
+        found += bench_get_child(elements + 1, count - 1);
+    }
+    double elapsed = bench_now() - start;
+    if (result->get_child_calls > 0) {
+        result->get_child_ns = elapsed / ((double)result->get_child_calls * iterations);
+    }
+
+    result->attribute_get_calls = with_attributes;
+    start = bench_now();
+    for (int i = 0; i < iterations; i++) {
+        found += bench_attribute_get(attributed, with_attributes);
+    }
+    elapsed = bench_now() - start;
+    if (result->attribute_get_calls > 0) {
+        result->attribute_get_ns = elapsed / ((double)result->attribute_get_calls * iterations);
+    }
+    free(attributed);
+
+    free(elements);
+    xml_unload(file);
+
+    int status = 0;
+    for (int i = 0; i < iterations; i++) {
+        start = bench_now();
+        file = xml_load(path);
+        loads[i] = bench_now() - start;
+        if (file == NULL) {
+            fprintf(stderr, "%s: failed to load\n", path);
+            status = -1;
+            break;
+        }
+        start = bench_now();
+        xml_unload(file);
+        unloads[i] = bench_now() - start;
+    }
+
+    if (status == 0) {
+        result->load_best_ns = loads[0];
+        for (int i = 1; i < iterations; i++) {
+            if (loads[i] < result->load_best_ns) {
+                result->load_best_ns = loads[i];
+            }
+        }
+        result->load_ns = bench_median(loads, (size_t)iterations);
+        result->unload_ns = bench_median(unloads, (size_t)iterations);
+    }
+    free(loads);
+    free(unloads);
+
+    if (found != (result->get_child_calls + result->attribute_get_calls) * (size_t)iterations) {
+        fprintf(stderr, "%s: lookups missed\n", path);
+        return -1;
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        result->peak_rss_kb = usage.ru_maxrss;
+    }
+    return status;
+}
+
+static void bench_print_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void bench_print_result(FILE *out, const char *path, const BenchResult *result) {
+    double mb_per_s = result->load_ns > 0 ? (double)result->bytes / (1024.0 * 1024.0) / (result->load_ns / 1e9) : 0;
+    double ns_per_element = result->elements > 0 ? result->load_ns / (double)result->elements : 0;
+
+    fprintf(out, "{\"file\": ");
+    bench_print_string(out, path);
+    fprintf(out, ", \"bytes\": %zu, \"elements\": %zu, \"attributes\": %zu, \"max_depth\": %zu",
+            result->bytes, result->elements, result->attributes, result->max_depth);
+    fprintf(out, ", \"load_ms\": %.3f, \"load_best_ms\": %.3f, \"unload_ms\": %.3f",
+            result->load_ns / 1e6, result->load_best_ns / 1e6, result->unload_ns / 1e6);
+    fprintf(out, ", \"mb_per_s\": %.1f, \"ns_per_element\": %.1f", mb_per_s, ns_per_element);
+    fprintf(out, ", \"get_child_calls\": %zu, \"get_child_ns\": %.1f", result->get_child_calls, result->get_child_ns);
+    fprintf(out, ", \"attribute_get_calls\": %zu, \"attribute_get_ns\": %.1f", result->attribute_get_calls, result->attribute_get_ns);
+    if (result->counted_allocations) {
+        fprintf(out, ", \"allocations\": %zu, \"allocated_bytes\": %zu", result->allocations, result->allocated_bytes);
+    } else {
+        fprintf(out, ", \"allocations\": null, \"allocated_bytes\": null");
+    }
+    fprintf(out, ", \"peak_rss_kb\": %ld}", result->peak_rss_kb);
+}
+
+// Runs bench_file in a child and prints its result, 0 on success
+static int bench_run(const char *path, int iterations) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        perror("pipe");
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    if (child == 0) {
+        close(pipe_fds[0]);
+        BenchResult result;
+        int status = bench_file(path, iterations, &result);
+        if (status == 0) {
+            status = write(pipe_fds[1], &result, sizeof(result)) == (ssize_t)sizeof(result) ? 0 : -1;
+        }
+        _exit(status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    close(pipe_fds[1]);
+    BenchResult result;
+    size_t received = 0;
+    while (received < sizeof(result)) {
+        ssize_t size = read(pipe_fds[0], (char *)&result + received, sizeof(result) - received);
+        if (size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (size <= 0) {
+            break;
+        }
+        received += (size_t)size;
+    }
+    close(pipe_fds[0]);
+
+    int status;
+    if (waitpid(child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS || received != sizeof(result)) {
+        return -1;
+    }
+    bench_print_result(stdout, path, &result);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int iterations = BENCH_DEFAULT_ITERATIONS;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        iterations = atoi(argv[2]);
+        first = 3;
+    }
+    if (iterations < 1 || first >= argc) {
+        fprintf(stderr, "usage: xml-bench [-n ITERATIONS] FILE...\n");
+        return EXIT_FAILURE;
+    }
+
+    int failed = 0;
+    int printed = 0;
+    printf("{\"scan\": \"%s\", \"iterations\": %d, \"documents\": [", xml_scan_implementation(), iterations);
+    for (int i = first; i < argc; i++) {
+        printf(printed > 0 ? ",\n  " : "\n  ");
+        // a failed run leaves a null entry, the output stays valid JSON
+        if (bench_run(argv[i], iterations) != 0) {
+            fprintf(stderr, "%s: benchmark failed\n", argv[i]);
+            printf("null");
+            failed = 1;
+        }
+        printed++;
+    }
+    printf("\n]}\n");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
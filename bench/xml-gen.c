@@ -0,0 +1,253 @@
+// Deterministic generator of benchmark documents.
+//
+// usage: xml-gen SHAPE [SIZE_MIB] [SEED]
+//
+// Writes a document of roughly SIZE_MIB MiB (default 8) to stdout. The same
+// shape, size and seed always give the same bytes, so results can be compared
+// across commits. Shapes:
+//   deep        chains of elements nested hundreds to thousands deep
+//   wide        one root with a very long list of small siblings
+//   attributes  records of 8 to 32 attributes each
+//   text        large text and CDATA blobs
+//   comments    small elements between runs of comments
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *gen_names[] = {
+    "item", "record", "entry", "value", "name", "title", "id", "node",
+    "group", "field", "data", "link", "price", "date", "author", "note"
+};
+#define GEN_NAMES_SIZE (sizeof(gen_names) / sizeof(gen_names[0]))
+
+static const char *gen_words[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+    "elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+    "et", "dolore", "magna", "aliqua", "enim", "ad", "minim", "veniam"
+};
+#define GEN_WORDS_SIZE (sizeof(gen_words) / sizeof(gen_words[0]))
+
+typedef struct Generator {
+    uint64_t state;
+    size_t written;
+    size_t target;
+} Generator;
+
+// xorshift64*, fixed so the output does not depend on the C library
+static uint64_t gen_next(Generator *gen) {
+    gen->state ^= gen->state >> 12;
+    gen->state ^= gen->state << 25;
+    gen->state ^= gen->state >> 27;
+    return gen->state * 0x2545F4914F6CDD1DULL;
+}
+
+// uniform in [low, high]
+static size_t gen_range(Generator *gen, size_t low, size_t high) {
+    return low + (size_t)(gen_next(gen) % (high - low + 1));
+}
+
+static int gen_done(const Generator *gen) {
+    return gen->written >= gen->target;
+}
+
+static void gen_write(Generator *gen, const char *data, size_t size) {
+    fwrite(data, 1, size, stdout);
+    gen->written += size;
+}
+
+static void gen_puts(Generator *gen, const char *text) {
+    gen_write(gen, text, strlen(text));
+}
+
+static void gen_printf(Generator *gen, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int size = vprintf(format, args);
+    va_end(args);
+    if (size > 0) {
+        gen->written += (size_t)size;
+    }
+}
+
+static const char *gen_name(Generator *gen) {
+    return gen_names[gen_next(gen) % GEN_NAMES_SIZE];
+}
+
+// size bytes of words separated by spaces, or by line breaks every so often
+static void gen_words_text(Generator *gen, size_t size) {
+    size_t line = 0;
+    while (size > 0) {
+        const char *word = gen_words[gen_next(gen) % GEN_WORDS_SIZE];
+        size_t word_size = strlen(word);
+        if (word_size > size) {
+            word_size = size;
+        }
+        gen_write(gen, word, word_size);
+        size -= word_size;
+        line += word_size;
+        if (size > 0) {
+            gen_write(gen, line > 72 ? "\n" : " ", 1);
+            line = line > 72 ? 0 : line + 1;
+            size--;
+        }
+    }
+}
+
+// size letters and digits, for attribute values and identifiers
+static void gen_token(Generator *gen, size_t size) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    char buffer[64];
+    while (size > 0) {
+        size_t chunk = size < sizeof(buffer) ? size : sizeof(buffer);
+        for (size_t i = 0; i < chunk; i++) {
+            buffer[i] = alphabet[gen_next(gen) % (sizeof(alphabet) - 1)];
+        }
+        gen_write(gen, buffer, chunk);
+        size -= chunk;
+    }
+}
+
+static void gen_deep(Generator *gen) {
+    size_t chain = 0;
+    while (!gen_done(gen)) {
+        size_t depth = gen_range(gen, 256, 4096);
+        gen_printf(gen, "<chain n=\"%zu\">", chain++);
+        for (size_t i = 0; i < depth; i++) {
+            gen_printf(gen, "<%s>", gen_names[i % GEN_NAMES_SIZE]);
+        }
+        gen_token(gen, gen_range(gen, 4, 32));
+        for (size_t i = depth; i > 0; i--) {
+            gen_printf(gen, "</%s>", gen_names[(i - 1) % GEN_NAMES_SIZE]);
+        }
+        gen_puts(gen, "</chain>\n");
+    }
+}
+
+static void gen_wide(Generator *gen) {
+    size_t id = 0;
+    while (!gen_done(gen)) {
+        const char *name = gen_name(gen);
+        gen_printf(gen, "  <%s id=\"%zu\">", name, id++);
+        gen_token(gen, gen_range(gen, 1, 24));
+        gen_printf(gen, "</%s>\n", name);
+    }
+}
+
+static void gen_attributes(Generator *gen) {
+    while (!gen_done(gen)) {
+        size_t count = gen_range(gen, 8, 32);
+        gen_puts(gen, "  <record");
+        for (size_t i = 0; i < count; i++) {
+            // mostly double quotes, some single ones
+            const char *quote = gen_next(gen) % 8 == 0 ? "'" : "\"";
+            gen_printf(gen, " %s%zu=%s", gen_names[i % GEN_NAMES_SIZE], i, quote);
+            gen_token(gen, gen_range(gen, 1, 32));
+            gen_puts(gen, quote);
+        }
+        gen_puts(gen, gen_next(gen) % 2 == 0 ? "/>\n" : "></record>\n");
+    }
+}
+
+static void gen_text(Generator *gen) {
+    while (!gen_done(gen)) {
+        if (gen_next(gen) % 3 == 0) {
+            // CDATA may hold markup characters, they must not end the section
+            gen_puts(gen, "  <data><![CDATA[");
+            size_t size = gen_range(gen, 4 * 1024, 256 * 1024);
+            for (size_t written = 0; written < size; ) {
+                size_t run = gen_range(gen, 16, 512);
+                gen_words_text(gen, run);
+                gen_puts(gen, gen_next(gen) % 2 == 0 ? " <a href=\"x\"> & " : " if (a > b) ");
+                written += run + 16;
+            }
+            gen_puts(gen, "]]></data>\n");
+        } else {
+            gen_puts(gen, "  <para>");
+            gen_words_text(gen, gen_range(gen, 4 * 1024, 64 * 1024));
+            gen_puts(gen, "</para>\n");
+        }
+    }
+}
+
+static void gen_comments(Generator *gen) {
+    size_t id = 0;
+    while (!gen_done(gen)) {
+        size_t comments = gen_range(gen, 1, 6);
+        for (size_t i = 0; i < comments; i++) {
+            gen_puts(gen, "  <!-- ");
+            gen_words_text(gen, gen_range(gen, 16, 512));
+            gen_puts(gen, " -->\n");
+        }
+        const char *name = gen_name(gen);
+        gen_printf(gen, "  <%s id=\"%zu\">", name, id++);
+        gen_token(gen, gen_range(gen, 1, 16));
+        gen_printf(gen, "</%s>\n", name);
+    }
+}
+
+typedef struct Shape {
+    const char *name;
+    void (*generate)(Generator *gen);
+} Shape;
+
+static const Shape gen_shapes[] = {
+    {"deep", gen_deep},
+    {"wide", gen_wide},
+    {"attributes", gen_attributes},
+    {"text", gen_text},
+    {"comments", gen_comments}
+};
+#define GEN_SHAPES_SIZE (sizeof(gen_shapes) / sizeof(gen_shapes[0]))
+
+static void usage(void) {
+    fprintf(stderr, "usage: xml-gen SHAPE [SIZE_MIB] [SEED]\nshapes:");
+    for (size_t i = 0; i < GEN_SHAPES_SIZE; i++) {
+        fprintf(stderr, " %s", gen_shapes[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 4) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    const Shape *shape = NULL;
+    for (size_t i = 0; i < GEN_SHAPES_SIZE; i++) {
+        if (strcmp(argv[1], gen_shapes[i].name) == 0) {
+            shape = &gen_shapes[i];
+        }
+    }
+    if (shape == NULL) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    double size_mib = argc > 2 ? strtod(argv[2], NULL) : 8.0;
+    uint64_t seed = argc > 3 ? strtoull(argv[3], NULL, 10) : 1;
+    if (size_mib <= 0) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    Generator gen;
+    // xorshift must not start at 0, and nearby seeds should diverge at once
+    gen.state = (seed + 1) * 0x9E3779B97F4A7C15ULL;
+    gen.written = 0;
+    gen.target = (size_t)(size_mib * 1024 * 1024);
+
+    gen_puts(&gen, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    gen_printf(&gen, "<bench shape=\"%s\" seed=\"%llu\">\n", shape->name, (unsigned long long)seed);
+    shape->generate(&gen);
+    gen_puts(&gen, "</bench>\n");
+
+    if (fflush(stdout) != 0) {
+        perror("xml-gen");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,385 @@
+#define _DEFAULT_SOURCE
+
+#include "xml-parser.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Regular files up to this size are read into the worker's buffer, larger
+// ones are mapped by xml_load_into
+#define XML_BATCH_READ_MAX (1 << 20)
+
+// Loading many files (xml_load_many). Every worker owns a contiguous range
+// of the paths and takes them from the front; once its range is empty it
+// steals the back half of another worker's range. Documents either go to
+// the results, or through a queue to the handler on the calling thread, in
+// which case the documents are recycled and their number is capped.
+
+typedef struct XMLBatch XMLBatch;
+
+typedef struct XMLBatchWorker {
+    XMLBatch *batch;
+    pthread_t thread;
+    int started;
+
+    pthread_mutex_t lock; // guards next and end, thieves change end
+    size_t next;
+    size_t end;
+
+    // whole small files are read here, reused from one file to the next
+    char *buffer;
+    size_t buffer_capacity;
+} XMLBatchWorker;
+
+// A loaded document waiting for the handler
+typedef struct XMLBatchDone {
+    size_t index;
+    XMLFile *file;
+    int error;
+} XMLBatchDone;
+
+struct XMLBatch {
+    const char *const *paths;
+    XMLLoadOptions load;
+    XMLLoadResult *results;
+    XMLLoadHandler handler;
+    void *context;
+
+    XMLBatchWorker *workers;
+    size_t workers_size;
+
+    // handler only, all guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    size_t in_flight; // documents taken from spare or created, not yet back
+    size_t max_in_flight;
+    XMLBatchDone *done; // max_in_flight entries
+    size_t done_size;
+    XMLFile **spare; // documents reset by the handler loop, max_in_flight entries
+    size_t spare_size;
+    size_t workers_finished;
+};
+
+static size_t xml_batch_threads(const XMLLoadOptions *options, size_t count) {
+    size_t threads = options->threads;
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (size_t)online : 1;
+    }
+    return threads < count ? threads : count;
+}
+
+// Next path for worker, its own or a stolen one. 0 once every range is empty.
+static int xml_batch_take(XMLBatchWorker *worker, size_t *index) {
+    pthread_mutex_lock(&worker->lock);
+    int taken = worker->next < worker->end;
+    if (taken) {
+        *index = worker->next++;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    if (taken) {
+        return 1;
+    }
+
+    XMLBatch *batch = worker->batch;
+    size_t self = (size_t)(worker - batch->workers);
+    for (size_t i = 1; i < batch->workers_size; i++) {
+        XMLBatchWorker *victim = &batch->workers[(self + i) % batch->workers_size];
+        pthread_mutex_lock(&victim->lock);
+        size_t remaining = victim->end - victim->next;
+        size_t start = victim->end - (remaining + 1) / 2;
+        size_t end = victim->end;
+        victim->end = start;
+        pthread_mutex_unlock(&victim->lock);
+        if (remaining > 0) {
+            pthread_mutex_lock(&worker->lock);
+            worker->next = start + 1;
+            worker->end = end;
+            pthread_mutex_unlock(&worker->lock);
+            *index = start;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Reads a whole file into the worker's buffer. Returns its size through
+// size, or the errno of the failure.
+static int xml_batch_read(XMLBatchWorker *worker, int fd, size_t size_hint, size_t *size) {
+    *size = 0;
+    while (1) {
+        if (worker->buffer_capacity - *size < 1 || worker->buffer_capacity < size_hint + 1) {
+            size_t capacity = worker->buffer_capacity > 0 ? worker->buffer_capacity * 2 : 64 * 1024;
+            while (capacity < size_hint + 1) {
+                capacity *= 2;
+            }
+            char *buffer = realloc(worker->buffer, capacity);
+            if (buffer == NULL) {
+                return ENOMEM;
+            }
+            worker->buffer = buffer;
+            worker->buffer_capacity = capacity;
+        }
+        ssize_t count = read(fd, worker->buffer + *size, worker->buffer_capacity - *size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            return errno;
+        }
+        if (count == 0) {
+            return 0;
+        }
+        *size += (size_t)count;
+    }
+}
+
+// The errno of a failed load
+static int xml_batch_error(const XMLError *error) {
+    switch (error->code) {
+        case XML_ERROR_IO:
+            return error->system_error;
+        case XML_ERROR_MEMORY:
+            return ENOMEM;
+        default:
+            return EINVAL;
+    }
+}
+
+// Loads path into file. 0 or the errno of the failure.
+static int xml_batch_load(XMLBatchWorker *worker, XMLFile *file, const char *path) {
+    XMLError load_error;
+    XMLLoadOptions load = worker->batch->load;
+    load.error = &load_error;
+    const XMLLoadOptions *options = &load;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return errno;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        int error = errno;
+        close(fd);
+        return error;
+    }
+    // lazy documents keep their source, it cannot be the shared buffer
+    if (S_ISREG(info.st_mode) && info.st_size <= XML_BATCH_READ_MAX && !(options->flags & XML_LOAD_LAZY)) {
+        size_t size;
+        int error = xml_batch_read(worker, fd, (size_t)info.st_size, &size);
+        close(fd);
+        if (error != 0) {
+            return error;
+        }
+        return xml_load_buffer_into(file, worker->buffer, size, options) == 0 ? 0 : xml_batch_error(&load_error);
+    }
+    close(fd);
+    return xml_load_into(file, path, options) == 0 ? 0 : xml_batch_error(&load_error);
+}
+
+// A document to load into, a recycled one when there is a handler. Waits
+// while max_in_flight documents are out.
+static XMLFile *xml_batch_acquire(XMLBatch *batch) {
+    if (batch->handler == NULL) {
+        return xml_document_new();
+    }
+    pthread_mutex_lock(&batch->lock);
+    while (batch->in_flight >= batch->max_in_flight) {
+        pthread_cond_wait(&batch->changed, &batch->lock);
+    }
+    batch->in_flight++;
+    XMLFile *file = batch->spare_size > 0 ? batch->spare[--batch->spare_size] : NULL;
+    pthread_mutex_unlock(&batch->lock);
+    return file != NULL ? file : xml_document_new();
+}
+
+static void xml_batch_complete(XMLBatch *batch, size_t index, XMLFile *file, int error) {
+    if (batch->handler == NULL) {
+        if (error != 0) {
+            xml_unload(file);
+            file = NULL;
+        }
+        batch->results[index].file = file;
+        batch->results[index].error = error;
+        return;
+    }
+    pthread_mutex_lock(&batch->lock);
+    XMLBatchDone *done = &batch->done[batch->done_size++];
+    done->index = index;
+    done->file = file;
+    done->error = error;
+    pthread_cond_broadcast(&batch->changed);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void *xml_batch_work(void *argument) {
+    XMLBatchWorker *worker = argument;
+    XMLBatch *batch = worker->batch;
+    size_t index;
+    while (xml_batch_take(worker, &index)) {
+        XMLFile *file = xml_batch_acquire(batch);
+        int error = file != NULL ? xml_batch_load(worker, file, batch->paths[index]) : ENOMEM;
+        xml_batch_complete(batch, index, file, error);
+    }
+    if (batch->handler != NULL) {
+        pthread_mutex_lock(&batch->lock);
+        batch->workers_finished++;
+        pthread_cond_broadcast(&batch->changed);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    return NULL;
+}
+
+// Hands the documents to the handler as they complete, until every worker
+// is done. Returns the number that loaded.
+static size_t xml_batch_handle(XMLBatch *batch) {
+    size_t loaded = 0;
+    pthread_mutex_lock(&batch->lock);
+    while (1) {
+        while (batch->done_size == 0 && batch->workers_finished < batch->workers_size) {
+            pthread_cond_wait(&batch->changed, &batch->lock);
+        }
+        if (batch->done_size == 0) {
+            break;
+        }
+        XMLBatchDone done = batch->done[--batch->done_size];
+        pthread_mutex_unlock(&batch->lock);
+
+        batch->handler(batch->context, done.index, done.error == 0 ? done.file : NULL, done.error);
+        if (batch->results != NULL) {
+            batch->results[done.index].file = NULL;
+            batch->results[done.index].error = done.error;
+        }
+        loaded += done.error == 0;
+        xml_document_reset(done.file);
+
+        pthread_mutex_lock(&batch->lock);
+        if (done.file != NULL) {
+            batch->spare[batch->spare_size++] = done.file;
+        }
+        batch->in_flight--;
+        pthread_cond_broadcast(&batch->changed);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return loaded;
+}
+
+// Without threads: one document, reused for every file
+static size_t xml_batch_serial(XMLBatch *batch, XMLBatchWorker *worker, size_t count) {
+    size_t loaded = 0;
+    XMLFile *spare = NULL;
+    for (size_t index = 0; index < count; index++) {
+        XMLFile *file = spare != NULL ? spare : xml_document_new();
+        spare = NULL;
+        int error = file != NULL ? xml_batch_load(worker, file, batch->paths[index]) : ENOMEM;
+        loaded += error == 0;
+        if (batch->handler == NULL) {
+            xml_batch_complete(batch, index, file, error);
+            continue;
+        }
+        batch->handler(batch->context, index, error == 0 ? file : NULL, error);
+        if (batch->results != NULL) {
+            batch->results[index].file = NULL;
+            batch->results[index].error = error;
+        }
+        xml_document_reset(file);
+        spare = file;
+    }
+    xml_unload(spare);
+    return loaded;
+}
+
+size_t xml_load_many(const char *const *paths, size_t count, const XMLLoadManyOptions *options, XMLLoadResult *results) {
+    XMLLoadManyOptions defaults;
+    if (options == NULL) {
+        memset(&defaults, 0, sizeof(defaults));
+        options = &defaults;
+    }
+    if (count == 0 || (results == NULL && options->handler == NULL)) {
+        return 0;
+    }
+
+    XMLBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.paths = paths;
+    batch.load = options->load;
+    batch.load.flags &= ~(XML_LOAD_PARALLEL | XML_LOAD_BORROW_BUFFER);
+    batch.load.names = NULL;
+    batch.load.stats = NULL;
+    batch.load.warning = NULL;
+    batch.results = results;
+    batch.handler = options->handler;
+    batch.context = options->context;
+    batch.workers_size = xml_batch_threads(&options->load, count);
+    batch.max_in_flight = options->max_in_flight > 0 ? options->max_in_flight : 2 * batch.workers_size;
+
+    batch.workers = calloc(batch.workers_size, sizeof(XMLBatchWorker));
+    if (batch.handler != NULL) {
+        batch.done = malloc(batch.max_in_flight * sizeof(XMLBatchDone));
+        batch.spare = malloc(batch.max_in_flight * sizeof(XMLFile *));
+    }
+    if (batch.workers == NULL || (batch.handler != NULL && (batch.done == NULL || batch.spare == NULL))) {
+        free(batch.workers);
+        free(batch.done);
+        free(batch.spare);
+        return 0;
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.changed, NULL);
+
+    // contiguous ranges, so neighbouring paths (often one directory) stay on
+    // one worker until stolen
+    for (size_t i = 0; i < batch.workers_size; i++) {
+        XMLBatchWorker *worker = &batch.workers[i];
+        worker->batch = &batch;
+        worker->next = count * i / batch.workers_size;
+        worker->end = count * (i + 1) / batch.workers_size;
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+    size_t started = 0;
+    for (size_t i = 0; i < batch.workers_size; i++) {
+        XMLBatchWorker *worker = &batch.workers[i];
+        worker->started = pthread_create(&worker->thread, NULL, xml_batch_work, worker) == 0;
+        started += worker->started;
+    }
+    // workers that did not start count as finished, their paths get stolen
+    pthread_mutex_lock(&batch.lock);
+    batch.workers_finished += batch.workers_size - started;
+    pthread_mutex_unlock(&batch.lock);
+
+    size_t loaded = 0;
+    if (started == 0) {
+        loaded = xml_batch_serial(&batch, &batch.workers[0], count);
+    } else if (batch.handler != NULL) {
+        loaded = xml_batch_handle(&batch);
+    }
+    for (size_t i = 0; i < batch.workers_size; i++) {
+        if (batch.workers[i].started) {
+            pthread_join(batch.workers[i].thread, NULL);
+        }
+    }
+    // only once every worker is done, the others may still steal until then
+    for (size_t i = 0; i < batch.workers_size; i++) {
+        pthread_mutex_destroy(&batch.workers[i].lock);
+        free(batch.workers[i].buffer);
+    }
+    if (started > 0 && batch.handler == NULL) {
+        for (size_t i = 0; i < count; i++) {
+            loaded += results[i].error == 0;
+        }
+    }
+
+    for (size_t i = 0; i < batch.spare_size; i++) {
+        xml_unload(batch.spare[i]);
+    }
+    pthread_cond_destroy(&batch.changed);
+    pthread_mutex_destroy(&batch.lock);
+    free(batch.workers);
+    free(batch.done);
+    free(batch.spare);
+    return loaded;
+}
@@ -0,0 +1,505 @@
+#define _DEFAULT_SOURCE
+
+#include "xml-encoding.h"
+#include "xml-scan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+// A decoder that has not seen a '>' after this many bytes picks the encoding
+// from what it has: a declaration is never that long
+#define XML_DECODER_HEAD_SIZE 4096
+
+// Input is handed to the reader this much at a time, so its buffer stays
+// small whatever the size of the document
+#define XML_DECODER_BLOCK_SIZE (1 << 20)
+
+// the encoding stage of loads without options
+static const XMLLoadOptions xml_decoder_default_options = { XML_LOAD_DEFAULT, 0, NULL, 0, NULL, NULL, NULL, NULL };
+
+static const char *const xml_utf8_names[] = { "UTF-8", "UTF8", "US-ASCII", "ASCII", NULL };
+static const char *const xml_latin1_names[] = { "ISO-8859-1", "ISO8859-1", "ISO_8859-1", "LATIN1", "LATIN-1", NULL };
+
+size_t xml_utf8_encode(uint32_t code, char *out) {
+    if (code < 0x80) {
+        out[0] = (char)code;
+        return 1;
+    }
+    if (code < 0x800) {
+        out[0] = (char)(0xC0 | (code >> 6));
+        out[1] = (char)(0x80 | (code & 0x3F));
+        return 2;
+    }
+    if (code < 0x10000) {
+        out[0] = (char)(0xE0 | (code >> 12));
+        out[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (code & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (code >> 18));
+    out[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (code & 0x3F));
+    return 4;
+}
+
+// The encoding named by the XML declaration at the start of data, NULL when
+// there is none
+static const char *xml_declared_encoding(const char *data, size_t size, size_t *encoding_size) {
+    const char *end = data + size;
+    if (size < 5 || memcmp(data, "<?xml", 5) != 0) {
+        return NULL;
+    }
+    end = xml_scan_find_sequence(data, end, "?>", 2);
+    const char *cursor = xml_scan_find_sequence(data, end, "encoding", 8);
+    if (cursor == end) {
+        return NULL;
+    }
+    cursor = xml_scan_skip_whitespace(cursor + 8, end);
+    if (cursor == end || *cursor != '=') {
+        return NULL;
+    }
+    cursor = xml_scan_skip_whitespace(cursor + 1, end);
+    if (cursor == end || (*cursor != '"' && *cursor != '\'')) {
+        return NULL;
+    }
+    const char *name_end = xml_scan_find_byte(cursor + 1, end, *cursor);
+    if (name_end == end) {
+        return NULL;
+    }
+    *encoding_size = (size_t)(name_end - cursor - 1);
+    return cursor + 1;
+}
+
+static int xml_encoding_is(const char *encoding, size_t size, const char *const *names) {
+    for (; *names != NULL; names++) {
+        if (strlen(*names) == size && strncasecmp(encoding, *names, size) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+XMLEncoding xml_encoding_detect(const char *data, size_t size, size_t *bom_size, const char **declared, size_t *declared_size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    *bom_size = 0;
+    *declared = NULL;
+    *declared_size = 0;
+    if (size >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE) {
+        *bom_size = 2;
+        return XML_ENCODING_UTF16LE;
+    }
+    if (size >= 2 && bytes[0] == 0xFE && bytes[1] == 0xFF) {
+        *bom_size = 2;
+        return XML_ENCODING_UTF16BE;
+    }
+    if (size >= 4 && bytes[0] == '<' && bytes[1] == 0 && bytes[2] == '?' && bytes[3] == 0) {
+        return XML_ENCODING_UTF16LE;
+    }
+    if (size >= 4 && bytes[0] == 0 && bytes[1] == '<' && bytes[2] == 0 && bytes[3] == '?') {
+        return XML_ENCODING_UTF16BE;
+    }
+    if (size >= 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF) {
+        *bom_size = 3;
+    }
+
+    *declared = xml_declared_encoding(data + *bom_size, size - *bom_size, declared_size);
+    if (*declared == NULL || xml_encoding_is(*declared, *declared_size, xml_utf8_names)) {
+        return XML_ENCODING_UTF8;
+    }
+    if (xml_encoding_is(*declared, *declared_size, xml_latin1_names)) {
+        return XML_ENCODING_LATIN1;
+    }
+    return XML_ENCODING_OTHER;
+}
+
+size_t xml_latin1_utf8_size(const char *data, size_t size) {
+    const char *end = data + size;
+    for (const char *cursor = xml_scan_find_non_ascii(data, end); cursor < end; cursor = xml_scan_find_non_ascii(cursor + 1, end)) {
+        size++;
+    }
+    return size;
+}
+
+size_t xml_latin1_to_utf8(const char *data, size_t size, char *out) {
+    const char *end = data + size;
+    char *start = out;
+    for (const char *cursor = data; cursor < end; ) {
+        const char *run_end = xml_scan_find_non_ascii(cursor, end);
+        memcpy(out, cursor, (size_t)(run_end - cursor));
+        out += run_end - cursor;
+        if (run_end == end) {
+            break;
+        }
+        out += xml_utf8_encode((unsigned char)*run_end, out);
+        cursor = run_end + 1;
+    }
+    return (size_t)(out - start);
+}
+
+int xml_utf16_to_utf8(const char *input, size_t units, int big_endian, char *out, size_t *out_size, size_t *error_unit) {
+    const unsigned char *bytes = (const unsigned char *)input;
+    size_t high = big_endian ? 0 : 1;
+    size_t size = 0;
+    for (size_t i = 0; i < units; ) {
+        size_t ascii = xml_scan_utf16_ascii(input + 2 * i, units - i, out + size, big_endian);
+        i += ascii;
+        size += ascii;
+        // runs of other characters are converted here, ASCII goes back to
+        // the kernel
+        while (i < units) {
+            uint32_t unit = (uint32_t)bytes[2 * i + high] << 8 | bytes[2 * i + 1 - high];
+            if (unit < 0x80) {
+                break;
+            }
+            if (unit >= 0xDC00 && unit <= 0xDFFF) {
+                *error_unit = i;
+                return -1;
+            }
+            if (unit >= 0xD800 && unit <= 0xDBFF) {
+                uint32_t low = i + 1 < units ? (uint32_t)bytes[2 * i + 2 + high] << 8 | bytes[2 * i + 3 - high] : 0;
+                if (low < 0xDC00 || low > 0xDFFF) {
+                    *error_unit = i;
+                    return -1;
+                }
+                unit = 0x10000 + ((unit - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            }
+            size += xml_utf8_encode(unit, out + size);
+            i++;
+        }
+    }
+    *out_size = size;
+    return 0;
+}
+
+void xml_decoder_init(XMLDecoder *decoder, const XMLLoadOptions *options) {
+    memset(decoder, 0, sizeof(XMLDecoder));
+    decoder->options = options;
+    // skipping the stage reads the bytes as UTF-8, without validating them
+    decoder->detected = (options->flags & XML_LOAD_SKIP_ENCODING) != 0;
+    decoder->encoding = XML_ENCODING_UTF8;
+}
+
+void xml_decoder_free(XMLDecoder *decoder) {
+    free(decoder->carry);
+    free(decoder->output);
+    decoder->carry = NULL;
+    decoder->output = NULL;
+}
+
+static int xml_decoder_fail(XMLDecoder *decoder, XMLErrorCode code, const char *message, size_t offset) {
+    if (decoder->error.code == XML_ERROR_NONE) {
+        decoder->error.code = code;
+        decoder->error.message = message;
+        decoder->error.offset = offset;
+    }
+    return -1;
+}
+
+static int xml_decoder_reserve(char **buffer, size_t *capacity, size_t size) {
+    if (size <= *capacity) {
+        return 0;
+    }
+    size_t new_capacity = *capacity > 0 ? *capacity : 64;
+    while (new_capacity < size) {
+        new_capacity *= 2;
+    }
+    char *grown = realloc(*buffer, new_capacity);
+    if (grown == NULL) {
+        return -1;
+    }
+    *buffer = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Bytes at the end of data that start a character the block does not finish
+static size_t xml_decoder_tail(const XMLDecoder *decoder, const char *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    if (decoder->encoding == XML_ENCODING_UTF8 && !(decoder->options->flags & XML_LOAD_SKIP_ENCODING)) {
+        for (size_t i = 1; i <= 3 && i <= size; i++) {
+            unsigned char byte = bytes[size - i];
+            if ((byte & 0xC0) == 0x80) {
+                continue;
+            }
+            size_t length = byte >= 0xF0 ? 4 : byte >= 0xE0 ? 3 : byte >= 0xC0 ? 2 : 1;
+            return length > i ? i : 0;
+        }
+        return 0;
+    }
+    if (decoder->encoding == XML_ENCODING_UTF16LE || decoder->encoding == XML_ENCODING_UTF16BE) {
+        size_t tail = size % 2;
+        size_t high = decoder->encoding == XML_ENCODING_UTF16BE ? 0 : 1;
+        // a high surrogate waits for its low one
+        if (size - tail >= 2 && bytes[size - tail - 2 + high] >= 0xD8 && bytes[size - tail - 2 + high] <= 0xDB) {
+            tail += 2;
+        }
+        return tail;
+    }
+    return 0;
+}
+
+// Decodes size bytes that end on a character boundary and feeds them
+static int xml_decoder_convert(XMLDecoder *decoder, XMLReader *reader, const char *data, size_t size) {
+    const char *end = data + size;
+    const char *invalid;
+    const char *output = data;
+    size_t output_size = size;
+
+    if (!(decoder->options->flags & XML_LOAD_SKIP_ENCODING)) {
+        switch (decoder->encoding) {
+            case XML_ENCODING_UTF8:
+                invalid = xml_scan_validate_utf8(data, end);
+                if (invalid != end) {
+                    return xml_decoder_fail(decoder, XML_ERROR_ENCODING, "Invalid UTF-8", decoder->offset + (size_t)(invalid - data));
+                }
+                break;
+
+            case XML_ENCODING_OTHER:
+                invalid = xml_scan_find_non_ascii(data, end);
+                if (invalid != end) {
+                    return xml_decoder_fail(decoder, XML_ERROR_UNSUPPORTED_ENCODING, "Unsupported encoding in a document that is not ASCII", decoder->offset + (size_t)(invalid - data));
+                }
+                break;
+
+            case XML_ENCODING_LATIN1:
+                if (xml_decoder_reserve(&decoder->output, &decoder->output_capacity, size * 2) != 0) {
+                    return xml_decoder_fail(decoder, XML_ERROR_MEMORY, "Out of memory", decoder->offset);
+                }
+                output = decoder->output;
+                output_size = xml_latin1_to_utf8(data, size, decoder->output);
+                break;
+
+            case XML_ENCODING_UTF16LE:
+            case XML_ENCODING_UTF16BE: {
+                if (size % 2 != 0) {
+                    return xml_decoder_fail(decoder, XML_ERROR_ENCODING, "UTF-16 document of an odd number of bytes", decoder->offset + size - 1);
+                }
+                size_t error_unit = 0;
+                if (xml_decoder_reserve(&decoder->output, &decoder->output_capacity, size / 2 * 3) != 0) {
+                    return xml_decoder_fail(decoder, XML_ERROR_MEMORY, "Out of memory", decoder->offset);
+                }
+                if (xml_utf16_to_utf8(data, size / 2, decoder->encoding == XML_ENCODING_UTF16BE, decoder->output, &output_size, &error_unit) != 0) {
+                    return xml_decoder_fail(decoder, XML_ERROR_ENCODING, "Unpaired UTF-16 surrogate", decoder->offset + 2 * error_unit);
+                }
+                output = decoder->output;
+                break;
+            }
+        }
+    }
+
+    decoder->offset += size;
+    if (xml_reader_feed(reader, output, output_size) != 0) {
+        return xml_decoder_fail(decoder, XML_ERROR_MEMORY, "Out of memory", decoder->offset);
+    }
+    return 0;
+}
+
+// Decodes a block that starts on a character boundary. Unless it is the
+// last one, a character it cuts short is kept in carry.
+static int xml_decoder_block(XMLDecoder *decoder, XMLReader *reader, const char *data, size_t size, int last) {
+    size_t tail = last ? 0 : xml_decoder_tail(decoder, data, size);
+    if (xml_decoder_convert(decoder, reader, data, size - tail) != 0) {
+        return -1;
+    }
+    if (xml_decoder_reserve(&decoder->carry, &decoder->carry_capacity, tail) != 0) {
+        return xml_decoder_fail(decoder, XML_ERROR_MEMORY, "Out of memory", decoder->offset);
+    }
+    // data may be the carry itself, which holds the head of the document
+    if (tail > 0) {
+        memmove(decoder->carry, data + size - tail, tail);
+    }
+    decoder->carry_size = tail;
+    return 0;
+}
+
+// Picks the encoding once the head of the document holds its declaration,
+// then decodes the head
+static int xml_decoder_detect(XMLDecoder *decoder, XMLReader *reader, int last) {
+    const char *head = decoder->carry;
+    size_t size = decoder->carry_size;
+    if (!last && size < XML_DECODER_HEAD_SIZE && xml_scan_find_byte(head, head + size, '>') == head + size) {
+        return 0;
+    }
+
+    size_t bom_size;
+    const char *declared;
+    size_t declared_size;
+    decoder->encoding = xml_encoding_detect(head, size, &bom_size, &declared, &declared_size);
+    decoder->detected = 1;
+    if (decoder->encoding == XML_ENCODING_OTHER && decoder->options->warning != NULL) {
+        XMLError warning;
+        memset(&warning, 0, sizeof(XMLError));
+        warning.code = XML_ERROR_UNSUPPORTED_ENCODING;
+        warning.message = "Unsupported encoding, the document is read as ASCII";
+        warning.offset = (size_t)(declared - head);
+        decoder->options->warning(decoder->options->warning_context, &warning);
+    }
+
+    decoder->offset = bom_size;
+    decoder->carry_size = 0;
+    return xml_decoder_block(decoder, reader, head + bom_size, size - bom_size, last);
+}
+
+static int xml_decoder_input(XMLDecoder *decoder, XMLReader *reader, const char *data, size_t size, int last) {
+    if (!decoder->detected) {
+        if (xml_decoder_reserve(&decoder->carry, &decoder->carry_capacity, decoder->carry_size + size) != 0) {
+            return xml_decoder_fail(decoder, XML_ERROR_MEMORY, "Out of memory", 0);
+        }
+        if (size > 0) {
+            memcpy(decoder->carry + decoder->carry_size, data, size);
+            decoder->carry_size += size;
+        }
+        return xml_decoder_detect(decoder, reader, last);
+    }
+
+    // finish the character the last block cut short, a byte at a time
+    while (decoder->carry_size > 0 && size > 0) {
+        if (xml_decoder_reserve(&decoder->carry, &decoder->carry_capacity, decoder->carry_size + 1) != 0) {
+            return xml_decoder_fail(decoder, XML_ERROR_MEMORY, "Out of memory", decoder->offset);
+        }
+        decoder->carry[decoder->carry_size++] = *data++;
+        size--;
+        if (xml_decoder_tail(decoder, decoder->carry, decoder->carry_size) == 0) {
+            size_t carry_size = decoder->carry_size;
+            decoder->carry_size = 0;
+            if (xml_decoder_convert(decoder, reader, decoder->carry, carry_size) != 0) {
+                return -1;
+            }
+        }
+    }
+    if (decoder->carry_size > 0) {
+        // the block ran out first
+        if (!last) {
+            return 0;
+        }
+        // cut short by the end of the input, which the conversion reports
+        size_t carry_size = decoder->carry_size;
+        decoder->carry_size = 0;
+        return xml_decoder_convert(decoder, reader, decoder->carry, carry_size);
+    }
+    return xml_decoder_block(decoder, reader, data, size, last);
+}
+
+int xml_decoder_feed(XMLDecoder *decoder, XMLReader *reader, const char *data, size_t size) {
+    return xml_decoder_input(decoder, reader, data, size, 0);
+}
+
+int xml_decoder_finish(XMLDecoder *decoder, XMLReader *reader) {
+    if (xml_decoder_input(decoder, reader, NULL, 0, 1) != 0) {
+        return -1;
+    }
+    xml_reader_finish(reader);
+    return 0;
+}
+
+static int xml_decode_error(XMLError *error, XMLErrorCode code, const char *message, int system_error) {
+    if (error->code == XML_ERROR_NONE) {
+        memset(error, 0, sizeof(XMLError));
+        error->code = code;
+        error->message = message;
+        error->system_error = system_error;
+    }
+    return -1;
+}
+
+// Hands every complete event to handler. 1 once the root element is closed
+// or handler stopped, 0 when more input is needed, -1 on error.
+static int xml_decode_drain(XMLReader *reader, XMLEventHandler handler, void *context, XMLError *error) {
+    XMLEvent event;
+    XMLReaderStatus status;
+    while ((status = xml_reader_next(reader, &event)) == XML_READER_EVENT) {
+        int handled = handler(context, &event);
+        if (handled != 0) {
+            return handled;
+        }
+    }
+    if (status == XML_READER_ERROR) {
+        if (error->code == XML_ERROR_NONE) {
+            *error = *xml_reader_last_error(reader);
+        }
+        return -1;
+    }
+    return status == XML_READER_DONE;
+}
+
+// Passes a block of input through the encoding stage to the reader, or the
+// end of the input when last is set, then drains the events
+static int xml_decode_block(XMLDecoder *decoder, XMLReader *reader, const char *data, size_t size, int last, XMLEventHandler handler, void *context, XMLError *error) {
+    int failed = last ? xml_decoder_finish(decoder, reader) : xml_decoder_feed(decoder, reader, data, size);
+    if (failed != 0) {
+        if (error->code == XML_ERROR_NONE) {
+            *error = decoder->error;
+        }
+        return -1;
+    }
+    return xml_decode_drain(reader, handler, context, error);
+}
+
+int xml_decode_buffer(const char *data, size_t len, const XMLLoadOptions *options, XMLEventHandler handler, void *context, XMLError *error) {
+    XMLReader *reader = xml_reader_new();
+    if (reader == NULL) {
+        return xml_decode_error(error, XML_ERROR_MEMORY, "Out of memory", 0);
+    }
+    XMLDecoder decoder;
+    xml_decoder_init(&decoder, options != NULL ? options : &xml_decoder_default_options);
+    int done = 0;
+    for (size_t offset = 0; offset < len && done == 0; offset += XML_DECODER_BLOCK_SIZE) {
+        size_t size = len - offset < XML_DECODER_BLOCK_SIZE ? len - offset : XML_DECODER_BLOCK_SIZE;
+        done = xml_decode_block(&decoder, reader, data + offset, size, 0, handler, context, error);
+    }
+    if (done == 0) {
+        done = xml_decode_block(&decoder, reader, NULL, 0, 1, handler, context, error);
+    }
+    xml_reader_free(reader);
+    xml_decoder_free(&decoder);
+    return done;
+}
+
+int xml_decode_file(const char *filepath, const XMLLoadOptions *options, XMLEventHandler handler, void *context, XMLError *error, size_t *bytes_read) {
+    size_t total = 0;
+    if (bytes_read != NULL) {
+        *bytes_read = 0;
+    }
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        return xml_decode_error(error, XML_ERROR_IO, "Could not read the file", errno);
+    }
+    char *block = malloc(XML_DECODER_BLOCK_SIZE);
+    XMLReader *reader = xml_reader_new();
+    if (block == NULL || reader == NULL) {
+        free(block);
+        xml_reader_free(reader);
+        close(fd);
+        return xml_decode_error(error, XML_ERROR_MEMORY, "Out of memory", 0);
+    }
+
+    XMLDecoder decoder;
+    xml_decoder_init(&decoder, options != NULL ? options : &xml_decoder_default_options);
+    int done = 0;
+    while (done == 0) {
+        ssize_t count = read(fd, block, XML_DECODER_BLOCK_SIZE);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            done = xml_decode_error(error, XML_ERROR_IO, "Could not read the file", errno);
+        } else {
+            total += (size_t)count;
+            done = xml_decode_block(&decoder, reader, block, (size_t)count, count == 0, handler, context, error);
+        }
+    }
+    free(block);
+    xml_reader_free(reader);
+    xml_decoder_free(&decoder);
+    close(fd);
+    if (bytes_read != NULL) {
+        *bytes_read = total;
+    }
+    return done;
+}
@@ -0,0 +1,134 @@
+#ifndef __XML_ENCODING__
+#define __XML_ENCODING__
+
+#include "xml-parser.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Encoding stage shared by the loads (xml-parser.c), which run it over the
+// whole source, and by the loads that go through the streaming reader
+// (flat documents and record splitting), which run it block by block with
+// xml_decode_buffer and xml_decode_file. Everything after it works on UTF-8.
+
+typedef enum XMLEncoding {
+    XML_ENCODING_UTF8, // also documents without a declared encoding
+    XML_ENCODING_UTF16LE,
+    XML_ENCODING_UTF16BE,
+    XML_ENCODING_LATIN1,
+    // declared, but not transcoded: only ASCII documents are accepted, they
+    // read the same in every encoding
+    XML_ENCODING_OTHER
+} XMLEncoding;
+
+/**
+ * @brief tell the encoding of a document from its first bytes
+ *
+ * The byte order mark wins over the declaration, then a UTF-16 declaration
+ * is recognized by its zero bytes. data must hold the XML declaration, if
+ * there is one, up to its '>'.
+ *
+ * @param bom_size Receives the size of the byte order mark, 0 without one
+ * @param declared Receives the encoding named by the declaration, NULL when
+ *        there is none or the document is UTF-16
+ * @param declared_size Receives the size of *declared
+ */
+XMLEncoding xml_encoding_detect(const char *data, size_t size, size_t *bom_size, const char **declared, size_t *declared_size);
+
+/**
+ * @brief write code as UTF-8 to out, which has room for 4 bytes
+ *
+ * @return The number of bytes written.
+ */
+size_t xml_utf8_encode(uint32_t code, char *out);
+
+/**
+ * @brief the size of size bytes of Latin-1 once transcoded to UTF-8
+ */
+size_t xml_latin1_utf8_size(const char *data, size_t size);
+
+/**
+ * @brief transcode size bytes of Latin-1 to UTF-8
+ *
+ * @param out Room for xml_latin1_utf8_size bytes
+ * @return The number of bytes written.
+ */
+size_t xml_latin1_to_utf8(const char *data, size_t size, char *out);
+
+/**
+ * @brief transcode units UTF-16 code units to UTF-8
+ *
+ * @param out Room for 3 bytes per unit
+ * @param out_size Receives the number of bytes written
+ * @param error_unit Receives the index of an unpaired surrogate on failure.
+ *        A high surrogate as the last unit is unpaired.
+ * @return 0 on success, -1 on an unpaired surrogate.
+ */
+int xml_utf16_to_utf8(const char *input, size_t units, int big_endian, char *out, size_t *out_size, size_t *error_unit);
+
+// Runs the encoding stage over input that comes in blocks and hands the
+// UTF-8 to a streaming reader. A character cut by the end of a block is
+// kept until the next one, so blocks can be of any size. Error offsets
+// count the bytes of the input.
+typedef struct XMLDecoder {
+    const XMLLoadOptions *options; // flags and the warning callback
+    int detected;
+    XMLEncoding encoding;
+    // the start of the document until its encoding is known, then the
+    // bytes of a character the last block cut short
+    char *carry;
+    size_t carry_size;
+    size_t carry_capacity;
+    char *output; // transcoded blocks
+    size_t output_capacity;
+    size_t offset; // input bytes decoded so far
+    XMLError error;
+} XMLDecoder;
+
+/**
+ * @brief set up a decoder, with XML_LOAD_SKIP_ENCODING it passes the bytes as they are
+ *
+ * @param options Must not be NULL, and outlive the decoder
+ */
+void xml_decoder_init(XMLDecoder *decoder, const XMLLoadOptions *options);
+
+void xml_decoder_free(XMLDecoder *decoder);
+
+/**
+ * @brief decode the next block of input and feed it to reader
+ *
+ * @return 0 on success, -1 with decoder->error set.
+ */
+int xml_decoder_feed(XMLDecoder *decoder, XMLReader *reader, const char *data, size_t size);
+
+/**
+ * @brief decode what is left of the input and finish reader
+ *
+ * @return 0 on success, -1 with decoder->error set.
+ */
+int xml_decoder_finish(XMLDecoder *decoder, XMLReader *reader);
+
+// Called for every event of a document run through xml_decode_buffer or
+// xml_decode_file. Returns 0 to go on, 1 to stop the load early without an
+// error, -1 on an error it has recorded itself.
+typedef int (*XMLEventHandler)(void *context, const XMLEvent *event);
+
+/**
+ * @brief run len bytes of data through the encoding stage and the streaming reader
+ *
+ * @param options The load options, or NULL for the defaults
+ * @param handler Gets every event, in document order
+ * @param error Receives the error of the encoding stage or of the reader,
+ *        unless it already holds one
+ * @return 1 once the root element is closed or handler stopped, -1 on error.
+ */
+int xml_decode_buffer(const char *data, size_t len, const XMLLoadOptions *options, XMLEventHandler handler, void *context, XMLError *error);
+
+/**
+ * @brief same as xml_decode_buffer, reading filepath a block at a time
+ *
+ * @param bytes_read If not NULL, receives the number of bytes read
+ */
+int xml_decode_file(const char *filepath, const XMLLoadOptions *options, XMLEventHandler handler, void *context, XMLError *error, size_t *bytes_read);
+
+#endif
@@ -0,0 +1,508 @@
+#define _DEFAULT_SOURCE
+
+#include "xml-parser.h"
+#include "xml-encoding.h"
+#include "xml-scan.h"
+
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Counting for XMLParseStats, compiled out like the parser's
+#ifndef XML_DISABLE_PARSE_STATS
+#define XML_FLAT_STATS(expression) ((void)(expression))
+#else
+#define XML_FLAT_STATS(expression) ((void)0)
+#endif
+
+typedef struct XMLFlatFrame {
+    uint32_t node;
+    uint32_t last_child;
+    uint32_t children; // the position of the next text run
+} XMLFlatFrame;
+
+// Builds a flat document from the events of the streaming reader. The arrays
+// grow by doubling and are trimmed to size once the document is complete.
+typedef struct XMLFlatBuilder {
+    XMLFlatDocument *document;
+    size_t nodes_capacity;
+    size_t attributes_capacity;
+    size_t texts_capacity;
+    size_t strings_capacity;
+    // the text runs of an element come between those of its children, they
+    // are only regrouped by element when that happened
+    int texts_grouped;
+
+    XMLFlatFrame *frames;
+    size_t depth;
+    size_t frames_capacity;
+    size_t max_depth;
+
+    // the first error. A failure that left none behind ran out of memory.
+    XMLError error;
+    XMLParseStats stats;
+} XMLFlatBuilder;
+
+static unsigned long long xml_flat_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ull + (unsigned long long)now.tv_nsec;
+}
+
+// Records the first error of the build. Events do not say where they come
+// from, so only the reader's errors have an offset.
+static int xml_flat_fail(XMLFlatBuilder *builder, XMLErrorCode code, const char *message) {
+    if (builder->error.code == XML_ERROR_NONE) {
+        builder->error.code = code;
+        builder->error.message = message;
+    }
+    return -1;
+}
+
+// Makes room for one more item of an array that holds size items
+static int xml_flat_reserve(void **items, size_t *capacity, size_t size, size_t item_size) {
+    if (size < *capacity) {
+        return 0;
+    }
+    size_t new_capacity = *capacity > 0 ? *capacity * 2 : 1024;
+    void *grown = realloc(*items, new_capacity * item_size);
+    if (grown == NULL) {
+        return -1;
+    }
+    *items = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Copies value into the strings, NUL-terminated, and returns its offset
+static int xml_flat_add_string(XMLFlatBuilder *builder, XMLStringView value, uint32_t *offset) {
+    XMLFlatDocument *document = builder->document;
+    size_t needed = document->strings_size + value.size + 1;
+    if (needed > UINT32_MAX) {
+        return xml_flat_fail(builder, XML_ERROR_LIMIT, "Flat documents hold at most 4 GiB of strings");
+    }
+    if (needed > builder->strings_capacity) {
+        size_t capacity = builder->strings_capacity > 0 ? builder->strings_capacity : 64 * 1024;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *strings = realloc(document->strings, capacity);
+        if (strings == NULL) {
+            return -1;
+        }
+        document->strings = strings;
+        builder->strings_capacity = capacity;
+    }
+    *offset = (uint32_t)document->strings_size;
+    if (value.size > 0) {
+        memcpy(document->strings + document->strings_size, value.data, value.size);
+    }
+    document->strings[document->strings_size + value.size] = '\0';
+    document->strings_size = needed;
+    return 0;
+}
+
+static unsigned int xml_flat_value_flags(XMLStringView value) {
+    const char *end = value.data + value.size;
+    return xml_scan_find_byte(value.data, end, '&') != end ? XML_VALUE_ENTITIES : 0;
+}
+
+static int xml_flat_start(XMLFlatBuilder *builder, const XMLEvent *event) {
+    XMLFlatDocument *document = builder->document;
+    if (builder->max_depth > 0 && builder->depth + 1 > builder->max_depth) {
+        return xml_flat_fail(builder, XML_ERROR_MAX_DEPTH, "Maximum nesting depth exceeded");
+    }
+    if (document->nodes_size >= XML_FLAT_NONE) {
+        return xml_flat_fail(builder, XML_ERROR_LIMIT, "Flat documents hold fewer than 4G elements");
+    }
+    if (xml_flat_reserve((void **)&document->nodes, &builder->nodes_capacity, document->nodes_size, sizeof(XMLFlatNode)) != 0
+        || xml_flat_reserve((void **)&builder->frames, &builder->frames_capacity, builder->depth, sizeof(XMLFlatFrame)) != 0) {
+        return -1;
+    }
+
+    uint32_t index = (uint32_t)document->nodes_size++;
+    XMLFlatNode *node = &document->nodes[index];
+    node->name = xml_name_table_add_view(document->names, event->name);
+    if (node->name == XML_ATOM_NONE) {
+        return -1;
+    }
+    node->parent = XML_FLAT_NONE;
+    node->first_child = XML_FLAT_NONE;
+    node->next_sibling = XML_FLAT_NONE;
+    node->subtree_end = XML_FLAT_NONE;
+    node->attributes = (uint32_t)document->attributes_size;
+    node->attributes_size = 0;
+    node->texts = 0;
+    node->texts_size = 0;
+
+    if (builder->depth > 0) {
+        XMLFlatFrame *parent = &builder->frames[builder->depth - 1];
+        node->parent = parent->node;
+        if (parent->last_child == XML_FLAT_NONE) {
+            document->nodes[parent->node].first_child = index;
+        } else {
+            document->nodes[parent->last_child].next_sibling = index;
+        }
+        parent->last_child = index;
+        parent->children++;
+    }
+
+    XMLFlatFrame *frame = &builder->frames[builder->depth++];
+    frame->node = index;
+    frame->last_child = XML_FLAT_NONE;
+    frame->children = 0;
+    XML_FLAT_STATS(builder->stats.elements++);
+    XML_FLAT_STATS(builder->stats.max_depth = builder->depth > builder->stats.max_depth ? builder->depth : builder->stats.max_depth);
+    return 0;
+}
+
+static int xml_flat_attribute_event(XMLFlatBuilder *builder, const XMLEvent *event) {
+    XMLFlatDocument *document = builder->document;
+    if (xml_flat_reserve((void **)&document->attributes, &builder->attributes_capacity, document->attributes_size, sizeof(XMLFlatAttribute)) != 0) {
+        return -1;
+    }
+    XMLFlatAttribute *attribute = &document->attributes[document->attributes_size];
+    attribute->name = xml_name_table_add_view(document->names, event->name);
+    if (attribute->name == XML_ATOM_NONE || xml_flat_add_string(builder, event->value, &attribute->value) != 0) {
+        return -1;
+    }
+    attribute->value_size = (uint32_t)event->value.size;
+    attribute->flags = xml_flat_value_flags(event->value);
+    document->attributes_size++;
+    document->nodes[builder->frames[builder->depth - 1].node].attributes_size++;
+    XML_FLAT_STATS(builder->stats.attributes++);
+    return 0;
+}
+
+static int xml_flat_text_event(XMLFlatBuilder *builder, const XMLEvent *event) {
+    XMLFlatDocument *document = builder->document;
+    if (xml_flat_reserve((void **)&document->texts, &builder->texts_capacity, document->texts_size, sizeof(XMLFlatText)) != 0) {
+        return -1;
+    }
+    const XMLFlatFrame *frame = &builder->frames[builder->depth - 1];
+    XMLFlatText *text = &document->texts[document->texts_size];
+    if (xml_flat_add_string(builder, event->value, &text->text) != 0) {
+        return -1;
+    }
+    text->node = frame->node;
+    text->size = (uint32_t)event->value.size;
+    text->position = frame->children;
+    text->flags = event->type == XML_EVENT_CDATA ? XML_VALUE_CDATA : xml_flat_value_flags(event->value);
+    if (document->texts_size > 0 && text->node < document->texts[document->texts_size - 1].node) {
+        builder->texts_grouped = 0;
+    }
+    document->texts_size++;
+    XML_FLAT_STATS(event->type == XML_EVENT_CDATA ? builder->stats.cdata_sections++ : builder->stats.texts++);
+    return 0;
+}
+
+// The XMLEventHandler of the loads, context is the builder
+static int xml_flat_event(void *context, const XMLEvent *event) {
+    XMLFlatBuilder *builder = context;
+    switch (event->type) {
+        case XML_EVENT_START_ELEMENT:
+            return xml_flat_start(builder, event);
+        case XML_EVENT_ATTRIBUTE:
+            return xml_flat_attribute_event(builder, event);
+        case XML_EVENT_TEXT:
+        case XML_EVENT_CDATA:
+            return xml_flat_text_event(builder, event);
+        case XML_EVENT_COMMENT:
+            XML_FLAT_STATS(builder->stats.comments++);
+            return 0;
+        case XML_EVENT_END_ELEMENT: {
+            XMLFlatDocument *document = builder->document;
+            document->nodes[builder->frames[--builder->depth].node].subtree_end = (uint32_t)document->nodes_size;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Counting sort of the text runs by element, stable so the runs of each
+// element stay in document order
+static int xml_flat_group_texts(XMLFlatDocument *document) {
+    XMLFlatText *grouped = malloc(document->texts_size * sizeof(XMLFlatText));
+    if (grouped == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < document->texts_size; i++) {
+        document->nodes[document->texts[i].node].texts_size++;
+    }
+    uint32_t start = 0;
+    for (size_t i = 0; i < document->nodes_size; i++) {
+        document->nodes[i].texts = start;
+        start += document->nodes[i].texts_size;
+    }
+    // texts serves as the fill cursor of each element, then is moved back
+    for (size_t i = 0; i < document->texts_size; i++) {
+        grouped[document->nodes[document->texts[i].node].texts++] = document->texts[i];
+    }
+    for (size_t i = 0; i < document->nodes_size; i++) {
+        document->nodes[i].texts -= document->nodes[i].texts_size;
+    }
+    free(document->texts);
+    document->texts = grouped;
+    return 0;
+}
+
+// Same as xml_flat_group_texts when the runs are already grouped
+static void xml_flat_index_texts(XMLFlatDocument *document) {
+    for (size_t i = document->texts_size; i > 0; i--) {
+        XMLFlatNode *node = &document->nodes[document->texts[i - 1].node];
+        node->texts = (uint32_t)(i - 1);
+        node->texts_size++;
+    }
+}
+
+// Gives back what the doubling left unused, the arrays stay as they are if
+// that fails
+static void *xml_flat_trim(void *items, size_t size) {
+    if (items == NULL || size == 0) {
+        return items;
+    }
+    void *trimmed = realloc(items, size);
+    return trimmed != NULL ? trimmed : items;
+}
+
+static int xml_flat_finish(XMLFlatBuilder *builder) {
+    XMLFlatDocument *document = builder->document;
+    if (builder->texts_grouped) {
+        xml_flat_index_texts(document);
+    } else if (xml_flat_group_texts(document) != 0) {
+        return -1;
+    }
+    document->nodes = xml_flat_trim(document->nodes, document->nodes_size * sizeof(XMLFlatNode));
+    document->attributes = xml_flat_trim(document->attributes, document->attributes_size * sizeof(XMLFlatAttribute));
+    document->texts = xml_flat_trim(document->texts, document->texts_size * sizeof(XMLFlatText));
+    document->strings = xml_flat_trim(document->strings, document->strings_size);
+    return 0;
+}
+
+// Fills in the error of a load that stopped before it had a builder
+static void xml_flat_load_error(const XMLLoadOptions *options, XMLErrorCode code, const char *message, int system_error) {
+    if (options != NULL && options->error != NULL) {
+        memset(options->error, 0, sizeof(XMLError));
+        options->error->code = code;
+        options->error->message = message;
+        options->error->system_error = system_error;
+    }
+}
+
+static int xml_flat_builder_init(XMLFlatBuilder *builder, const XMLLoadOptions *options) {
+    memset(builder, 0, sizeof(XMLFlatBuilder));
+    builder->texts_grouped = 1;
+    builder->document = calloc(1, sizeof(XMLFlatDocument));
+    if (builder->document == NULL) {
+        return -1;
+    }
+    if (options != NULL && options->names != NULL) {
+        builder->document->names = options->names;
+        builder->document->shared_names = 1;
+    } else {
+        builder->document->names = xml_name_table_new();
+        if (builder->document->names == NULL) {
+            free(builder->document);
+            return -1;
+        }
+    }
+    builder->max_depth = options != NULL ? options->max_depth : 0;
+    return 0;
+}
+
+// Frees the builder, and the document unless it was completed. Returns the
+// completed document or NULL.
+static XMLFlatDocument *xml_flat_builder_end(XMLFlatBuilder *builder, int done, const XMLLoadOptions *options, unsigned long long started) {
+    free(builder->frames);
+    (void)started;
+    if (done == 1 && xml_flat_finish(builder) != 0) {
+        done = -1;
+    }
+    if (done != 1 && builder->error.code == XML_ERROR_NONE) {
+        builder->error.code = XML_ERROR_MEMORY;
+        builder->error.message = "Out of memory";
+    }
+    if (options != NULL && options->error != NULL) {
+        *options->error = builder->error;
+    }
+    if (options != NULL && options->stats != NULL) {
+        *options->stats = builder->stats;
+        XML_FLAT_STATS(options->stats->total_ns = xml_flat_clock() - started);
+    }
+    if (done != 1) {
+        xml_flat_free(builder->document);
+        return NULL;
+    }
+    return builder->document;
+}
+
+XMLFlatDocument *xml_flat_load_buffer(const char *data, size_t len, const XMLLoadOptions *options) {
+    unsigned long long started = xml_flat_clock();
+    XMLFlatBuilder builder;
+    if (xml_flat_builder_init(&builder, options) != 0) {
+        xml_flat_load_error(options, XML_ERROR_MEMORY, "Out of memory", 0);
+        return NULL;
+    }
+    int done = xml_decode_buffer(data, len, options, xml_flat_event, &builder, &builder.error);
+    XML_FLAT_STATS(builder.stats.bytes_read = len);
+    return xml_flat_builder_end(&builder, done, options, started);
+}
+
+XMLFlatDocument *xml_flat_load(const char *filepath, const XMLLoadOptions *options) {
+    unsigned long long started = xml_flat_clock();
+    XMLFlatBuilder builder;
+    if (xml_flat_builder_init(&builder, options) != 0) {
+        xml_flat_load_error(options, XML_ERROR_MEMORY, "Out of memory", 0);
+        return NULL;
+    }
+    size_t bytes_read;
+    int done = xml_decode_file(filepath, options, xml_flat_event, &builder, &builder.error, &bytes_read);
+    XML_FLAT_STATS(builder.stats.bytes_read = bytes_read);
+    return xml_flat_builder_end(&builder, done, options, started);
+}
+
+// Hands the runs of the innermost open element that come before its next
+// child to the builder, *cursor is its first run not handed over yet
+static int xml_flat_tree_texts(XMLFlatBuilder *builder, const XMLText **cursor, size_t position) {
+    for (; *cursor != NULL && (*cursor)->position <= position; *cursor = (*cursor)->next) {
+        XMLEvent event;
+        event.type = ((*cursor)->flags & XML_VALUE_CDATA) ? XML_EVENT_CDATA : XML_EVENT_TEXT;
+        event.value.data = (*cursor)->text;
+        event.value.size = (*cursor)->size;
+        event.depth = (int)builder->depth;
+        if (xml_flat_text_event(builder, &event) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Replays the tree below element as reader events, in document order. The
+// walk follows the parent links, only the text cursors need a stack.
+static int xml_flat_tree(XMLFlatBuilder *builder, XMLElement *element) {
+    const XMLText **cursors = NULL;
+    size_t cursors_capacity = 0;
+    XMLElement *root = element;
+
+    while (element != NULL) {
+        XMLEvent event;
+        event.type = XML_EVENT_START_ELEMENT;
+        event.name.data = element->name;
+        event.name.size = element->name_size;
+        event.value.data = NULL;
+        event.value.size = 0;
+        event.depth = (int)builder->depth + 1;
+        if (xml_flat_start(builder, &event) != 0) {
+            break;
+        }
+        event.type = XML_EVENT_ATTRIBUTE;
+        int failed = 0;
+        for (int i = 0; i < element->attributes_size && !failed; i++) {
+            event.name.data = element->attributes[i].name;
+            event.name.size = element->attributes[i].name_size;
+            event.value.data = element->attributes[i].value;
+            event.value.size = element->attributes[i].value_size;
+            failed = xml_flat_attribute_event(builder, &event) != 0;
+        }
+        if (failed || xml_flat_reserve((void **)&cursors, &cursors_capacity, builder->depth - 1, sizeof(const XMLText *)) != 0) {
+            break;
+        }
+        cursors[builder->depth - 1] = element->texts;
+        if (xml_flat_tree_texts(builder, &cursors[builder->depth - 1], 0) != 0) {
+            break;
+        }
+
+        XMLElement *child = xml_element_children(element);
+        if (child != NULL) {
+            element = child;
+            continue;
+        }
+        // close elements up to the first one with a sibling left
+        while (element != NULL) {
+            if (xml_flat_tree_texts(builder, &cursors[builder->depth - 1], SIZE_MAX) != 0) {
+                failed = 1;
+                break;
+            }
+            event.type = XML_EVENT_END_ELEMENT;
+            event.name.data = element->name;
+            event.name.size = element->name_size;
+            xml_flat_event(builder, &event);
+            if (element == root) {
+                free(cursors);
+                return 0;
+            }
+            const XMLFlatFrame *parent = &builder->frames[builder->depth - 1];
+            if (xml_flat_tree_texts(builder, &cursors[builder->depth - 1], parent->children) != 0) {
+                failed = 1;
+                break;
+            }
+            if (element->next_sibling != NULL) {
+                element = element->next_sibling;
+                break;
+            }
+            element = element->parent;
+        }
+        if (failed) {
+            break;
+        }
+    }
+    free(cursors);
+    return -1;
+}
+
+XMLFlatDocument *xml_flat_from_file(XMLFile *file) {
+    if (file == NULL || file->root == NULL) {
+        return NULL;
+    }
+    XMLFlatBuilder builder;
+    if (xml_flat_builder_init(&builder, NULL) != 0) {
+        return NULL;
+    }
+    int done = xml_flat_tree(&builder, file->root) == 0 ? 1 : -1;
+    return xml_flat_builder_end(&builder, done, NULL, 0);
+}
+
+void xml_flat_free(XMLFlatDocument *document) {
+    if (document == NULL) {
+        return;
+    }
+    if (!document->shared_names) {
+        xml_name_table_free(document->names);
+    }
+    if (document->mapping != NULL) {
+        munmap(document->mapping, document->mapping_size);
+    } else {
+        free(document->nodes);
+        free(document->attributes);
+        free(document->texts);
+        free(document->strings);
+    }
+    free(document);
+}
+
+XMLStringView xml_flat_string(const XMLFlatDocument *document, uint32_t offset, uint32_t size) {
+    XMLStringView view;
+    view.data = document->strings + offset;
+    view.size = size;
+    return view;
+}
+
+uint32_t xml_flat_child(const XMLFlatDocument *document, uint32_t node, XMLAtom atom) {
+    uint32_t child = document->nodes[node].first_child;
+    while (child != XML_FLAT_NONE && document->nodes[child].name != atom) {
+        child = document->nodes[child].next_sibling;
+    }
+    return child;
+}
+
+const XMLFlatAttribute *xml_flat_attribute(const XMLFlatDocument *document, uint32_t node, XMLAtom atom) {
+    const XMLFlatNode *flat = &document->nodes[node];
+    for (uint32_t i = 0; i < flat->attributes_size; i++) {
+        if (document->attributes[flat->attributes + i].name == atom) {
+            return &document->attributes[flat->attributes + i];
+        }
+    }
+    return NULL;
+}
@@ -1,594 +1,2989 @@
+#define _DEFAULT_SOURCE
+
 #include "xml-parser.h"
+#include "xml-encoding.h"
+#include "xml-scan.h"
+#include "xml-tokenizer.h"
 
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-// Easy function to load contents from a file given its path using glibc
-char *get_file_content(const char *filepath) {
-    FILE *file = fopen(filepath, "r");
-    if(file == NULL) {
-        fprintf(stderr,"Could open file (%s) to read\n",filepath);
-        return NULL;
-    }
-    
-    fseek(file, 0L, SEEK_END);
-    long size_file = ftell(file);
-    rewind(file);
-    
-    char *content = malloc(sizeof(char)*(size_file + 1));
-    content[size_file] = '\0';
-    for (int i = 0; i < size_file; i++) {
-        content[i] = fgetc(file);
-    }
-    
-    fclose(file);
-    
-    return content;
-}
-
-// recursive function, could give stackoverflow for really deep nested XML elements
-void xml_free_element_recursive(XMLElement* element) {
-    if(element == NULL) return;
-
-    free(element->name);
-    free(element->text_content);
-
-    XMLAttribute *attr = element->attributes;
-    while(attr != NULL) {
-        XMLAttribute *next = attr->next;
-        free(attr->name);
-        free(attr->value);
-        free(attr);
-        attr = next;
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define XML_READ_BLOCK_SIZE (1 << 20)
+
+// Raw bytes of a document. Files and copies are followed by a '\0', borrowed
+// caller buffers are not, so the parser never looks past data + size.
+typedef struct XMLSource {
+    char *data;
+    size_t size;
+    // the mapping or buffer data lies in, data starts past a byte order mark
+    char *region;
+    size_t mapped_size; // 0 when region is a heap buffer
+    int borrowed; // region belongs to the caller (XML_LOAD_BORROW_BUFFER)
+} XMLSource;
+
+// Maps a regular file without copying it. The region is reserved one byte larger
+// than the file (rounded up to a page) so there is always a zero byte after the
+// last file byte, even when the size is an exact multiple of the page size.
+static int xml_source_map(XMLSource *source, int fd, size_t size) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapped_size = (size + 1 + page_size - 1) & ~(page_size - 1);
+
+    // writable private mapping: in-situ parsing terminates strings in place and
+    // only the pages it touches get copied
+    char *region = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        return -1;
     }
 
-    XMLElement *current_child = element->children;
-    while (current_child != NULL) {
-        XMLElement *next_sibling = current_child->next_sibling;
-        xml_free_element_recursive(current_child);  
-        current_child = next_sibling;
+    if (mmap(region, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(region, mapped_size);
+        return -1;
     }
 
-    free(element);
-}
+    madvise(region, size, MADV_SEQUENTIAL);
 
-void xml_free_element(XMLElement* element) {
-    xml_free_element_recursive(element); // we use recursion for now
+    source->data = region;
+    source->size = size;
+    source->region = region;
+    source->mapped_size = mapped_size;
+    source->borrowed = 0;
+    return 0;
 }
 
-void ignore_values(char **cursor, int values[], int values_size) {
-    if (cursor == NULL || *cursor == NULL || **cursor == '\0') {
-        return;
-    }
-
-    if (values_size <= 0) {
-        return;
+// Fallback for pipes, character devices and files that cannot be mapped: read in
+// large blocks instead of a byte at a time. size_hint is only used to size the
+// first allocation.
+static int xml_source_read(XMLSource *source, int fd, size_t size_hint) {
+    size_t capacity = size_hint > 0 ? size_hint + 1 : XML_READ_BLOCK_SIZE;
+    size_t size = 0;
+    char *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        return -1;
     }
 
-    while(**cursor != '\0') {
-        int exist_values = 0;
-        
-        for(int i = 0; i < values_size; i++) {
-            if(**cursor == values[i]) {
-                exist_values = 1;
-                break;
+    while (1) {
+        if (capacity - size < 2) {
+            size_t new_capacity = capacity * 2;
+            char *new_buffer = realloc(buffer, new_capacity);
+            if (new_buffer == NULL) {
+                free(buffer);
+                return -1;
             }
+            buffer = new_buffer;
+            capacity = new_capacity;
         }
 
-        if(exist_values) {
-            (*cursor)++;
-        } else {
-            break;
+        size_t to_read = capacity - size - 1;
+        if (to_read > XML_READ_BLOCK_SIZE) {
+            to_read = XML_READ_BLOCK_SIZE;
         }
-    }
-}
 
-// TODO: there could be functions that implement each part of the parsing so it doesnt have that much LOC
-// Also it doesnt handle CDATA
-XMLElement *parse_xml_element(char **cursor, XMLElement* parent_element) {
-    char *current_pos = *cursor;
-    
-    int skip_values[] = {' ', '\n', '\t', '\r'};
-
-    ignore_values(&current_pos,skip_values,sizeof(skip_values)/sizeof(skip_values[0]));
-
-    if(*current_pos != '<') {
-        perror("Error: Expected '<' to start an element.\n");
-        *cursor = current_pos; 
-        return NULL;
+        ssize_t count = read(fd, buffer + size, to_read);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            free(buffer);
+            return -1;
+        }
+        if (count == 0) break;
+        size += (size_t)count;
     }
 
-    current_pos++;
-
-    ignore_values(&current_pos,skip_values,sizeof(skip_values)/sizeof(skip_values[0]));
+    buffer[size] = '\0';
+    source->data = buffer;
+    source->size = size;
+    source->region = buffer;
+    source->mapped_size = 0;
+    source->borrowed = 0;
+    return 0;
+}
 
-    char *name_start = current_pos;
-    while(*current_pos && *current_pos != ' ' && *current_pos != '\t' && *current_pos != '\n' && *current_pos != '\r' && *current_pos != '>' && *current_pos != '/') {
-        current_pos++;
+// Load contents from an open file. Regular files are memory mapped unless
+// XML_LOAD_NO_MMAP is set, everything else is read in blocks. The descriptor is
+// left open.
+static int xml_source_open_fd(XMLSource *source, int fd, unsigned int flags) {
+    source->data = NULL;
+    source->size = 0;
+    source->region = NULL;
+    source->mapped_size = 0;
+    source->borrowed = 0;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        return -1;
     }
 
-    long size_name = current_pos - name_start;
-    if (size_name == 0) {
-        perror("Error: Element name is empty.\n");
-        *cursor = current_pos;
-        return NULL;
-    }
-    
-    XMLElement *element = malloc(sizeof(XMLElement));
-    if (!element) {
-        perror("Malloc failed for XMLElement");
-        *cursor = current_pos;
-        return NULL;
+    int result = -1;
+    size_t size_hint = 0;
+    if (S_ISREG(info.st_mode)) {
+        size_hint = (size_t)info.st_size;
+        // empty regular files are often synthetic (procfs, sysfs), read those
+        if (info.st_size > 0 && !(flags & XML_LOAD_NO_MMAP)) {
+            result = xml_source_map(source, fd, (size_t)info.st_size);
+        }
     }
-    
-    element->name = NULL;
-    element->text_content = NULL;
-    element->attributes = NULL;
-    element->attributes_size = 0;
-    element->parent = parent_element;
-    element->children = NULL;
-    element->next_sibling = NULL;
 
-    element->name = malloc(size_name + 1);
-    if (!element->name) {
-        perror("Malloc failed for element name");
-        free(element);
-        *cursor = current_pos;
-        return NULL;
+    if (result != 0) {
+        result = xml_source_read(source, fd, size_hint);
     }
+    return result;
+}
 
-    strncpy(element->name, name_start, size_name);
-    element->name[size_name] = '\0';
-
-    while(*current_pos == ' ' || *current_pos == '\n' || *current_pos == '\t' || *current_pos == '\r') {
-        current_pos++;
+// Load contents from a file given its path
+static int xml_source_open(XMLSource *source, const char *filepath, unsigned int flags) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        return -1;
     }
 
-    XMLAttribute *last_attr = NULL;
-
-    while(*current_pos != '/' && *current_pos != '>' && *current_pos != '\0') {
-        char *attr_name_start = current_pos;
-        while(*current_pos && *current_pos != '=' && *current_pos != ' ' && *current_pos != '\t' && *current_pos != '\n' && *current_pos != '\r') {
-            current_pos++;
-        }
-        long size_attr_name = current_pos - attr_name_start;
-        if (size_attr_name == 0) {
-            fprintf(stderr, "Error: Attribute name is empty for element %s.\n", element->name);
-            *cursor = current_pos;
-            xml_free_element(element);
-            return NULL;
-        }
-
-        char *attr_name_str = malloc(size_attr_name + 1);
-        if (!attr_name_str) { xml_free_element(element); *cursor = current_pos; return NULL; }
-        strncpy(attr_name_str, attr_name_start, size_attr_name);
-        attr_name_str[size_attr_name] = '\0';
-
-        while(*current_pos == ' ' || *current_pos == '\t' || *current_pos == '\n' || *current_pos == '\r') {
-            current_pos++;
-        }
-
-        if (*current_pos != '=') {
-            fprintf(stderr, "Error: Expected '=' after attribute name '%s' for element %s.\n", attr_name_str, element->name);
-            free(attr_name_str);
-            xml_free_element(element);
-            *cursor = current_pos;
-            return NULL;
-        }
+    int result = xml_source_open_fd(source, fd, flags);
+    close(fd);
+    return result;
+}
 
-        current_pos++;
+// Wrap a caller buffer. It is only copied (once, with a terminator) when the
+// document has to own a writable copy for in-situ parsing.
+static int xml_source_open_buffer(XMLSource *source, const char *data, size_t size, unsigned int flags) {
+    source->size = size;
+    source->mapped_size = 0;
 
-        while(*current_pos == ' ' || *current_pos == '\t' || *current_pos == '\n' || *current_pos == '\r') {
-            current_pos++;
+    if ((flags & XML_LOAD_IN_SITU) && !(flags & XML_LOAD_BORROW_BUFFER)) {
+        source->data = malloc(size + 1);
+        if (source->data == NULL) {
+            return -1;
         }
+        memcpy(source->data, data, size);
+        source->data[size] = '\0';
+        source->region = source->data;
+        source->borrowed = 0;
+        return 0;
+    }
 
-        if (*current_pos != '\"' && *current_pos != '\'') {
-            fprintf(stderr, "Error: Attribute value for '%s' must start with '\"' or \"'\".\n", attr_name_str);
-            free(attr_name_str);
-            xml_free_element(element);
-            *cursor = current_pos;
-            return NULL;
-        }
-        char quote_char = *current_pos;
-        current_pos++;
+    // read only, the parser never writes to a source it does not own
+    source->data = (char *)data;
+    source->region = source->data;
+    source->borrowed = 1;
+    return 0;
+}
 
-        char *attr_value_start = current_pos;
-        while(*current_pos && *current_pos != quote_char) {
-            // TODO: handle escaped quotes within the value
-            current_pos++;
-        }
-        if (*current_pos != quote_char) {
-            fprintf(stderr, "Error: Attribute value for '%s' not terminated with %c.\n", attr_name_str, quote_char);
-            free(attr_name_str);
-            xml_free_element(element);
-            *cursor = current_pos;
-            return NULL;
-        }
-        long size_attr_value = current_pos - attr_value_start;
+static void xml_source_close(XMLSource *source) {
+    if (source->region == NULL) {
+        return;
+    }
 
-        char *attr_value_str = malloc(size_attr_value + 1);
-        if (!attr_value_str) { free(attr_name_str); xml_free_element(element); *cursor = current_pos; return NULL; }
-        strncpy(attr_value_str, attr_value_start, size_attr_value);
-        attr_value_str[size_attr_value] = '\0';
+    if (source->mapped_size > 0) {
+        munmap(source->region, source->mapped_size);
+    } else if (!source->borrowed) {
+        free(source->region);
+    }
+    source->data = NULL;
+    source->size = 0;
+    source->region = NULL;
+    source->mapped_size = 0;
+}
 
-        current_pos++;
+// Errors and warnings (XMLError). Nothing is printed: the first error of a
+// load is recorded with its offset from the start of the source region, and
+// lines are only counted when the caller asks for them.
 
-        XMLAttribute *new_attr = malloc(sizeof(XMLAttribute));
-        if (!new_attr) { xml_free_element(element); free(attr_name_str); free(attr_value_str); *cursor = current_pos; return NULL; }
-        new_attr->name = attr_name_str;
-        new_attr->value = attr_value_str;
-        new_attr->next = NULL;
+// Records an error unless one was recorded already. error may be NULL.
+static void xml_error_set(XMLError *error, XMLErrorCode code, const char *message, size_t offset) {
+    if (error == NULL || error->code != XML_ERROR_NONE) {
+        return;
+    }
+    error->code = code;
+    error->message = message;
+    error->offset = offset;
+    error->system_error = 0;
+    error->line = 0;
+    error->column = 0;
+}
 
-        if (element->attributes == NULL) {
-            element->attributes = new_attr;
-        } else {
-            last_attr->next = new_attr;
-        }
-        last_attr = new_attr;
-        element->attributes_size++;
+// Records the failure of a system call, from errno
+static void xml_error_set_system(XMLError *error, const char *message) {
+    int system_error = errno;
+    if (error == NULL || error->code != XML_ERROR_NONE) {
+        return;
+    }
+    xml_error_set(error, system_error == ENOMEM ? XML_ERROR_MEMORY : XML_ERROR_IO, message, 0);
+    error->system_error = system_error;
+}
 
-        while(*current_pos == ' ' || *current_pos == '\n' || *current_pos == '\t' || *current_pos == '\r') {
-            current_pos++;
-        }
+void xml_error_locate(XMLError *error, const char *data, size_t size) {
+    const char *end = data + (error->offset < size ? error->offset : size);
+    const char *line_start = data;
+    size_t line = 1;
+    for (const char *newline = xml_scan_find_byte(data, end, '\n'); newline != end; newline = xml_scan_find_byte(newline + 1, end, '\n')) {
+        line++;
+        line_start = newline + 1;
     }
+    error->line = line;
+    error->column = (size_t)(end - line_start) + 1;
+}
 
-    if (*current_pos == '/') {
-        current_pos++;
-        if (*current_pos != '>') {
-            fprintf(stderr, "Error: Expected '>' after '/' in self-closing tag for element %s.\n", element->name);
-            xml_free_element(element);
-            *cursor = current_pos;
-            return NULL;
-        }
-        current_pos++;
-        element->text_content = NULL; 
-        *cursor = current_pos;
-        return element;
+// Locates error in source when the load asked for it (XML_LOAD_ERROR_LOCATION)
+static void xml_source_locate(XMLError *error, const XMLSource *source, unsigned int flags) {
+    if (error != NULL && error->code != XML_ERROR_NONE && (flags & XML_LOAD_ERROR_LOCATION)) {
+        xml_error_locate(error, source->region, (size_t)(source->data + source->size - source->region));
+    }
+}
 
-    } else if (*current_pos == '>') {
-        current_pos++;
+// Hands a warning about the byte at offset of the source region to the
+// load's callback, if it has one
+static void xml_source_warn(const XMLSource *source, const XMLLoadOptions *options, XMLErrorCode code, const char *message, size_t offset) {
+    if (options->warning == NULL) {
+        return;
+    }
+    XMLError warning;
+    warning.code = XML_ERROR_NONE;
+    xml_error_set(&warning, code, message, offset);
+    xml_source_locate(&warning, source, options->flags);
+    options->warning(options->warning_context, &warning);
+}
 
-        XMLElement *last_child = NULL;
-        while (1) {
-            char *temp_pos_before_content = current_pos;
-            while(*current_pos == ' ' || *current_pos == '\n' || *current_pos == '\t' || *current_pos == '\r') {
-                current_pos++;
-            }
+// Encoding stage, run on every source before it is parsed (the detection
+// and the transcoders are in xml-encoding.c). The parser works on UTF-8: a
+// byte order mark is dropped, UTF-16 and Latin-1 documents are transcoded
+// into a new buffer, and UTF-8 is validated where it lies. ASCII and valid
+// UTF-8 are never copied.
+
+// Replaces the bytes of source with the size bytes of buffer, a heap buffer
+// with room for the terminator
+static void xml_source_adopt(XMLSource *source, char *buffer, size_t size) {
+    buffer[size] = '\0';
+    xml_source_close(source);
+    source->data = buffer;
+    source->size = size;
+    source->region = buffer;
+    source->borrowed = 0;
+}
 
-            if (*current_pos == '\0') {
-                fprintf(stderr, "Error: Unexpected end of input while parsing content of %s.\n", element->name);
-                xml_free_element(element);
-                *cursor = current_pos;
-                return NULL;
-            }
+static int xml_source_from_latin1(XMLSource *source, XMLError *error) {
+    size_t size = xml_latin1_utf8_size(source->data, source->size);
+    if (size == source->size) {
+        return 0;
+    }
+    char *buffer = malloc(size + 1);
+    if (buffer == NULL) {
+        xml_error_set(error, XML_ERROR_MEMORY, "Out of memory", 0);
+        return -1;
+    }
+    xml_latin1_to_utf8(source->data, source->size, buffer);
+    xml_source_adopt(source, buffer, size);
+    return 0;
+}
 
-            if (*current_pos == '<') { 
-                if (*(current_pos + 1) == '/') { 
-                    current_pos += 2;
-                    while(*current_pos == ' ' || *current_pos == '\n' || *current_pos == '\t' || *current_pos == '\r') {
-                        current_pos++;
-                    }
-                    char *closing_name_start = current_pos;
-                    while(*current_pos && *current_pos != '>') {
-                        current_pos++;
-                    }
-                    if (*current_pos != '>') {
-                        fprintf(stderr, "Error: Closing tag for %s not terminated with '>'.\n", element->name);
-                        xml_free_element(element);
-                        *cursor = current_pos;
-                        return NULL;
-                    }
-                    long size_closing_name = current_pos - closing_name_start;
-
-                    // Optional: trim trailing whitespace from closing_name_start up to size_closing_name
-                    // before strncmp to be more lenient.
-                    if (strncmp(element->name, closing_name_start, size_closing_name) == 0 && element->name[size_closing_name] == '\0') {
-                        current_pos++;
-                        *cursor = current_pos;
-                        return element;
-                    } else {
-                        char temp_closing_name[size_closing_name + 1];
-                        strncpy(temp_closing_name, closing_name_start, size_closing_name);
-                        temp_closing_name[size_closing_name] = '\0';
-                        fprintf(stderr, "Error: Mismatch in closing tag. Expected </%s>, got </%s>.\n", element->name, temp_closing_name);
-                        xml_free_element(element);
-                        *cursor = current_pos;
-                        return NULL; 
-                    }
-                } else if (*(current_pos + 1) == '!') { 
-                    if (strncmp(current_pos, "<!--", 4) == 0) {
-                        current_pos += 4;
-                        char *comment_end = strstr(current_pos, "-->");
-                        if (!comment_end) {
-                            perror("Error: Unterminated comment.\n");
-                            xml_free_element(element);
-                            *cursor = current_pos;
-                            return NULL;
-                        }
-                        current_pos = comment_end + 3; 
-                        continue; // go back to look for next child/text/closing tag
-                    }
-                    else if (strncmp(current_pos, "<![CDATA[", 9) == 0) {
-                        current_pos += 9;
-                        char *cdata_end = strstr(current_pos, "]]>");
-                        if (!cdata_end) {
-                            perror("Error: Unterminated CDATA section.\n");
-                            xml_free_element(element);
-                            *cursor = current_pos;
-                            return NULL;
-                        }
-                        // TODO: capture CDATA as text here.
-                        current_pos = cdata_end + 3; 
-                        continue;
-                    } else {
-                        perror("Error: Unsupported XML construct starting with '<!'.\n");
-                        xml_free_element(element);
-                        *cursor = current_pos;
-                        return NULL;
-                    }
-                } else {
-                    XMLElement *child = parse_xml_element(&current_pos, element); // Recursive call
-                    if (!child) {
-                        fprintf(stderr, "Error parsing child element of %s.\n", element->name);
-                        xml_free_element(element);
-                        return NULL; 
-                    }
-
-                    if (element->children == NULL) {
-                        element->children = child;
-                    } else {
-                        last_child->next_sibling = child;
-                    }
-                    last_child = child;
-                }
-            } else { 
-                char *text_start = temp_pos_before_content; 
-                char *text_end = current_pos; 
+static int xml_source_from_utf16(XMLSource *source, size_t offset, int big_endian, XMLError *error) {
+    if ((source->size - offset) % 2 != 0) {
+        xml_error_set(error, XML_ERROR_ENCODING, "UTF-16 document of an odd number of bytes", source->size - 1);
+        return -1;
+    }
+    size_t units = (source->size - offset) / 2;
+    // 3 bytes per unit at most, a surrogate pair gives 4 bytes for 2 units
+    char *buffer = malloc(units * 3 + 1);
+    if (buffer == NULL) {
+        xml_error_set(error, XML_ERROR_MEMORY, "Out of memory", 0);
+        return -1;
+    }
+    size_t size = 0;
+    size_t error_unit = 0;
+    if (xml_utf16_to_utf8(source->data + offset, units, big_endian, buffer, &size, &error_unit) != 0) {
+        xml_error_set(error, XML_ERROR_ENCODING, "Unpaired UTF-16 surrogate", offset + 2 * error_unit);
+        free(buffer);
+        return -1;
+    }
+    xml_source_adopt(source, buffer, size);
+    return 0;
+}
 
-                while(*text_end != '<' && *text_end != '\0') {
-                    text_end++;
-                }
+// Runs the encoding stage on source, see above
+static int xml_source_decode(XMLSource *source, const XMLLoadOptions *options) {
+    XMLError *error = options->error;
+    size_t bom_size;
+    const char *encoding;
+    size_t encoding_size;
+    XMLEncoding kind = xml_encoding_detect(source->data, source->size, &bom_size, &encoding, &encoding_size);
+    if (kind == XML_ENCODING_UTF16LE || kind == XML_ENCODING_UTF16BE) {
+        return xml_source_from_utf16(source, bom_size, kind == XML_ENCODING_UTF16BE, error);
+    }
+    source->data += bom_size;
+    source->size -= bom_size;
+    if (kind == XML_ENCODING_LATIN1) {
+        return xml_source_from_latin1(source, error);
+    }
 
-                if (text_end > text_start) {
-                    long size_text = text_end - text_start;
-                    // TODO: Trim trailing whitespace from text if desired
-                    // TODO: Handle XML entities like &, <, etc. in text
-                    if (element->text_content) {
-                        fprintf(stderr, "Warning: Multiple text nodes or mixed content not fully supported yet, overwriting text for %s.\n", element->name);
-                        free(element->text_content);
-                    }
-
-                    element->text_content = malloc(size_text + 1);
-                    if (!element->text_content) { xml_free_element(element); return NULL; }
-
-                    strncpy(element->text_content, text_start, size_text);
-                    element->text_content[size_text] = '\0';
-                    current_pos = text_end;
-                }
-            }
+    const char *end = source->data + source->size;
+    const char *invalid;
+    if (kind == XML_ENCODING_UTF8) {
+        invalid = xml_scan_validate_utf8(source->data, end);
+        if (invalid != end) {
+            xml_error_set(error, XML_ERROR_ENCODING, "Invalid UTF-8", (size_t)(invalid - source->region));
+            return -1;
         }
-    } else {
-        fprintf(stderr, "Error: Expected '>' or '/>' to end tag for element %s, found '%c'.\n", element->name, *current_pos);
-        xml_free_element(element);
-        *cursor = current_pos;
-        return NULL;
+        return 0;
+    }
+    // other encodings are only accepted for ASCII documents, which read the
+    // same in all of them
+    invalid = xml_scan_find_non_ascii(source->data, end);
+    if (invalid != end) {
+        xml_error_set(error, XML_ERROR_UNSUPPORTED_ENCODING, "Unsupported encoding in a document that is not ASCII", (size_t)(invalid - source->region));
+        return -1;
     }
+    xml_source_warn(source, options, XML_ERROR_UNSUPPORTED_ENCODING, "Unsupported encoding, the document is read as ASCII", (size_t)(encoding - source->region));
+    return 0;
+}
 
-    // this should not be reached if logic is correct
-    fprintf(stderr, "Error: Unhandled parsing state for element %s.\n", element->name);
-    *cursor = current_pos;
-    xml_free_element(element);
-    return NULL;
+// Parse statistics (XMLParseStats). Every counter update goes through
+// XML_STATS and every phase time through XML_STATS_PHASE, so that
+// XML_DISABLE_PARSE_STATS leaves none of them in the build.
+#ifndef XML_DISABLE_PARSE_STATS
+#define XML_STATS(expression) ((void)(expression))
+// Adds the time since mark to stats->field and restarts mark
+#define XML_STATS_PHASE(stats, field, mark) \
+    do { if ((stats) != NULL) { (stats)->field += xml_stats_lap(&(mark)); } } while (0)
+
+static unsigned long long xml_stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ull + (unsigned long long)now.tv_nsec;
 }
 
-XMLFile *xml_load(const char *filepath) {
-    XMLFile *file = malloc(sizeof(XMLFile));
-    if(file == NULL) {
-        perror("Could not allocate xml file\n");
-        return NULL;
+static unsigned long long xml_stats_lap(unsigned long long *mark) {
+    unsigned long long now = xml_stats_now();
+    unsigned long long lap = now - *mark;
+    *mark = now;
+    return lap;
+}
+
+// Adds the node counts of a parser to stats
+static void xml_stats_add_counts(XMLParseStats *stats, const XMLParseStats *counts) {
+    stats->elements += counts->elements;
+    stats->attributes += counts->attributes;
+    stats->texts += counts->texts;
+    stats->comments += counts->comments;
+    stats->cdata_sections += counts->cdata_sections;
+    if (counts->max_depth > stats->max_depth) {
+        stats->max_depth = counts->max_depth;
     }
-    
-    file->version = NULL;
-    file->encoding = NULL;
-    file->root = NULL;
-    
-    char *content = get_file_content(filepath);
-    if(content == NULL) {
-        perror("Could not open file\n");
-        free(file);
-        return NULL;
+}
+#else
+#define XML_STATS(expression) ((void)0)
+#define XML_STATS_PHASE(stats, field, mark) ((void)(mark))
+#endif
+
+// Start of a phase, 0 when nothing is timed
+static unsigned long long xml_stats_clock(const XMLParseStats *stats) {
+#ifndef XML_DISABLE_PARSE_STATS
+    if (stats != NULL) {
+        return xml_stats_now();
     }
+#else
+    (void)stats;
+#endif
+    return 0;
+}
 
-    char *current_pos = content;
-    if (*current_pos != '<'|| *(current_pos + 1) != '?') {
-        perror("Expected <?");
-        free(content);
-        free(file);
-        return NULL;
+// Zeroes the stats and the error of a load and starts its clock
+static unsigned long long xml_load_begin(const XMLLoadOptions *options) {
+    if (options->stats != NULL) {
+        memset(options->stats, 0, sizeof(XMLParseStats));
     }
+    if (options->error != NULL) {
+        memset(options->error, 0, sizeof(XMLError));
+    }
+    return xml_stats_clock(options->stats);
+}
 
-    current_pos += 2; 
+#define XML_ARENA_MIN_BLOCK_SIZE (64 * 1024)
+#define XML_ARENA_MAX_BLOCK_SIZE (64 * 1024 * 1024)
+#define XML_ARENA_ALIGN (sizeof(void *) * 2)
+
+typedef struct XMLArenaBlock {
+    struct XMLArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} XMLArenaBlock;
+
+// Bump allocator owning every element, attribute and string of one document.
+// Blocks are only released by xml_arena_free, xml_arena_reset keeps them around
+// for the next document.
+typedef struct XMLArena {
+    XMLArenaBlock *first;
+    XMLArenaBlock *current;
+    size_t next_block_size;
+#ifndef XML_DISABLE_PARSE_STATS
+    // blocks allocated over the arena's life, for XMLParseStats
+    size_t allocations;
+    size_t allocated_bytes;
+#endif
+} XMLArena;
+
+static XMLArenaBlock *xml_arena_new_block(XMLArena *arena, size_t min_size) {
+    size_t size = arena->next_block_size;
+    while (size < min_size) {
+        size *= 2;
+    }
+    if (arena->next_block_size < XML_ARENA_MAX_BLOCK_SIZE) {
+        arena->next_block_size *= 2;
+    }
 
-    if (strncmp(current_pos, "xml", 3) != 0) {
-        perror("Expected 'xml' after '<?'\n");
-        free(content);
-        free(file);
+    XMLArenaBlock *block = malloc(sizeof(XMLArenaBlock) + size);
+    if (block == NULL) {
         return NULL;
     }
+    block->size = size;
+    block->used = 0;
+    XML_STATS(arena->allocations++);
+    XML_STATS(arena->allocated_bytes += sizeof(XMLArenaBlock) + size);
+
+    // keep the chain in allocation order so reset can walk it front to back
+    if (arena->current == NULL) {
+        block->next = NULL;
+        arena->first = block;
+    } else {
+        block->next = arena->current->next;
+        arena->current->next = block;
+    }
+    arena->current = block;
+    return block;
+}
 
-    current_pos += 3;
+static void *xml_arena_alloc_align(XMLArena *arena, size_t size, size_t align) {
+    XMLArenaBlock *block = arena->current;
+    while (block != NULL) {
+        uintptr_t start = (uintptr_t)(block->data + block->used);
+        size_t offset = block->used + (((start + align - 1) & ~(uintptr_t)(align - 1)) - start);
+        if (offset + size <= block->size) {
+            block->used = offset + size;
+            arena->current = block;
+            return block->data + offset;
+        }
+        // after a reset the following blocks are empty, try those before growing
+        block = block->next;
+    }
 
-    char *version_start = strstr(current_pos, "version=\"");
-    if (version_start == NULL) {
-        perror("XML declaration missing version.\n");
-        free(file);
-        free(content);
+    block = xml_arena_new_block(arena, size + align);
+    if (block == NULL) {
         return NULL;
     }
+    return xml_arena_alloc_align(arena, size, align);
+}
 
-    version_start += strlen("version=\"");
+static void *xml_arena_alloc(XMLArena *arena, size_t size) {
+    return xml_arena_alloc_align(arena, size, XML_ARENA_ALIGN);
+}
 
-    char *version_end = strchr(version_start, '\"');
-    if (version_end == NULL) {
-        perror("Malformed XML declaration: version string not terminated.\n");
-        free(file);
-        free(content);
+static char *xml_arena_strndup(XMLArena *arena, const char *string, size_t size) {
+    char *copy = xml_arena_alloc_align(arena, size + 1, 1);
+    if (copy == NULL) {
         return NULL;
     }
+    memcpy(copy, string, size);
+    copy[size] = '\0';
+    return copy;
+}
 
-    long size = version_end - version_start;
-    if (size <= 0) {
-        perror("Malformed XML declaration: version string is missing.\n");
-        free(file);
-        free(content);
+static XMLArena *xml_arena_new(void) {
+    XMLArena *arena = malloc(sizeof(XMLArena));
+    if (arena == NULL) {
         return NULL;
     }
+    arena->first = NULL;
+    arena->current = NULL;
+    arena->next_block_size = XML_ARENA_MIN_BLOCK_SIZE;
+    XML_STATS(arena->allocations = 0);
+    XML_STATS(arena->allocated_bytes = 0);
+    return arena;
+}
 
-    file->version = malloc(size + 1);
-    if (file->version == NULL) {
-        perror("Malloc failed for version\n");
-        free(file);
-        free(content);
-        return NULL;
+static void xml_arena_reset(XMLArena *arena) {
+    for (XMLArenaBlock *block = arena->first; block != NULL; block = block->next) {
+        block->used = 0;
     }
+    arena->current = arena->first;
+}
 
-    strncpy(file->version, version_start, size);
-    file->version[size] = '\0';
-    current_pos = version_end + 1;
+// Moves every block of other to the end of arena and frees other. What was
+// allocated from other now lives as long as arena.
+static void xml_arena_adopt(XMLArena *arena, XMLArena *other) {
+    if (other->first != NULL) {
+        if (arena->first == NULL) {
+            arena->first = other->first;
+            arena->current = other->first;
+        } else {
+            XMLArenaBlock *last = arena->first;
+            while (last->next != NULL) {
+                last = last->next;
+            }
+            last->next = other->first;
+        }
+    }
+    XML_STATS(arena->allocations += other->allocations);
+    XML_STATS(arena->allocated_bytes += other->allocated_bytes);
+    free(other);
+}
 
-    char *encoding_start = strstr(current_pos, "encoding=\"");
-    if (encoding_start == NULL) { 
-        perror("Malformed XML declaration: encoding string not started.\n");
-        free(content);
-        free(file->version);
-        free(file);
-        return NULL;
+static void xml_arena_free(XMLArena *arena) {
+    if (arena == NULL) {
+        return;
     }
+    XMLArenaBlock *block = arena->first;
+    while (block != NULL) {
+        XMLArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
 
-    encoding_start += strlen("encoding=\"");
+#define XML_NAME_TABLE_MIN_SLOTS 64
+
+typedef struct XMLNameEntry {
+    const char *name;
+    size_t size;
+    uint32_t hash;
+} XMLNameEntry;
+
+// Interns element and attribute names. Each distinct name is stored once and
+// numbered in order of appearance, atom 0 (XML_ATOM_NONE) is never handed out.
+// Lookups go through an open addressing hash of atoms, kept at most half full.
+struct XMLNameTable {
+    XMLArena *arena; // the name strings
+    int owns_arena; // shared tables have their own, per-document ones use the document's
+
+    XMLNameEntry *entries; // indexed by atom
+    size_t count; // atoms handed out, plus the unused entry 0
+    size_t entries_capacity;
+
+    XMLAtom *slots; // 0 for an empty slot
+    size_t slots_capacity; // a power of two
+};
+
+// FNV-1a
+static uint32_t xml_name_hash(const char *name, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
 
-    char *encoding_end = strchr(encoding_start, '\"');
-    if (encoding_end == NULL) {
-        perror("Malformed XML declaration: encoding string not terminated.\n");
-        free(content);
-        free(file->version);
-        free(file);
+static XMLNameTable *xml_name_table_create(XMLArena *arena) {
+    XMLNameTable *table = calloc(1, sizeof(XMLNameTable));
+    if (table == NULL) {
         return NULL;
     }
+    if (arena == NULL) {
+        arena = xml_arena_new();
+        if (arena == NULL) {
+            free(table);
+            return NULL;
+        }
+        table->owns_arena = 1;
+    }
+    table->arena = arena;
+    table->count = 1;
+    return table;
+}
 
-    long encoding_size = encoding_end - encoding_start;
-    if (encoding_size <= 0) {
-        perror("Malformed XML declaration: encoding is missing.\n");
-        free(content);
-        free(file->version);
-        free(file);
-        return NULL;
+// Forgets every name. The strings of a per-document table live in the document
+// arena, which is reset along with it.
+static void xml_name_table_reset(XMLNameTable *table) {
+    if (table->owns_arena) {
+        xml_arena_reset(table->arena);
+    }
+    if (table->slots != NULL) {
+        memset(table->slots, 0, table->slots_capacity * sizeof(XMLAtom));
     }
+    table->count = 1;
+}
 
-    file->encoding = malloc(encoding_size + 1);
-    if (file->encoding == NULL) {
-        perror("Malloc failed for encoding\n");
-        free(content);
-        free(file->version);
-        free(file);
+static XMLAtom *xml_name_table_slot(const XMLNameTable *table, const char *name, size_t size, uint32_t hash) {
+    size_t mask = table->slots_capacity - 1;
+    size_t index = hash & mask;
+    while (table->slots[index] != XML_ATOM_NONE) {
+        const XMLNameEntry *entry = &table->entries[table->slots[index]];
+        if (entry->hash == hash && entry->size == size && memcmp(entry->name, name, size) == 0) {
+            break;
+        }
+        index = (index + 1) & mask;
+    }
+    return &table->slots[index];
+}
 
+static int xml_name_table_grow(XMLNameTable *table) {
+    size_t capacity = table->slots_capacity > 0 ? table->slots_capacity * 2 : XML_NAME_TABLE_MIN_SLOTS;
+    XMLAtom *slots = calloc(capacity, sizeof(XMLAtom));
+    if (slots == NULL) {
+        return -1;
     }
+    free(table->slots);
+    table->slots = slots;
+    table->slots_capacity = capacity;
 
-    strncpy(file->encoding, encoding_start, size);
-    file->encoding[size] = '\0';
-    current_pos = encoding_end + 1;
+    for (XMLAtom atom = 1; atom < table->count; atom++) {
+        const XMLNameEntry *entry = &table->entries[atom];
+        *xml_name_table_slot(table, entry->name, entry->size, entry->hash) = atom;
+    }
+    return 0;
+}
 
-    char *end = strstr(current_pos, "?>");
-    if (end == NULL) {
-        perror("Malformed XML declaration: not closed with ?>.\n");
-        free(content);
-        free(file->version);
-        free(file->encoding);
-        free(file);
+static XMLAtom xml_name_table_find(const XMLNameTable *table, const char *name, size_t size) {
+    if (table == NULL || table->slots == NULL) {
+        return XML_ATOM_NONE;
+    }
+    return *xml_name_table_slot(table, name, size, xml_name_hash(name, size));
+}
+
+// Returns the interned, NUL-terminated copy of name and its atom, NULL if an
+// allocation fails
+static const char *xml_name_table_intern(XMLNameTable *table, const char *name, size_t size, XMLAtom *atom) {
+    if (table->count * 2 >= table->slots_capacity && xml_name_table_grow(table) != 0) {
         return NULL;
     }
 
-    current_pos = end + 2;
+    uint32_t hash = xml_name_hash(name, size);
+    XMLAtom *slot = xml_name_table_slot(table, name, size, hash);
+    if (*slot != XML_ATOM_NONE) {
+        *atom = *slot;
+        return table->entries[*slot].name;
+    }
 
-    file->root = parse_xml_element(&current_pos, NULL);
-    free(content);
+    if (table->count >= table->entries_capacity) {
+        size_t capacity = table->entries_capacity > 0 ? table->entries_capacity * 2 : XML_NAME_TABLE_MIN_SLOTS;
+        XMLNameEntry *entries = realloc(table->entries, capacity * sizeof(XMLNameEntry));
+        if (entries == NULL) {
+            return NULL;
+        }
+        table->entries = entries;
+        table->entries_capacity = capacity;
+    }
 
-    return file;
+    char *copy = xml_arena_strndup(table->arena, name, size);
+    if (copy == NULL) {
+        return NULL;
+    }
+    XMLNameEntry *entry = &table->entries[table->count];
+    entry->name = copy;
+    entry->size = size;
+    entry->hash = hash;
+    *slot = (XMLAtom)table->count++;
+    *atom = *slot;
+    return copy;
 }
 
-void xml_unload(XMLFile *file_struct) {
-    if (file_struct == NULL) {
+XMLNameTable *xml_name_table_new(void) {
+    return xml_name_table_create(NULL);
+}
+
+void xml_name_table_free(XMLNameTable *table) {
+    if (table == NULL) {
         return;
     }
-    free(file_struct->version);
-    file_struct->version = NULL;
+    if (table->owns_arena) {
+        xml_arena_free(table->arena);
+    }
+    free(table->entries);
+    free(table->slots);
+    free(table);
+}
 
-    free(file_struct->encoding);
-    file_struct->encoding = NULL;
+XMLAtom xml_name_table_lookup(const XMLNameTable *table, const char *name) {
+    if (name == NULL) {
+        return XML_ATOM_NONE;
+    }
+    return xml_name_table_find(table, name, strlen(name));
+}
 
-    if (file_struct->root != NULL) {
-        xml_free_element(file_struct->root);
-        file_struct->root = NULL;
+XMLAtom xml_name_table_add(XMLNameTable *table, const char *name) {
+    XMLAtom atom = XML_ATOM_NONE;
+    if (table != NULL && name != NULL) {
+        xml_name_table_intern(table, name, strlen(name), &atom);
     }
+    return atom;
+}
 
-    free(file_struct);
-    file_struct = NULL;
+XMLAtom xml_name_table_add_view(XMLNameTable *table, XMLStringView name) {
+    XMLAtom atom = XML_ATOM_NONE;
+    if (table != NULL && name.data != NULL) {
+        xml_name_table_intern(table, name.data, name.size, &atom);
+    }
+    return atom;
 }
 
-// recursive function, could give stackoverflow for really deep nested XML elements
-XMLElement* find_element_by_name_recursive(XMLElement *current_element, const char *tag_name) {
-    if (current_element == NULL || tag_name == NULL) {
+const char *xml_name_table_name(const XMLNameTable *table, XMLAtom atom) {
+    if (table == NULL || atom == XML_ATOM_NONE || atom >= table->count) {
         return NULL;
     }
+    return table->entries[atom].name;
+}
+
+typedef struct XMLParseFrame {
+    XMLElement *element;
+    XMLElement *last_child;
+    XMLText *last_text;
+    size_t children; // child elements so far, the position of the next run
+} XMLParseFrame;
+
+typedef struct XMLParser {
+    XMLArena *arena;
+    XMLNameTable *names;
+    unsigned int flags;
+    char *start; // the source region, error offsets count from there
+    char *end; // first byte after the source
+    XMLTokenAttributes attributes;
+    XMLStructuralIndex structure; // for XML_LOAD_STRUCTURAL_INDEX, set up on first use
+    size_t element_size; // lazy elements are allocated with room for their links
+
+    // open elements, replaces the call stack of a recursive descent parser
+    XMLParseFrame *frames;
+    size_t depth;
+    size_t frames_capacity;
+    size_t max_depth; // 0 for no limit
+
+    XMLError error; // the first one, the parse stops there
+#ifndef XML_DISABLE_PARSE_STATS
+    XMLParseStats stats; // node counts only, the phases are timed by the load
+#endif
+} XMLParser;
+
+static void xml_parser_init(XMLParser *parser, XMLArena *arena, XMLNameTable *names, char *start, char *end, const XMLLoadOptions *options) {
+    parser->arena = arena;
+    parser->names = names;
+    parser->flags = options->flags;
+    parser->start = start;
+    parser->end = end;
+    parser->attributes.items = NULL;
+    parser->attributes.count = 0;
+    parser->attributes.capacity = 0;
+    parser->structure.offsets = NULL;
+    parser->element_size = sizeof(XMLElement);
+    parser->frames = NULL;
+    parser->depth = 0;
+    parser->frames_capacity = 0;
+    parser->max_depth = options->max_depth;
+    parser->error.code = XML_ERROR_NONE;
+    XML_STATS(memset(&parser->stats, 0, sizeof(XMLParseStats)));
+}
 
-    if (current_element->name != NULL && strcmp(current_element->name, tag_name) == 0) {
-        return current_element;
+static void xml_parser_fail(XMLParser *parser, XMLErrorCode code, const char *message, const char *position) {
+    xml_error_set(&parser->error, code, message, (size_t)(position - parser->start));
+}
+
+// Frees the scratch memory, not the arena
+static void xml_parser_release(XMLParser *parser) {
+    xml_token_attributes_free(&parser->attributes);
+    xml_structural_index_free(&parser->structure);
+    free(parser->frames);
+    parser->frames = NULL;
+}
+
+// In-situ documents point straight into the source buffer, the terminators are
+// written by xml_terminate_in_situ once the whole buffer has been parsed.
+// Borrowed buffers are read only, their values and text stay unterminated.
+static char *xml_parser_string(XMLParser *parser, char *start, size_t size) {
+    if (parser->flags & (XML_LOAD_IN_SITU | XML_LOAD_BORROW_BUFFER)) {
+        return start;
     }
+    return xml_arena_strndup(parser->arena, start, size);
+}
 
-    XMLElement *child = current_element->children;
-    while (child != NULL) {
-        XMLElement *found_in_child = find_element_by_name_recursive(child, tag_name);
-        if (found_in_child != NULL) {
-            return found_in_child;
-        }
-        child = child->next_sibling;
+// Version and encoding, always NUL-terminated
+static char *xml_parser_name(XMLParser *parser, char *start, size_t size) {
+    if (parser->flags & XML_LOAD_BORROW_BUFFER) {
+        return xml_arena_strndup(parser->arena, start, size);
     }
+    return xml_parser_string(parser, start, size);
+}
 
-    return NULL;
+// Bounded strstr over the source, NULL when needle is not in [cursor, end)
+static char *xml_find_sequence(char *cursor, char *end, const char *needle) {
+    char *found = (char *)xml_scan_find_sequence(cursor, end, needle, strlen(needle));
+    return found != end ? found : NULL;
 }
 
-XMLElement* xml_element_get_child(XMLElement *start_element, const char *tag_name) {
-    if (start_element == NULL || tag_name == NULL) {
-        return NULL;
+// Next element after element in document order without leaving root. It walks
+// the parent links, so deep trees need neither recursion nor a stack.
+static XMLElement *xml_element_next_in_subtree(XMLElement *element, XMLElement *root) {
+    XMLElement *children = xml_element_children(element);
+    if (children != NULL) {
+        return children;
     }
-
-    XMLElement *child = start_element->children;
-    while (child != NULL) {
-        XMLElement *found = find_element_by_name_recursive(child, tag_name);
-        if (found) {
-            return found;
+    while (element != root) {
+        if (element->next_sibling != NULL) {
+            return element->next_sibling;
         }
-        child = child->next_sibling;
+        element = element->parent;
     }
     return NULL;
 }
 
-XMLAttribute* xml_attribute_get(XMLElement *current_element, const char *attr_name) {
-    if (current_element == NULL || attr_name == NULL) {
-        return NULL;
+// The byte after every in-situ string is the delimiter that ended it ('>', '/',
+// '=', a quote, whitespace or the '<' of the next tag), which the parser no
+// longer needs, so it can be overwritten with the terminator.
+// Names are interned and already terminated.
+static void xml_terminate_element(XMLElement *element) {
+    for (XMLText *text = element->texts; text != NULL; text = text->next) {
+        text->text[text->size] = '\0';
     }
+    for (int i = 0; i < element->attributes_size; i++) {
+        XMLAttribute *attr = &element->attributes[i];
+        attr->value[attr->value_size] = '\0';
+    }
+}
 
-    XMLAttribute *child = current_element->attributes;
-    while (child != NULL) {
-        if(strcmp(child->name, attr_name) == 0) {
-            return child;
+static void xml_terminate_in_situ(XMLElement *root) {
+    for (XMLElement *element = root; element != NULL; element = xml_element_next_in_subtree(element, root)) {
+        xml_terminate_element(element);
+    }
+}
+
+static void xml_parser_report(XMLParser *parser, const XMLToken *token) {
+    xml_parser_fail(parser, xml_token_error_code(token->error), xml_token_error_string(token->error), token->error_position);
+}
+
+static XMLTokenStatus xml_parser_next_token(XMLParser *parser, char *cursor, XMLToken *token) {
+    if (parser->flags & XML_LOAD_STRUCTURAL_INDEX) {
+        if (parser->structure.offsets != NULL || xml_structural_index_init(&parser->structure, parser->end) == 0) {
+            return xml_tokenize_content_indexed(&parser->structure, cursor, token, &parser->attributes);
         }
+        // without memory for the index the content is tokenized directly
+        parser->flags &= ~XML_LOAD_STRUCTURAL_INDEX;
+    }
+    return xml_tokenize_content(cursor, parser->end, token, &parser->attributes);
+}
 
-        child = child->next;
+// Counts the text, comment and CDATA tokens, elements are counted as they
+// are built
+static void xml_parser_count(XMLParser *parser, const XMLToken *token) {
+#ifndef XML_DISABLE_PARSE_STATS
+    switch (token->type) {
+        case XML_TOKEN_TEXT:
+            parser->stats.texts++;
+            break;
+        case XML_TOKEN_COMMENT:
+            parser->stats.comments++;
+            break;
+        case XML_TOKEN_CDATA:
+            parser->stats.cdata_sections++;
+            break;
+        default:
+            break;
     }
+#else
+    (void)parser;
+    (void)token;
+#endif
+}
 
-    return NULL;
+// A value only needs decoding when it has a '&', which one vector scan tells
+static unsigned int xml_value_flags(const char *value, size_t size) {
+    return xml_scan_find_byte(value, value + size, '&') != value + size ? XML_VALUE_ENTITIES : 0;
+}
+
+// The run of a text or CDATA token, its text copied unless the document
+// points into its source like every other value
+static XMLText *xml_parser_new_text(XMLParser *parser, const XMLToken *token, size_t position) {
+    XMLText *text = xml_arena_alloc(parser->arena, sizeof(XMLText));
+    if (text != NULL) {
+        text->text = xml_parser_string(parser, (char *)token->value, token->value_size);
+    }
+    if (!text || !text->text) {
+        xml_parser_fail(parser, XML_ERROR_MEMORY, "Out of memory", token->start);
+        return NULL;
+    }
+    text->size = token->value_size;
+    text->flags = token->type == XML_TOKEN_CDATA ? XML_VALUE_CDATA : xml_value_flags(token->value, token->value_size);
+    text->position = position;
+    text->next = NULL;
+    return text;
+}
+
+// Appends the run after *last, the first run of element also fills in its
+// text_content
+static void xml_element_append_text(XMLElement *element, XMLText **last, XMLText *text) {
+    if (*last == NULL) {
+        element->texts = text;
+        element->text_content = text->text;
+        element->text_size = text->size;
+        element->text_flags = text->flags;
+    } else {
+        (*last)->next = text;
+    }
+    *last = text;
+}
+
+// Elements with at least this many attributes also get a hash of their names
+#define XML_ATTRIBUTE_HASH_THRESHOLD 16
+
+// The hash lives in the same allocation, right after the attribute array:
+// the name table the atoms come from, so lookups by atom find the hash of
+// the name, then a power of two number of slots, at most half full, each
+// holding the index of an attribute plus one, or 0 when empty.
+static size_t xml_attribute_slots_capacity(int attributes_size) {
+    size_t capacity = XML_ATTRIBUTE_HASH_THRESHOLD * 2;
+    while (capacity < (size_t)attributes_size * 2) {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+// Bytes to allocate after an attribute array of count attributes
+static size_t xml_attribute_hash_size(size_t count) {
+    if (count < XML_ATTRIBUTE_HASH_THRESHOLD) {
+        return 0;
+    }
+    return sizeof(const XMLNameTable *) + xml_attribute_slots_capacity((int)count) * sizeof(uint32_t);
+}
+
+static const XMLNameTable **xml_attribute_hash_names(const XMLElement *element) {
+    return (const XMLNameTable **)(element->attributes + element->attributes_size);
+}
+
+static uint32_t *xml_attribute_slots(const XMLElement *element) {
+    return (uint32_t *)(xml_attribute_hash_names(element) + 1);
+}
+
+// Probes for name, stops at its slot or at the empty slot where it would go.
+// hash is xml_name_hash of the name, which the name table already knows.
+static uint32_t *xml_attribute_slot(const XMLElement *element, const char *name, size_t size, uint32_t hash) {
+    uint32_t *slots = xml_attribute_slots(element);
+    size_t mask = xml_attribute_slots_capacity(element->attributes_size) - 1;
+    size_t index = hash & mask;
+    while (slots[index] != 0) {
+        const XMLAttribute *attr = &element->attributes[slots[index] - 1];
+        if (attr->name_size == size && memcmp(attr->name, name, size) == 0) {
+            break;
+        }
+        index = (index + 1) & mask;
+    }
+    return &slots[index];
+}
+
+// An element without name, attributes, text or children under parent_element
+static void xml_element_init(XMLElement *element, XMLElement *parent_element) {
+    element->name = NULL;
+    element->name_size = 0;
+    element->name_atom = XML_ATOM_NONE;
+    element->text_flags = 0;
+    element->text_content = NULL;
+    element->text_size = 0;
+    element->decoded_text = NULL;
+    element->decoded_text_size = 0;
+    element->texts = NULL;
+    element->attributes = NULL;
+    element->attributes_size = 0;
+    element->children_pending = 0;
+    element->parent = parent_element;
+    element->children = NULL;
+    element->next_sibling = NULL;
+    element->pre_order = 0;
+    element->post_order = 0;
+}
+
+// Fills in the hash of an element with XML_ATTRIBUTE_HASH_THRESHOLD or more
+// attributes, allocated right after them
+static void xml_element_hash_attributes(XMLElement *element, const XMLNameTable *names) {
+    *xml_attribute_hash_names(element) = names;
+    memset(xml_attribute_slots(element), 0, xml_attribute_slots_capacity(element->attributes_size) * sizeof(uint32_t));
+    for (int i = 0; i < element->attributes_size; i++) {
+        // a repeated name keeps pointing to its first attribute
+        const XMLAttribute *attr = &element->attributes[i];
+        uint32_t *slot = xml_attribute_slot(element, attr->name, attr->name_size, names->entries[attr->name_atom].hash);
+        if (*slot == 0) {
+            *slot = (uint32_t)i + 1;
+        }
+    }
+}
+
+// Builds an element from a start tag token. The attributes come from the
+// tokenizer's scratch array, which the next token overwrites.
+static XMLElement *xml_parser_new_element(XMLParser *parser, const XMLToken *token, XMLElement *parent_element) {
+    XMLElement *element = xml_arena_alloc(parser->arena, parser->element_size);
+    if (!element) {
+        xml_parser_fail(parser, XML_ERROR_MEMORY, "Out of memory", token->start);
+        return NULL;
+    }
+
+    xml_element_init(element, parent_element);
+    element->name = (char *)xml_name_table_intern(parser->names, token->name, token->name_size, &element->name_atom);
+    element->name_size = token->name_size;
+    // the parent's frame is the innermost one, if it has any
+    XML_STATS(parser->stats.elements++);
+    XML_STATS(parser->stats.attributes += parser->attributes.count);
+    XML_STATS(parser->stats.max_depth = parser->depth + 1 > parser->stats.max_depth ? parser->depth + 1 : parser->stats.max_depth);
+
+    if (!element->name) {
+        xml_parser_fail(parser, XML_ERROR_MEMORY, "Out of memory", token->start);
+        return NULL;
+    }
+
+    size_t count = parser->attributes.count;
+    if (count == 0) {
+        return element;
+    }
+
+    // one block for the attributes and, for large elements, their hash
+    size_t size = count * sizeof(XMLAttribute);
+    size_t slots_size = xml_attribute_hash_size(count);
+    element->attributes = xml_arena_alloc(parser->arena, size + slots_size);
+    if (!element->attributes) {
+        xml_parser_fail(parser, XML_ERROR_MEMORY, "Out of memory", token->start);
+        return NULL;
+    }
+    element->attributes_size = (int)count;
+
+    for (size_t i = 0; i < count; i++) {
+        const XMLTokenAttribute *token_attr = &parser->attributes.items[i];
+
+        XMLAttribute *new_attr = &element->attributes[i];
+        new_attr->name = (char *)xml_name_table_intern(parser->names, token_attr->name, token_attr->name_size, &new_attr->name_atom);
+        new_attr->name_size = token_attr->name_size;
+        new_attr->value = xml_parser_string(parser, (char *)token_attr->value, token_attr->value_size);
+        new_attr->value_size = token_attr->value_size;
+        new_attr->value_flags = xml_value_flags(token_attr->value, token_attr->value_size);
+        new_attr->decoded_value = NULL;
+        new_attr->decoded_value_size = 0;
+        if (!new_attr->name || !new_attr->value) {
+            xml_parser_fail(parser, XML_ERROR_MEMORY, "Out of memory", token->start);
+            return NULL;
+        }
+    }
+
+    if (slots_size > 0) {
+        xml_element_hash_attributes(element, parser->names);
+    }
+
+    return element;
+}
+
+static int xml_parser_push(XMLParser *parser, XMLElement *element, const char *position) {
+    if (parser->depth == parser->frames_capacity) {
+        size_t capacity = parser->frames_capacity > 0 ? parser->frames_capacity * 2 : 64;
+        XMLParseFrame *frames = realloc(parser->frames, capacity * sizeof(XMLParseFrame));
+        if (frames == NULL) {
+            xml_parser_fail(parser, XML_ERROR_MEMORY, "Out of memory", position);
+            return -1;
+        }
+        parser->frames = frames;
+        parser->frames_capacity = capacity;
+    }
+
+    XMLParseFrame *frame = &parser->frames[parser->depth++];
+    frame->element = element;
+    frame->last_child = NULL;
+    frame->last_text = NULL;
+    frame->children = 0;
+    return 0;
+}
+
+// Parses the content of element up to and including its closing tag. Nested
+// elements are pushed on parser->frames instead of recursing, so the nesting
+// depth is only limited by memory and parser->max_depth.
+int parse_xml_content(char **cursor, XMLElement *element, XMLParser *parser) {
+    char *current_pos = *cursor;
+    size_t base_depth = parser->depth;
+
+    if (xml_parser_push(parser, element, current_pos) != 0) {
+        return -1;
+    }
+
+    while (parser->depth > base_depth) {
+        XMLParseFrame *frame = &parser->frames[parser->depth - 1];
+        element = frame->element;
+
+        XMLToken token;
+        if (xml_parser_next_token(parser, current_pos, &token) != XML_TOKEN_OK) {
+            xml_parser_report(parser, &token);
+            *cursor = (char *)token.error_position;
+            parser->depth = base_depth;
+            return -1;
+        }
+        xml_parser_count(parser, &token);
+
+        switch (token.type) {
+            case XML_TOKEN_END_TAG:
+                if (token.name_size != element->name_size || memcmp(element->name, token.name, token.name_size) != 0) {
+                    xml_parser_fail(parser, XML_ERROR_MISMATCHED_TAG, "Mismatch in closing tag", token.start);
+                    *cursor = (char *)token.start;
+                    parser->depth = base_depth;
+                    return -1;
+                }
+                parser->depth--;
+                break;
+
+            case XML_TOKEN_START_TAG: {
+                // the root of the document is at depth 1
+                if (parser->max_depth > 0 && parser->depth + 1 > parser->max_depth) {
+                    xml_parser_fail(parser, XML_ERROR_MAX_DEPTH, "Maximum nesting depth exceeded", token.start);
+                    *cursor = (char *)token.start;
+                    parser->depth = base_depth;
+                    return -1;
+                }
+
+                XMLElement *child = xml_parser_new_element(parser, &token, element);
+                if (!child) {
+                    *cursor = (char *)token.start;
+                    parser->depth = base_depth;
+                    return -1;
+                }
+
+                if (element->children == NULL) {
+                    element->children = child;
+                } else {
+                    frame->last_child->next_sibling = child;
+                }
+                frame->last_child = child;
+                frame->children++;
+
+                if (!token.self_closing && xml_parser_push(parser, child, token.start) != 0) {
+                    *cursor = (char *)token.start;
+                    parser->depth = base_depth;
+                    return -1;
+                }
+                break;
+            }
+
+            case XML_TOKEN_TEXT:
+            case XML_TOKEN_CDATA: {
+                // TODO: Trim trailing whitespace from text if desired
+                XMLText *text = xml_parser_new_text(parser, &token, frame->children);
+                if (!text) {
+                    parser->depth = base_depth;
+                    return -1;
+                }
+                xml_element_append_text(element, &frame->last_text, text);
+                break;
+            }
+
+            case XML_TOKEN_COMMENT:
+            case XML_TOKEN_PROCESSING_INSTRUCTION:
+                break;
+        }
+
+        current_pos = (char *)token.end;
+    }
+
+    *cursor = current_pos;
+    return 0;
+}
+
+// The token rules live in xml-tokenizer.c, shared with the streaming reader
+XMLElement *parse_xml_element(char **cursor, XMLElement* parent_element, XMLParser *parser) {
+    XMLToken token;
+    if (xml_tokenize_start_tag(*cursor, parser->end, &token, &parser->attributes) != XML_TOKEN_OK) {
+        xml_parser_report(parser, &token);
+        *cursor = (char *)token.error_position;
+        return NULL;
+    }
+
+    XMLElement *element = xml_parser_new_element(parser, &token, parent_element);
+    if (!element) {
+        return NULL;
+    }
+
+    *cursor = (char *)token.end;
+    if (!token.self_closing && parse_xml_content(cursor, element, parser) != 0) {
+        return NULL;
+    }
+    return element;
+}
+
+// Structural walks, shared by the parallel pre-scan and the lazy skip pass.
+// They only look for the delimiters of each piece of markup, the tokenizer
+// checks the rest once the elements are built.
+
+// Finds the '>' that ends the tag starting before cursor. Quotes start
+// attribute values, which may contain '>'.
+static char *xml_structural_tag_end(XMLStructuralIndex *index, char *cursor) {
+    while (1) {
+        char *found = (char *)xml_structural_index_find(index, cursor, 0);
+        if (found == index->end) {
+            return NULL;
+        }
+        if (*found == '>') {
+            return found;
+        }
+        if (*found == '"' || *found == '\'') {
+            found = (char *)xml_structural_index_find(index, found + 1, *found);
+            if (found == index->end) {
+                return NULL;
+            }
+        }
+        cursor = found + 1;
+    }
+}
+
+// Skips the comment, CDATA section or processing instruction at open, with
+// the same delimiters the tokenizer looks for. NULL when open starts none of
+// them or it is not terminated.
+static char *xml_structural_skip_section(char *open, char *end) {
+    const char *terminator;
+    char *body;
+    if (end - open >= 4 && memcmp(open, "<!--", 4) == 0) {
+        terminator = "-->";
+        body = open + 4;
+    } else if (end - open >= 9 && memcmp(open, "<![CDATA[", 9) == 0) {
+        terminator = "]]>";
+        body = open + 9;
+    } else if (end - open >= 2 && open[1] == '?') {
+        terminator = "?>";
+        body = open + 2;
+    } else {
+        return NULL;
+    }
+    char *close = (char *)xml_scan_find_sequence(body, end, terminator, strlen(terminator));
+    return close != end ? close + strlen(terminator) : NULL;
+}
+
+// Parallel parsing (XML_LOAD_PARALLEL). A pre-scan of the root element's
+// content picks split points at start tags directly inside the root, then
+// each range is parsed on its own thread with its own arena and name table.
+// The tables are merged in document order, so atoms are numbered as in a
+// serial parse, and a second parallel pass renumbers the atoms of each range.
+// Finally the top-level elements are linked under the root.
+
+// smaller documents are parsed on one thread
+#ifndef XML_PARALLEL_MIN_SIZE
+#define XML_PARALLEL_MIN_SIZE (1 << 20)
+#endif
+#define XML_PARALLEL_MAX_THREADS 64
+
+typedef struct XMLParseChunk {
+    XMLParser parser;
+    XMLElement *root;
+    char *start;
+    char *stop; // the next chunk's first start tag, or the root's end tag
+
+    // top-level elements, linked to each other but not yet to the root
+    XMLElement *first;
+    XMLElement *last;
+    size_t children;
+    // text runs directly inside the root, positioned among the chunk's own
+    // elements until the merge
+    XMLText *first_text;
+    XMLText *last_text;
+    int failed;
+
+    XMLAtom *atoms; // document atom of each atom of parser.names
+    const XMLNameTable *names; // the document's table, set with atoms
+} XMLParseChunk;
+
+typedef void *(*XMLParseChunkTask)(void *chunk);
+
+static size_t xml_parallel_threads(const XMLLoadOptions *options) {
+    size_t threads = options->threads;
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (size_t)online : 1;
+    }
+    return threads < XML_PARALLEL_MAX_THREADS ? threads : XML_PARALLEL_MAX_THREADS;
+}
+
+// Walks the markup of the root element's content on the structural index,
+// tracking only the depth, and stores in splits the '<' of top-level start
+// tags close to equal shares of the input. Quotes only count inside tags, and
+// comments, CDATA sections and processing instructions are skipped whole, so
+// no split falls inside any of them. Returns the number of splits and the
+// root's end tag in *content_end, or -1 for anything the scan cannot vouch
+// for, left to the serial parser.
+static long xml_parallel_prescan(char *cursor, char *end, char **splits, size_t max_splits, char **content_end) {
+    XMLStructuralIndex index;
+    if (xml_structural_index_init(&index, end) != 0) {
+        return -1;
+    }
+
+    size_t share = (size_t)(end - cursor) / (max_splits + 1);
+    char *next_target = cursor + share;
+    size_t depth = 0;
+    long count = -1;
+
+    for (size_t found = 0; ; ) {
+        char *open = (char *)xml_structural_index_find(&index, cursor, '<');
+        if (end - open < 2) {
+            break;
+        }
+
+        if (open[1] == '/') {
+            char *close = (char *)xml_structural_index_find(&index, open, '>');
+            if (close == end) {
+                break;
+            }
+            if (depth == 0) {
+                *content_end = open;
+                count = (long)found;
+                break;
+            }
+            depth--;
+            cursor = close + 1;
+            continue;
+        }
+
+        if (open[1] == '!' || open[1] == '?') {
+            cursor = xml_structural_skip_section(open, end);
+            if (cursor == NULL) {
+                break;
+            }
+            continue;
+        }
+
+        if (depth == 0 && open >= next_target && found < max_splits) {
+            splits[found++] = open;
+            next_target = open + share;
+        }
+
+        char *close = xml_structural_tag_end(&index, open + 1);
+        if (close == NULL) {
+            break;
+        }
+        if (close[-1] != '/') {
+            depth++;
+        }
+        cursor = close + 1;
+    }
+
+    xml_structural_index_free(&index);
+    return count;
+}
+
+// Parses the top-level nodes in [chunk->start, chunk->stop). Runs on a worker
+// thread, it only touches the chunk and reads the source around its range.
+static void *xml_parse_chunk(void *argument) {
+    XMLParseChunk *chunk = argument;
+    XMLParser *parser = &chunk->parser;
+    char *cursor = chunk->start;
+
+    // the root's frame, so depths count as they do in a serial parse
+    if (xml_parser_push(parser, chunk->root, cursor) != 0) {
+        chunk->failed = 1;
+        return NULL;
+    }
+
+    while (xml_scan_skip_whitespace(cursor, chunk->stop) < chunk->stop) {
+        XMLToken token;
+        if (xml_parser_next_token(parser, cursor, &token) != XML_TOKEN_OK) {
+            xml_parser_report(parser, &token);
+            chunk->failed = 1;
+            return NULL;
+        }
+        xml_parser_count(parser, &token);
+        cursor = (char *)token.end;
+
+        switch (token.type) {
+            case XML_TOKEN_START_TAG: {
+                if (parser->max_depth > 0 && parser->depth + 1 > parser->max_depth) {
+                    xml_parser_fail(parser, XML_ERROR_MAX_DEPTH, "Maximum nesting depth exceeded", token.start);
+                    chunk->failed = 1;
+                    return NULL;
+                }
+                XMLElement *child = xml_parser_new_element(parser, &token, chunk->root);
+                if (!child || (!token.self_closing && parse_xml_content(&cursor, child, parser) != 0)) {
+                    chunk->failed = 1;
+                    return NULL;
+                }
+                if (chunk->first == NULL) {
+                    chunk->first = child;
+                } else {
+                    chunk->last->next_sibling = child;
+                }
+                chunk->last = child;
+                chunk->children++;
+                break;
+            }
+
+            case XML_TOKEN_END_TAG:
+                // the pre-scan put the root's end tag at the last chunk's stop
+                xml_parser_fail(parser, XML_ERROR_MISMATCHED_TAG, "Mismatch in closing tag", token.start);
+                chunk->failed = 1;
+                return NULL;
+
+            case XML_TOKEN_TEXT:
+            case XML_TOKEN_CDATA: {
+                XMLText *text = xml_parser_new_text(parser, &token, chunk->children);
+                if (!text) {
+                    chunk->failed = 1;
+                    return NULL;
+                }
+                if (chunk->first_text == NULL) {
+                    chunk->first_text = text;
+                } else {
+                    chunk->last_text->next = text;
+                }
+                chunk->last_text = text;
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+// Gives every element and attribute of the chunk its document atom, and writes
+// the in-situ terminators. Those stay inside the range of their subtree, but
+// the vector scanners of the parse pass read a little past the bytes they
+// need, so they are only written once every chunk has been parsed.
+static void *xml_finish_chunk(void *argument) {
+    XMLParseChunk *chunk = argument;
+    unsigned int flags = chunk->parser.flags;
+    int terminate = (flags & XML_LOAD_IN_SITU) && !(flags & XML_LOAD_BORROW_BUFFER);
+
+    for (XMLElement *top = chunk->first; top != NULL; top = top->next_sibling) {
+        for (XMLElement *element = top; element != NULL; element = xml_element_next_in_subtree(element, top)) {
+            element->name_atom = chunk->atoms[element->name_atom];
+            for (int i = 0; i < element->attributes_size; i++) {
+                element->attributes[i].name_atom = chunk->atoms[element->attributes[i].name_atom];
+            }
+            if (element->attributes_size >= XML_ATTRIBUTE_HASH_THRESHOLD) {
+                *xml_attribute_hash_names(element) = chunk->names;
+            }
+            if (terminate) {
+                xml_terminate_element(element);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Runs task on every chunk, one thread each. The calling thread takes the first
+// chunk, a chunk whose thread cannot be started runs on it afterwards.
+static void xml_parallel_run(XMLParseChunk *chunks, size_t chunk_count, XMLParseChunkTask task) {
+    pthread_t workers[XML_PARALLEL_MAX_THREADS];
+    int started[XML_PARALLEL_MAX_THREADS];
+
+    for (size_t i = 1; i < chunk_count; i++) {
+        started[i] = pthread_create(&workers[i], NULL, task, &chunks[i]) == 0;
+    }
+    task(&chunks[0]);
+    for (size_t i = 1; i < chunk_count; i++) {
+        if (started[i]) {
+            pthread_join(workers[i], NULL);
+        } else {
+            task(&chunks[i]);
+        }
+    }
+}
+
+// Interns the names of every chunk into the document's table in chunk order
+static int xml_parallel_merge_names(XMLNameTable *names, XMLParseChunk *chunks, size_t chunk_count) {
+    for (size_t i = 0; i < chunk_count; i++) {
+        const XMLNameTable *local = chunks[i].parser.names;
+        chunks[i].atoms = malloc(local->count * sizeof(XMLAtom));
+        if (chunks[i].atoms == NULL) {
+            return -1;
+        }
+        chunks[i].atoms[XML_ATOM_NONE] = XML_ATOM_NONE;
+        chunks[i].names = names;
+        for (XMLAtom atom = 1; atom < local->count; atom++) {
+            if (xml_name_table_intern(names, local->entries[atom].name, local->entries[atom].size, &chunks[i].atoms[atom]) == NULL) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Same as parse_xml_element for the root, on up to threads threads. Falls back
+// to the serial parser for small documents and for content the pre-scan cannot
+// split safely. *terminated is set when the in-situ terminators have already
+// been written.
+static XMLElement *xml_parse_root_parallel(char **cursor, XMLParser *parser, size_t threads, int *terminated) {
+    XMLToken token;
+    if (xml_tokenize_start_tag(*cursor, parser->end, &token, &parser->attributes) != XML_TOKEN_OK) {
+        xml_parser_report(parser, &token);
+        *cursor = (char *)token.error_position;
+        return NULL;
+    }
+
+    XMLElement *root = xml_parser_new_element(parser, &token, NULL);
+    if (!root) {
+        return NULL;
+    }
+    *cursor = (char *)token.end;
+    if (token.self_closing) {
+        return root;
+    }
+
+    char *splits[XML_PARALLEL_MAX_THREADS];
+    char *content_end = NULL;
+    long split_count = -1;
+    if (parser->end - *cursor >= XML_PARALLEL_MIN_SIZE) {
+        split_count = xml_parallel_prescan(*cursor, parser->end, splits, threads - 1, &content_end);
+    }
+    if (split_count <= 0) {
+        return parse_xml_content(cursor, root, parser) == 0 ? root : NULL;
+    }
+
+    size_t chunk_count = (size_t)split_count + 1;
+    XMLParseChunk *chunks = calloc(chunk_count, sizeof(XMLParseChunk));
+    XMLLoadOptions chunk_options = { parser->flags, parser->max_depth, NULL, 0, NULL, NULL, NULL, NULL };
+    int failed = chunks == NULL;
+
+    for (size_t i = 0; i < chunk_count && !failed; i++) {
+        XMLParseChunk *chunk = &chunks[i];
+        XMLArena *arena = xml_arena_new();
+        XMLNameTable *names = arena != NULL ? xml_name_table_create(arena) : NULL;
+        if (names == NULL) {
+            xml_arena_free(arena);
+            failed = 1;
+            break;
+        }
+        xml_parser_init(&chunk->parser, arena, names, parser->start, parser->end, &chunk_options);
+        chunk->root = root;
+        chunk->start = i == 0 ? *cursor : splits[i - 1];
+        chunk->stop = i + 1 < chunk_count ? splits[i] : content_end;
+    }
+
+    if (!failed) {
+        xml_parallel_run(chunks, chunk_count, xml_parse_chunk);
+        // the first error in document order, as a serial parse would stop there
+        for (size_t i = 0; i < chunk_count && !failed; i++) {
+            if (chunks[i].failed) {
+                parser->error = chunks[i].parser.error;
+                failed = 1;
+            }
+        }
+    } else {
+        xml_parser_fail(parser, XML_ERROR_MEMORY, "Out of memory", *cursor);
+    }
+    if (!failed && xml_parallel_merge_names(parser->names, chunks, chunk_count) != 0) {
+        xml_parser_fail(parser, XML_ERROR_MEMORY, "Out of memory", *cursor);
+        failed = 1;
+    }
+    if (!failed) {
+        xml_parallel_run(chunks, chunk_count, xml_finish_chunk);
+    }
+
+    XMLElement *last = NULL;
+    XMLText *last_text = NULL;
+    size_t children = 0;
+    for (size_t i = 0; chunks != NULL && i < chunk_count; i++) {
+        XMLParseChunk *chunk = &chunks[i];
+        if (chunk->parser.arena == NULL) {
+            continue;
+        }
+        if (chunk->first != NULL) {
+            if (last == NULL) {
+                root->children = chunk->first;
+            } else {
+                last->next_sibling = chunk->first;
+            }
+            last = chunk->last;
+        }
+        for (XMLText *text = chunk->first_text; text != NULL; ) {
+            XMLText *next = text->next;
+            text->position += children;
+            text->next = NULL;
+            xml_element_append_text(root, &last_text, text);
+            text = next;
+        }
+        children += chunk->children;
+        XML_STATS(xml_stats_add_counts(&parser->stats, &chunk->parser.stats));
+        free(chunk->atoms);
+        xml_name_table_free(chunk->parser.names);
+        xml_parser_release(&chunk->parser);
+        // the elements stay, their memory now belongs to the document
+        xml_arena_adopt(parser->arena, chunk->parser.arena);
+    }
+    free(chunks);
+    if (failed) {
+        return NULL;
+    }
+
+    *cursor = content_end;
+    if (xml_tokenize_content(*cursor, parser->end, &token, &parser->attributes) != XML_TOKEN_OK) {
+        xml_parser_report(parser, &token);
+        return NULL;
+    }
+    if (token.type != XML_TOKEN_END_TAG || token.name_size != root->name_size || memcmp(root->name, token.name, token.name_size) != 0) {
+        xml_parser_fail(parser, XML_ERROR_MISMATCHED_TAG, "Mismatch in closing tag", token.start);
+        return NULL;
+    }
+    *cursor = (char *)token.end;
+
+    if ((parser->flags & XML_LOAD_IN_SITU) && !(parser->flags & XML_LOAD_BORROW_BUFFER)) {
+        xml_terminate_element(root);
+        *terminated = 1;
+    }
+    return root;
+}
+
+// Lazy loading (XML_LOAD_LAZY). The load runs a skip pass over the root
+// element on the structural index: it records the range of every element in
+// document order, pairing start and end tags by depth, then builds only the
+// root. Names, attributes and text are checked as the elements are built.
+// The children of an element are built from the ranges the first time they
+// are asked for, each with its attributes and text, and their own children
+// are left for later in turn.
+
+typedef struct XMLLazyRange {
+    size_t start; // offset of the start tag's '<'
+    size_t end; // offset of the byte after the element
+    size_t next; // first range after the element's subtree
+} XMLLazyRange;
+
+struct XMLLazyDocument {
+    XMLParser parser; // kept for the elements still to build
+    char *data;
+    XMLLazyRange *ranges; // in document order, the root first
+    size_t ranges_size;
+    size_t ranges_capacity;
+};
+
+// Every element of a lazy document is allocated as one of these, so it can
+// find its range and document when its children are built
+typedef struct XMLLazyElement {
+    XMLElement element;
+    XMLLazyDocument *document;
+    size_t range;
+} XMLLazyElement;
+
+static void xml_lazy_free(XMLLazyDocument *document) {
+    if (document == NULL) {
+        return;
+    }
+    xml_parser_release(&document->parser);
+    free(document->ranges);
+    free(document);
+}
+
+static int xml_lazy_push_range(XMLLazyDocument *document, size_t start) {
+    if (document->ranges_size == document->ranges_capacity) {
+        size_t capacity = document->ranges_capacity > 0 ? document->ranges_capacity * 2 : 1024;
+        XMLLazyRange *ranges = realloc(document->ranges, capacity * sizeof(XMLLazyRange));
+        if (ranges == NULL) {
+            xml_parser_fail(&document->parser, XML_ERROR_MEMORY, "Out of memory", document->data + start);
+            return -1;
+        }
+        document->ranges = ranges;
+        document->ranges_capacity = capacity;
+    }
+    XMLLazyRange *range = &document->ranges[document->ranges_size++];
+    range->start = start;
+    range->end = 0;
+    range->next = 0;
+    return 0;
+}
+
+// Reports the markup at position the skip pass could not get past. The
+// tokenizer knows best what is wrong with it.
+static void xml_lazy_report(XMLLazyDocument *document, char *position) {
+    XMLToken token;
+    if (xml_tokenize_content(position, document->parser.end, &token, &document->parser.attributes) != XML_TOKEN_OK) {
+        xml_parser_report(&document->parser, &token);
+    } else {
+        xml_parser_fail(&document->parser, XML_ERROR_UNEXPECTED_END, xml_token_error_string(XML_TOKEN_ERROR_UNEXPECTED_END), document->parser.end);
+    }
+}
+
+// Records the ranges of the element starting at open and of everything in it
+static int xml_lazy_skip(XMLLazyDocument *document, char *open) {
+    XMLParser *parser = &document->parser;
+    char *data = document->data;
+    char *end = parser->end;
+
+    XMLStructuralIndex index;
+    if (xml_structural_index_init(&index, end) != 0) {
+        xml_parser_fail(parser, XML_ERROR_MEMORY, "Out of memory", open);
+        return -1;
+    }
+    // ranges of the open elements
+    size_t *open_ranges = NULL;
+    size_t depth = 0;
+    size_t depth_capacity = 0;
+    int result = -1;
+
+    char *cursor = open;
+    while (1) {
+        open = (char *)xml_structural_index_find(&index, cursor, '<');
+        if (end - open < 2) {
+            xml_lazy_report(document, cursor);
+            break;
+        }
+
+        if (open[1] == '/') {
+            char *close = (char *)xml_structural_index_find(&index, open, '>');
+            if (close == end) {
+                xml_lazy_report(document, open);
+                break;
+            }
+            if (depth == 0) {
+                // an end tag where the root element should start
+                xml_parser_fail(parser, XML_ERROR_SYNTAX, "Element name is empty", open + 1);
+                break;
+            }
+            XMLLazyRange *range = &document->ranges[open_ranges[depth - 1]];
+            range->end = (size_t)(close + 1 - data);
+            range->next = document->ranges_size;
+            cursor = close + 1;
+            if (--depth == 0) {
+                result = 0;
+                break;
+            }
+            continue;
+        }
+
+        if (open[1] == '!' || open[1] == '?') {
+            char *after = xml_structural_skip_section(open, end);
+            if (after == NULL) {
+                xml_lazy_report(document, open);
+                break;
+            }
+            cursor = after;
+            continue;
+        }
+
+        // the root of the document is at depth 1
+        if (parser->max_depth > 0 && depth + 1 > parser->max_depth) {
+            xml_parser_fail(parser, XML_ERROR_MAX_DEPTH, "Maximum nesting depth exceeded", open);
+            break;
+        }
+        char *close = xml_structural_tag_end(&index, open + 1);
+        if (close == NULL) {
+            xml_lazy_report(document, open);
+            break;
+        }
+        size_t range = document->ranges_size;
+        if (xml_lazy_push_range(document, (size_t)(open - data)) != 0) {
+            break;
+        }
+        XML_STATS(parser->stats.max_depth = depth + 1 > parser->stats.max_depth ? depth + 1 : parser->stats.max_depth);
+        cursor = close + 1;
+        if (close[-1] == '/') {
+            document->ranges[range].end = (size_t)(cursor - data);
+            document->ranges[range].next = document->ranges_size;
+            if (depth == 0) {
+                result = 0;
+                break;
+            }
+            continue;
+        }
+
+        if (depth == depth_capacity) {
+            size_t capacity = depth_capacity > 0 ? depth_capacity * 2 : 64;
+            size_t *ranges = realloc(open_ranges, capacity * sizeof(size_t));
+            if (ranges == NULL) {
+                xml_parser_fail(parser, XML_ERROR_MEMORY, "Out of memory", open);
+                break;
+            }
+            open_ranges = ranges;
+            depth_capacity = capacity;
+        }
+        open_ranges[depth++] = range;
+    }
+
+    free(open_ranges);
+    xml_structural_index_free(&index);
+    return result;
+}
+
+// Reads the text runs of element, tokenizing its content around the ranges
+// of its children, which are counted to place the runs
+static int xml_lazy_read_text(XMLLazyDocument *document, XMLElement *element, char *cursor) {
+    XMLParser *parser = &document->parser;
+    size_t parent = ((XMLLazyElement *)element)->range;
+    size_t child = parent + 1;
+    size_t children = 0;
+    XMLText *last_text = NULL;
+
+    while (1) {
+        if (child < document->ranges[parent].next && xml_scan_skip_whitespace(cursor, parser->end) == document->data + document->ranges[child].start) {
+            cursor = document->data + document->ranges[child].end;
+            child = document->ranges[child].next;
+            children++;
+            continue;
+        }
+
+        XMLToken token;
+        if (xml_parser_next_token(parser, cursor, &token) != XML_TOKEN_OK) {
+            xml_parser_report(parser, &token);
+            return -1;
+        }
+        xml_parser_count(parser, &token);
+        cursor = (char *)token.end;
+
+        switch (token.type) {
+            case XML_TOKEN_END_TAG:
+                // the skip pass only counted the tags, the names are checked here
+                if (token.name_size != element->name_size || memcmp(element->name, token.name, token.name_size) != 0) {
+                    xml_parser_fail(parser, XML_ERROR_MISMATCHED_TAG, "Mismatch in closing tag", token.start);
+                    return -1;
+                }
+                return 0;
+
+            case XML_TOKEN_TEXT:
+            case XML_TOKEN_CDATA: {
+                XMLText *text = xml_parser_new_text(parser, &token, children);
+                if (!text) {
+                    return -1;
+                }
+                xml_element_append_text(element, &last_text, text);
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+}
+
+// Builds the element of a range, with its attributes and text
+static XMLElement *xml_lazy_new_element(XMLLazyDocument *document, size_t range, XMLElement *parent_element) {
+    XMLParser *parser = &document->parser;
+    XMLToken token;
+    if (xml_tokenize_start_tag(document->data + document->ranges[range].start, parser->end, &token, &parser->attributes) != XML_TOKEN_OK) {
+        xml_parser_report(parser, &token);
+        return NULL;
+    }
+
+    XMLElement *element = xml_parser_new_element(parser, &token, parent_element);
+    if (!element) {
+        return NULL;
+    }
+    XMLLazyElement *lazy = (XMLLazyElement *)element;
+    lazy->document = document;
+    lazy->range = range;
+    element->children_pending = document->ranges[range].next > range + 1;
+
+    if (!token.self_closing && xml_lazy_read_text(document, element, (char *)token.end) != 0) {
+        return NULL;
+    }
+    return element;
+}
+
+// An error leaves the element with the children built before it
+static void xml_lazy_build_children(XMLElement *element) {
+    XMLLazyElement *lazy = (XMLLazyElement *)element;
+    XMLLazyDocument *document = lazy->document;
+    XMLElement *last_child = NULL;
+
+    element->children_pending = 0;
+    for (size_t range = lazy->range + 1; range < document->ranges[lazy->range].next; range = document->ranges[range].next) {
+        XMLElement *child = xml_lazy_new_element(document, range, element);
+        if (!child) {
+            return;
+        }
+        if (last_child == NULL) {
+            element->children = child;
+        } else {
+            last_child->next_sibling = child;
+        }
+        last_child = child;
+    }
+}
+
+// Skips the root element and builds it. On success the parser belongs to the
+// new file->lazy and must not be released by the caller.
+static XMLElement *xml_parse_root_lazy(XMLFile *file, char *data, char **cursor, XMLParser *parser) {
+    char *open = (char *)xml_scan_skip_whitespace(*cursor, parser->end);
+    if (open == parser->end || *open != '<') {
+        // the same error as a full parse
+        return parse_xml_element(cursor, NULL, parser);
+    }
+
+    XMLLazyDocument *document = malloc(sizeof(XMLLazyDocument));
+    if (document == NULL) {
+        xml_parser_fail(parser, XML_ERROR_MEMORY, "Out of memory", open);
+        return NULL;
+    }
+    document->parser = *parser;
+    document->parser.element_size = sizeof(XMLLazyElement);
+    document->data = data;
+    document->ranges = NULL;
+    document->ranges_size = 0;
+    document->ranges_capacity = 0;
+    file->lazy = document;
+
+    if (xml_lazy_skip(document, open) != 0) {
+        return NULL;
+    }
+    *cursor = document->data + document->ranges[0].end;
+    XMLElement *root = xml_lazy_new_element(document, 0, NULL);
+    // the skip pass saw every element, only the root is built so far
+    XML_STATS(document->parser.stats.elements = document->ranges_size);
+    return root;
+}
+
+// Document-wide tag-name index. The elements of every name are listed in
+// document order, back to back in one array: those named atom are
+// elements[offsets[atom]..offsets[atom + 1]). With the pre/post-order numbers
+// the descendants of an element form one contiguous run of each list, found by
+// binary search.
+struct XMLTagIndex {
+    XMLElement **elements;
+    size_t *offsets;
+    size_t atom_count; // atoms of the name table when the index was built
+};
+
+static XMLTagIndex *xml_tag_index_build(XMLArena *arena, XMLNameTable *names, XMLElement *root) {
+    XMLTagIndex *index = xml_arena_alloc(arena, sizeof(XMLTagIndex));
+    if (index == NULL) {
+        return NULL;
+    }
+    index->atom_count = names->count;
+    index->offsets = xml_arena_alloc(arena, (index->atom_count + 1) * sizeof(size_t));
+    if (index->offsets == NULL) {
+        return NULL;
+    }
+    memset(index->offsets, 0, (index->atom_count + 1) * sizeof(size_t));
+
+    // number the elements and count them per name, offsets[atom + 1] for now
+    size_t pre = 0;
+    size_t post = 0;
+    XMLElement *element = root;
+    while (element != NULL) {
+        element->pre_order = pre++;
+        index->offsets[element->name_atom + 1]++;
+        if (element->children != NULL) {
+            element = element->children;
+            continue;
+        }
+        // leave the leaf and every ancestor it is the last child of
+        while (1) {
+            element->post_order = post++;
+            if (element == root) {
+                element = NULL;
+                break;
+            }
+            if (element->next_sibling != NULL) {
+                element = element->next_sibling;
+                break;
+            }
+            element = element->parent;
+        }
+    }
+
+    for (size_t atom = 0; atom < index->atom_count; atom++) {
+        index->offsets[atom + 1] += index->offsets[atom];
+    }
+
+    index->elements = xml_arena_alloc(arena, pre * sizeof(XMLElement *));
+    if (index->elements == NULL) {
+        return NULL;
+    }
+    // fill in document order, offsets[atom] is the fill position meanwhile and
+    // ends up at the start of the next list, hence the shift back afterwards
+    for (element = root; element != NULL; element = xml_element_next_in_subtree(element, root)) {
+        index->elements[index->offsets[element->name_atom]++] = element;
+    }
+    for (size_t atom = index->atom_count; atom > 0; atom--) {
+        index->offsets[atom] = index->offsets[atom - 1];
+    }
+    index->offsets[0] = 0;
+    return index;
+}
+
+// The tag index numbers every element, so a lazy document is built whole first
+static void xml_document_build_all(XMLFile *file) {
+    if (file->lazy == NULL) {
+        return;
+    }
+    // walking the whole tree builds every pending element on the way
+    XMLElement *element = file->root;
+    while (element != NULL) {
+        xml_element_children(element);
+        element = xml_element_next_in_subtree(element, file->root);
+    }
+}
+
+static const XMLLoadOptions xml_default_load_options = { XML_LOAD_DEFAULT, 0, NULL, 0, NULL, NULL, NULL, NULL };
+
+// Hands the error the parser stopped at to the caller of the load
+static void xml_parser_publish_error(const XMLParser *parser, const XMLSource *source, const XMLLoadOptions *options) {
+    if (options->error != NULL && parser->error.code != XML_ERROR_NONE) {
+        *options->error = parser->error;
+        xml_source_locate(options->error, source, options->flags);
+    }
+}
+
+// Warns about anything but comments and processing instructions after the
+// root element, which the parse otherwise leaves alone
+static void xml_parser_check_trailing(XMLParser *parser, const XMLSource *source, char *cursor, const XMLLoadOptions *options) {
+    while ((cursor = (char *)xml_scan_skip_whitespace(cursor, parser->end)) < parser->end) {
+        XMLToken token;
+        if (xml_tokenize_content(cursor, parser->end, &token, &parser->attributes) != XML_TOKEN_OK
+            || (token.type != XML_TOKEN_COMMENT && token.type != XML_TOKEN_PROCESSING_INSTRUCTION)) {
+            xml_source_warn(source, options, XML_ERROR_TRAILING_CONTENT, "Content after the root element", (size_t)(cursor - parser->start));
+            return;
+        }
+        cursor = (char *)token.end;
+    }
+}
+
+// Parses the XML declaration at *cursor into file. The version and the
+// encoding end at terminators[0] and terminators[1], where in-situ documents
+// terminate them once the whole source has been parsed.
+static int xml_parse_declaration(XMLFile *file, XMLParser *parser, char **cursor, char **terminators) {
+    char *current_pos = *cursor;
+    char *source_end = parser->end;
+    if (source_end - current_pos < 2 || *current_pos != '<'|| *(current_pos + 1) != '?') {
+        xml_parser_fail(parser, XML_ERROR_DECLARATION, "Expected <? to start the XML declaration", current_pos);
+        return -1;
+    }
+
+    current_pos += 2; 
+
+    if (source_end - current_pos < 3 || strncmp(current_pos, "xml", 3) != 0) {
+        xml_parser_fail(parser, XML_ERROR_DECLARATION, "Expected 'xml' after '<?'", current_pos);
+        return -1;
+    }
+
+    current_pos += 3;
+
+    char *end = xml_find_sequence(current_pos, source_end, "?>");
+    if (end == NULL) {
+        xml_parser_fail(parser, XML_ERROR_DECLARATION, "XML declaration not closed with ?>", *cursor);
+        return -1;
+    }
+
+    char *version_start = xml_find_sequence(current_pos, end, "version=\"");
+    if (version_start == NULL) {
+        xml_parser_fail(parser, XML_ERROR_DECLARATION, "XML declaration missing version", current_pos);
+        return -1;
+    }
+
+    version_start += strlen("version=\"");
+
+    char *version_end = xml_find_sequence(version_start, end, "\"");
+    if (version_end == NULL) {
+        xml_parser_fail(parser, XML_ERROR_DECLARATION, "Version string not terminated", version_start);
+        return -1;
+    }
+
+    long size = version_end - version_start;
+    if (size <= 0) {
+        xml_parser_fail(parser, XML_ERROR_DECLARATION, "Version string is empty", version_start);
+        return -1;
+    }
+
+    file->version = xml_parser_name(parser, version_start, size);
+    if (file->version == NULL) {
+        xml_parser_fail(parser, XML_ERROR_MEMORY, "Out of memory", version_start);
+        return -1;
+    }
+
+    current_pos = version_end + 1;
+
+    char *encoding_start = xml_find_sequence(current_pos, end, "encoding=\"");
+    if (encoding_start == NULL) { 
+        xml_parser_fail(parser, XML_ERROR_DECLARATION, "XML declaration missing encoding", current_pos);
+        return -1;
+    }
+
+    encoding_start += strlen("encoding=\"");
+
+    char *encoding_end = xml_find_sequence(encoding_start, end, "\"");
+    if (encoding_end == NULL) {
+        xml_parser_fail(parser, XML_ERROR_DECLARATION, "Encoding string not terminated", encoding_start);
+        return -1;
+    }
+
+    long encoding_size = encoding_end - encoding_start;
+    if (encoding_size <= 0) {
+        xml_parser_fail(parser, XML_ERROR_DECLARATION, "Encoding string is empty", encoding_start);
+        return -1;
+    }
+
+    file->encoding = xml_parser_name(parser, encoding_start, encoding_size);
+    if (file->encoding == NULL) {
+        xml_parser_fail(parser, XML_ERROR_MEMORY, "Out of memory", encoding_start);
+        return -1;
+    }
+
+    terminators[0] = version_end;
+    terminators[1] = encoding_end;
+    *cursor = end + 2;
+    return 0;
+}
+
+// Parses the XML declaration and the root element of source into file.
+// Returns -1 if the declaration is malformed, file->root is NULL when the
+// root element itself could not be parsed. Either way options->error says why.
+static int xml_parse_source(XMLFile *file, XMLSource *source, const XMLLoadOptions *options) {
+    // strings of lazy documents are copied, a terminator written in place
+    // could fall inside markup that is only parsed later
+    XMLLoadOptions lazy_options;
+    if (options->flags & XML_LOAD_LAZY) {
+        lazy_options = *options;
+        lazy_options.flags &= ~XML_LOAD_IN_SITU;
+        options = &lazy_options;
+    }
+    unsigned int flags = options->flags;
+    XMLParseStats *stats = options->stats;
+    unsigned long long mark = xml_stats_clock(stats);
+
+    XMLParser parser;
+    xml_parser_init(&parser, file->arena, file->names, source->region, source->data + source->size, options);
+
+    char *current_pos = source->data;
+    char *terminators[2];
+    if (xml_parse_declaration(file, &parser, &current_pos, terminators) != 0) {
+        xml_parser_publish_error(&parser, source, options);
+        return -1;
+    }
+    XML_STATS_PHASE(stats, declaration_ns, mark);
+
+    int terminated = 0;
+    size_t threads = (flags & XML_LOAD_PARALLEL) ? xml_parallel_threads(options) : 1;
+    if (flags & XML_LOAD_LAZY) {
+        file->root = xml_parse_root_lazy(file, source->data, &current_pos, &parser);
+    } else if (threads > 1) {
+        file->root = xml_parse_root_parallel(&current_pos, &parser, threads, &terminated);
+    } else {
+        file->root = parse_xml_element(&current_pos, NULL, &parser);
+    }
+    // a lazy document took the parser over, and goes on in its copy
+    XMLParser *active = file->lazy != NULL ? &file->lazy->parser : &parser;
+    xml_parser_publish_error(active, source, options);
+    if (file->root != NULL && options->warning != NULL) {
+        xml_parser_check_trailing(active, source, current_pos, options);
+    }
+#ifndef XML_DISABLE_PARSE_STATS
+    if (stats != NULL) {
+        xml_stats_add_counts(stats, &active->stats);
+    }
+#endif
+    if (file->lazy == NULL) {
+        xml_parser_release(&parser);
+    }
+    XML_STATS_PHASE(stats, parse_ns, mark);
+
+    if ((flags & XML_LOAD_BUILD_INDEX) && file->root != NULL) {
+        xml_document_build_all(file);
+        file->index = xml_tag_index_build(file->arena, file->names, file->root);
+        if (file->index == NULL) {
+            xml_error_set(options->error, XML_ERROR_MEMORY, "Out of memory", 0);
+            return -1;
+        }
+        XML_STATS_PHASE(stats, index_ns, mark);
+    }
+
+    if ((flags & XML_LOAD_IN_SITU) && !(flags & XML_LOAD_BORROW_BUFFER)) {
+        *terminators[0] = '\0';
+        *terminators[1] = '\0';
+        if (file->root != NULL && !terminated) {
+            xml_terminate_in_situ(file->root);
+        }
+        XML_STATS_PHASE(stats, parse_ns, mark);
+    }
+    return 0;
+}
+
+// Picks the name table the atoms of the next parse come from: the caller's
+// shared table, or the document's own one, created on first use
+static int xml_document_use_names(XMLFile *file, const XMLLoadOptions *options) {
+    if (options->names != NULL) {
+        if (!file->shared_names) {
+            xml_name_table_free(file->names);
+        }
+        file->names = options->names;
+        file->shared_names = 1;
+        return 0;
+    }
+
+    if (file->shared_names) {
+        file->names = NULL;
+        file->shared_names = 0;
+    }
+    if (file->names == NULL) {
+        file->names = xml_name_table_create(file->arena);
+        if (file->names == NULL) {
+            xml_error_set(options->error, XML_ERROR_MEMORY, "Out of memory", 0);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Parses source into file. In-situ and lazy documents keep the source until
+// they are reset or unloaded, otherwise it is released as soon as the parse
+// is done.
+static int xml_document_parse_source(XMLFile *file, XMLSource *source, const XMLLoadOptions *options) {
+    if (xml_document_use_names(file, options) != 0
+        || (!(options->flags & XML_LOAD_SKIP_ENCODING) && xml_source_decode(source, options) != 0)) {
+        xml_source_locate(options->error, source, options->flags);
+        xml_source_close(source);
+        return -1;
+    }
+
+    // a borrowed buffer that had to be transcoded is no longer the caller's,
+    // the values point into the copy
+    int borrowed_copy = (options->flags & XML_LOAD_BORROW_BUFFER) && !source->borrowed;
+    if (!(options->flags & (XML_LOAD_IN_SITU | XML_LOAD_LAZY)) && !borrowed_copy) {
+        int result = xml_parse_source(file, source, options);
+        xml_source_close(source);
+        return result;
+    }
+
+    file->source = xml_arena_alloc(file->arena, sizeof(XMLSource));
+    if (file->source == NULL) {
+        xml_error_set(options->error, XML_ERROR_MEMORY, "Out of memory", 0);
+        xml_source_close(source);
+        return -1;
+    }
+    *file->source = *source;
+    return xml_parse_source(file, file->source, options);
+}
+
+// xml_document_parse_source, finishing the statistics of a load that started
+// at started, before its source was read
+static int xml_document_adopt_source(XMLFile *file, XMLSource *source, const XMLLoadOptions *options, unsigned long long started) {
+#ifndef XML_DISABLE_PARSE_STATS
+    XMLParseStats *stats = options->stats;
+    size_t allocations = file->arena->allocations;
+    size_t allocated_bytes = file->arena->allocated_bytes;
+    if (stats != NULL) {
+        stats->bytes_read = source->size;
+        stats->read_ns = xml_stats_now() - started;
+    }
+
+    int result = xml_document_parse_source(file, source, options);
+
+    if (stats != NULL) {
+        stats->allocations = file->arena->allocations - allocations;
+        stats->allocated_bytes = file->arena->allocated_bytes - allocated_bytes;
+        stats->total_ns = xml_stats_now() - started;
+    }
+    return result;
+#else
+    (void)started;
+    return xml_document_parse_source(file, source, options);
+#endif
+}
+
+XMLFile *xml_document_new(void) {
+    XMLFile *file = malloc(sizeof(XMLFile));
+    if(file == NULL) {
+        return NULL;
+    }
+    
+    file->version = NULL;
+    file->encoding = NULL;
+    file->root = NULL;
+    file->source = NULL;
+    file->names = NULL;
+    file->shared_names = 0;
+    file->index = NULL;
+    file->lazy = NULL;
+
+    file->arena = xml_arena_new();
+    if (file->arena == NULL) {
+        free(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+void xml_document_reset(XMLFile *file) {
+    if (file == NULL) {
+        return;
+    }
+
+    file->version = NULL;
+    file->encoding = NULL;
+    file->root = NULL;
+    file->index = NULL;
+    xml_lazy_free(file->lazy);
+    file->lazy = NULL;
+    if (file->source != NULL) {
+        xml_source_close(file->source);
+        file->source = NULL;
+    }
+    if (file->names != NULL && !file->shared_names) {
+        xml_name_table_reset(file->names);
+    }
+    xml_arena_reset(file->arena);
+}
+
+// Files and descriptors are read into memory the document owns, there is
+// nothing the caller could lend
+static XMLLoadOptions xml_file_load_options(const XMLLoadOptions *options) {
+    XMLLoadOptions file_options = options != NULL ? *options : xml_default_load_options;
+    file_options.flags &= ~XML_LOAD_BORROW_BUFFER;
+    return file_options;
+}
+
+static XMLFile *xml_load_source(XMLSource *source, const XMLLoadOptions *options, unsigned long long started) {
+    XMLFile *file = xml_document_new();
+    if (file == NULL) {
+        xml_error_set(options->error, XML_ERROR_MEMORY, "Out of memory", 0);
+        xml_source_close(source);
+        return NULL;
+    }
+
+    // a root element that fails to parse still returns the file, like before
+    if (xml_document_adopt_source(file, source, options, started) != 0) {
+        xml_unload(file);
+        return NULL;
+    }
+    return file;
+}
+
+int xml_load_into(XMLFile *file, const char *filepath, const XMLLoadOptions *options) {
+    XMLLoadOptions file_options = xml_file_load_options(options);
+    unsigned long long started = xml_load_begin(&file_options);
+
+    xml_document_reset(file);
+
+    XMLSource source;
+    if(xml_source_open(&source, filepath, file_options.flags) != 0) {
+        xml_error_set_system(file_options.error, "Could not read the file");
+        return -1;
+    }
+
+    int result = xml_document_adopt_source(file, &source, &file_options, started);
+
+    if (result != 0 || file->root == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+int xml_load_buffer_into(XMLFile *file, const char *data, size_t len, const XMLLoadOptions *options) {
+    if (options == NULL) {
+        options = &xml_default_load_options;
+    }
+    unsigned long long started = xml_load_begin(options);
+
+    xml_document_reset(file);
+
+    XMLSource source;
+    if (xml_source_open_buffer(&source, data, len, options->flags) != 0) {
+        xml_error_set(options->error, XML_ERROR_MEMORY, "Out of memory", 0);
+        return -1;
+    }
+
+    int result = xml_document_adopt_source(file, &source, options, started);
+
+    if (result != 0 || file->root == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+XMLFile *xml_load(const char *filepath) {
+    return xml_load_ex(filepath, NULL);
+}
+
+XMLFile *xml_load_ex(const char *filepath, const XMLLoadOptions *options) {
+    XMLLoadOptions file_options = xml_file_load_options(options);
+    unsigned long long started = xml_load_begin(&file_options);
+
+    XMLSource source;
+    if(xml_source_open(&source, filepath, file_options.flags) != 0) {
+        xml_error_set_system(file_options.error, "Could not read the file");
+        return NULL;
+    }
+
+    return xml_load_source(&source, &file_options, started);
+}
+
+XMLFile *xml_load_fd(int fd) {
+    return xml_load_fd_ex(fd, NULL);
+}
+
+XMLFile *xml_load_fd_ex(int fd, const XMLLoadOptions *options) {
+    XMLLoadOptions file_options = xml_file_load_options(options);
+    unsigned long long started = xml_load_begin(&file_options);
+
+    XMLSource source;
+    if(xml_source_open_fd(&source, fd, file_options.flags) != 0) {
+        xml_error_set_system(file_options.error, "Could not read the file descriptor");
+        return NULL;
+    }
+
+    return xml_load_source(&source, &file_options, started);
+}
+
+XMLFile *xml_load_buffer(const char *data, size_t len) {
+    return xml_load_buffer_ex(data, len, NULL);
+}
+
+XMLFile *xml_load_buffer_ex(const char *data, size_t len, const XMLLoadOptions *options) {
+    if (options == NULL) {
+        options = &xml_default_load_options;
+    }
+    unsigned long long started = xml_load_begin(options);
+
+    XMLSource source;
+    if (xml_source_open_buffer(&source, data, len, options->flags) != 0) {
+        xml_error_set(options->error, XML_ERROR_MEMORY, "Out of memory", 0);
+        return NULL;
+    }
+
+    return xml_load_source(&source, options, started);
+}
+
+// Record splitting (see xml_load_records). The events of the streaming reader
+// are built into a scratch document one record at a time, the same way the
+// parser builds a tree from its tokens.
+
+typedef struct XMLRecordBuilder {
+    XMLFile *file; // the scratch document, reset after every record
+    XMLRecordCallback callback;
+    void *context;
+
+    // steps of an absolute record path, or the one name of a path that
+    // matches at any depth
+    XMLStringView *steps;
+    size_t steps_count;
+    int anywhere;
+    size_t matched; // open elements outside a record that match the leading steps
+    size_t max_depth; // 0 for no limit
+
+    // open elements of the record being built, none outside a record
+    XMLParseFrame *frames;
+    size_t depth;
+    size_t frames_capacity;
+    // attributes of the innermost open element until its first child, text
+    // or end shows up, when they are moved into the arena in one block
+    XMLAttribute *attributes;
+    size_t attributes_count;
+    size_t attributes_capacity;
+    int collecting;
+
+    long records;
+    int stopped; // the callback asked for no more records
+    XMLError error; // the first one, events do not say where they come from
+} XMLRecordBuilder;
+
+static int xml_record_fail(XMLRecordBuilder *builder, XMLErrorCode code, const char *message) {
+    xml_error_set(&builder->error, code, message, 0);
+    return -1;
+}
+
+static int xml_record_path_parse(XMLRecordBuilder *builder, const char *record_path) {
+    const char *cursor = record_path;
+    builder->anywhere = cursor[0] != '/' || cursor[1] == '/';
+    if (cursor[0] == '/') {
+        cursor += builder->anywhere ? 2 : 1;
+    }
+
+    size_t count = 1;
+    for (const char *c = cursor; *c != '\0'; c++) {
+        count += *c == '/';
+    }
+    if (builder->anywhere && count > 1) {
+        return xml_record_fail(builder, XML_ERROR_SYNTAX, "Record paths that match at any depth take a single name");
+    }
+    builder->steps = malloc(count * sizeof(XMLStringView));
+    if (builder->steps == NULL) {
+        return xml_record_fail(builder, XML_ERROR_MEMORY, "Out of memory");
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const char *end = strchr(cursor, '/');
+        if (end == NULL) {
+            end = cursor + strlen(cursor);
+        }
+        if (end == cursor) {
+            return xml_record_fail(builder, XML_ERROR_SYNTAX, "Empty step in record path");
+        }
+        builder->steps[i].data = cursor;
+        builder->steps[i].size = (size_t)(end - cursor);
+        cursor = end + 1;
+    }
+    builder->steps_count = count;
+    return 0;
+}
+
+static int xml_record_step_matches(const XMLStringView *step, XMLStringView name) {
+    if (step->size == 1 && step->data[0] == '*') {
+        return 1;
+    }
+    return step->size == name.size && memcmp(step->data, name.data, name.size) == 0;
+}
+
+// Moves the collected attributes of the innermost open element into the arena
+static int xml_record_end_attributes(XMLRecordBuilder *builder) {
+    if (!builder->collecting) {
+        return 0;
+    }
+    builder->collecting = 0;
+    size_t count = builder->attributes_count;
+    if (count == 0) {
+        return 0;
+    }
+
+    XMLElement *element = builder->frames[builder->depth - 1].element;
+    size_t size = count * sizeof(XMLAttribute);
+    size_t slots_size = xml_attribute_hash_size(count);
+    element->attributes = xml_arena_alloc(builder->file->arena, size + slots_size);
+    if (element->attributes == NULL) {
+        return xml_record_fail(builder, XML_ERROR_MEMORY, "Out of memory");
+    }
+    memcpy(element->attributes, builder->attributes, size);
+    element->attributes_size = (int)count;
+    if (slots_size > 0) {
+        xml_element_hash_attributes(element, builder->file->names);
+    }
+    return 0;
+}
+
+static int xml_record_attribute(XMLRecordBuilder *builder, const XMLEvent *event) {
+    if (builder->attributes_count == builder->attributes_capacity) {
+        size_t capacity = builder->attributes_capacity > 0 ? builder->attributes_capacity * 2 : 16;
+        XMLAttribute *attributes = realloc(builder->attributes, capacity * sizeof(XMLAttribute));
+        if (attributes == NULL) {
+            return xml_record_fail(builder, XML_ERROR_MEMORY, "Out of memory");
+        }
+        builder->attributes = attributes;
+        builder->attributes_capacity = capacity;
+    }
+
+    XMLAttribute *attr = &builder->attributes[builder->attributes_count++];
+    attr->name = (char *)xml_name_table_intern(builder->file->names, event->name.data, event->name.size, &attr->name_atom);
+    attr->name_size = event->name.size;
+    attr->value = xml_arena_strndup(builder->file->arena, event->value.data, event->value.size);
+    attr->value_size = event->value.size;
+    attr->value_flags = xml_value_flags(event->value.data, event->value.size);
+    attr->decoded_value = NULL;
+    attr->decoded_value_size = 0;
+    if (!attr->name || !attr->value) {
+        return xml_record_fail(builder, XML_ERROR_MEMORY, "Out of memory");
+    }
+    return 0;
+}
+
+static int xml_record_start(XMLRecordBuilder *builder, const XMLEvent *event) {
+    if (xml_record_end_attributes(builder) != 0) {
+        return -1;
+    }
+    if (builder->depth == builder->frames_capacity) {
+        size_t capacity = builder->frames_capacity > 0 ? builder->frames_capacity * 2 : 64;
+        XMLParseFrame *frames = realloc(builder->frames, capacity * sizeof(XMLParseFrame));
+        if (frames == NULL) {
+            return xml_record_fail(builder, XML_ERROR_MEMORY, "Out of memory");
+        }
+        builder->frames = frames;
+        builder->frames_capacity = capacity;
+    }
+
+    XMLParseFrame *parent = builder->depth > 0 ? &builder->frames[builder->depth - 1] : NULL;
+    XMLElement *element = xml_arena_alloc(builder->file->arena, sizeof(XMLElement));
+    if (element == NULL) {
+        return xml_record_fail(builder, XML_ERROR_MEMORY, "Out of memory");
+    }
+    xml_element_init(element, parent != NULL ? parent->element : NULL);
+    element->name = (char *)xml_name_table_intern(builder->file->names, event->name.data, event->name.size, &element->name_atom);
+    element->name_size = event->name.size;
+    if (element->name == NULL) {
+        return xml_record_fail(builder, XML_ERROR_MEMORY, "Out of memory");
+    }
+
+    if (parent == NULL) {
+        builder->file->root = element;
+    } else {
+        if (parent->element->children == NULL) {
+            parent->element->children = element;
+        } else {
+            parent->last_child->next_sibling = element;
+        }
+        parent->last_child = element;
+        parent->children++;
+    }
+
+    XMLParseFrame *frame = &builder->frames[builder->depth++];
+    frame->element = element;
+    frame->last_child = NULL;
+    frame->last_text = NULL;
+    frame->children = 0;
+    builder->attributes_count = 0;
+    builder->collecting = 1;
+    return 0;
+}
+
+static int xml_record_text(XMLRecordBuilder *builder, const XMLEvent *event) {
+    if (xml_record_end_attributes(builder) != 0) {
+        return -1;
+    }
+    XMLParseFrame *frame = &builder->frames[builder->depth - 1];
+    XMLText *text = xml_arena_alloc(builder->file->arena, sizeof(XMLText));
+    if (text != NULL) {
+        text->text = xml_arena_strndup(builder->file->arena, event->value.data, event->value.size);
+    }
+    if (!text || !text->text) {
+        return xml_record_fail(builder, XML_ERROR_MEMORY, "Out of memory");
+    }
+    text->size = event->value.size;
+    text->flags = event->type == XML_EVENT_CDATA ? XML_VALUE_CDATA : xml_value_flags(event->value.data, event->value.size);
+    text->position = frame->children;
+    text->next = NULL;
+    xml_element_append_text(frame->element, &frame->last_text, text);
+    return 0;
+}
+
+// Hands the finished record to the callback and resets the scratch document
+static void xml_record_deliver(XMLRecordBuilder *builder) {
+    builder->records++;
+    builder->stopped = builder->callback(builder->context, builder->file, builder->file->root) != 0;
+    xml_document_reset(builder->file);
+}
+
+static int xml_record_event(XMLRecordBuilder *builder, const XMLEvent *event) {
+    size_t depth = (size_t)event->depth;
+    switch (event->type) {
+        case XML_EVENT_START_ELEMENT:
+            // the root of the document is at depth 1
+            if (builder->max_depth > 0 && depth > builder->max_depth) {
+                return xml_record_fail(builder, XML_ERROR_MAX_DEPTH, "Maximum nesting depth exceeded");
+            }
+            if (builder->depth > 0) {
+                return xml_record_start(builder, event);
+            }
+            if (builder->anywhere) {
+                return xml_record_step_matches(&builder->steps[0], event->name) ? xml_record_start(builder, event) : 0;
+            }
+            if (builder->matched == depth - 1 && depth <= builder->steps_count
+                && xml_record_step_matches(&builder->steps[depth - 1], event->name)) {
+                builder->matched = depth;
+                if (depth == builder->steps_count) {
+                    return xml_record_start(builder, event);
+                }
+            }
+            return 0;
+
+        case XML_EVENT_ATTRIBUTE:
+            return builder->depth > 0 ? xml_record_attribute(builder, event) : 0;
+
+        case XML_EVENT_TEXT:
+        case XML_EVENT_CDATA:
+            return builder->depth > 0 ? xml_record_text(builder, event) : 0;
+
+        case XML_EVENT_COMMENT:
+            return 0;
+
+        case XML_EVENT_END_ELEMENT:
+            if (builder->matched >= depth) {
+                builder->matched = depth - 1;
+            }
+            if (builder->depth == 0) {
+                return 0;
+            }
+            if (xml_record_end_attributes(builder) != 0) {
+                return -1;
+            }
+            if (--builder->depth == 0) {
+                xml_record_deliver(builder);
+            }
+            return 0;
+    }
+    return 0;
+}
+
+// The XMLEventHandler of the loads, context is the builder. Stops the load
+// once the callback asked for no more records.
+static int xml_records_event(void *context, const XMLEvent *event) {
+    XMLRecordBuilder *builder = context;
+    if (xml_record_event(builder, event) != 0) {
+        return -1;
+    }
+    return builder->stopped;
+}
+
+static int xml_records_begin(XMLRecordBuilder *builder, const char *record_path, const XMLLoadOptions *options, XMLRecordCallback callback, void *context) {
+    memset(builder, 0, sizeof(XMLRecordBuilder));
+    builder->callback = callback;
+    builder->context = context;
+    builder->max_depth = options->max_depth;
+    if (xml_record_path_parse(builder, record_path) != 0) {
+        return -1;
+    }
+
+    builder->file = xml_document_new();
+    if (builder->file == NULL) {
+        return xml_record_fail(builder, XML_ERROR_MEMORY, "Out of memory");
+    }
+    // the names outlive every reset of the document, like a shared table
+    builder->file->names = options->names != NULL ? options->names : xml_name_table_new();
+    builder->file->shared_names = 1;
+    if (builder->file->names == NULL) {
+        return xml_record_fail(builder, XML_ERROR_MEMORY, "Out of memory");
+    }
+    return 0;
+}
+
+static long xml_records_end(XMLRecordBuilder *builder, int done, const XMLLoadOptions *options) {
+    if (builder->file != NULL) {
+        XMLNameTable *names = builder->file->names;
+        xml_unload(builder->file);
+        if (names != options->names) {
+            xml_name_table_free(names);
+        }
+    }
+    free(builder->steps);
+    free(builder->frames);
+    free(builder->attributes);
+    if (done != 1 && builder->error.code == XML_ERROR_NONE) {
+        xml_record_fail(builder, XML_ERROR_MEMORY, "Out of memory");
+    }
+    if (options->error != NULL) {
+        *options->error = builder->error;
+    }
+    return done == 1 ? builder->records : -1;
+}
+
+long xml_load_records_buffer(const char *data, size_t len, const char *record_path, const XMLLoadOptions *options, XMLRecordCallback callback, void *context) {
+    if (options == NULL) {
+        options = &xml_default_load_options;
+    }
+    XMLRecordBuilder builder;
+    if (xml_records_begin(&builder, record_path, options, callback, context) != 0) {
+        return xml_records_end(&builder, -1, options);
+    }
+
+    int done = xml_decode_buffer(data, len, options, xml_records_event, &builder, &builder.error);
+    return xml_records_end(&builder, done, options);
+}
+
+long xml_load_records(const char *filepath, const char *record_path, const XMLLoadOptions *options, XMLRecordCallback callback, void *context) {
+    if (options == NULL) {
+        options = &xml_default_load_options;
+    }
+    XMLRecordBuilder builder;
+    if (xml_records_begin(&builder, record_path, options, callback, context) != 0) {
+        return xml_records_end(&builder, -1, options);
+    }
+
+    int done = xml_decode_file(filepath, options, xml_records_event, &builder, &builder.error, NULL);
+    return xml_records_end(&builder, done, options);
+}
+
+const XMLError *xml_document_error(const XMLFile *file) {
+    if (file == NULL || file->lazy == NULL || file->lazy->parser.error.code == XML_ERROR_NONE) {
+        return NULL;
+    }
+    return &file->lazy->parser.error;
+}
+
+void xml_unload(XMLFile *file_struct) {
+    if (file_struct == NULL) {
+        return;
+    }
+
+    xml_lazy_free(file_struct->lazy);
+    file_struct->lazy = NULL;
+    if (file_struct->source != NULL) {
+        xml_source_close(file_struct->source);
+        file_struct->source = NULL;
+    }
+
+    if (!file_struct->shared_names) {
+        xml_name_table_free(file_struct->names);
+    }
+    file_struct->names = NULL;
+
+    // every element, attribute and string lives in the arena
+    xml_arena_free(file_struct->arena);
+    file_struct->arena = NULL;
+    file_struct->version = NULL;
+    file_struct->encoding = NULL;
+    file_struct->root = NULL;
+
+    free(file_struct);
+}
+
+// first element named tag_name in the subtree of current_element, itself included
+XMLElement* find_element_by_name(XMLElement *current_element, const char *tag_name) {
+    if (current_element == NULL || tag_name == NULL) {
+        return NULL;
+    }
+
+    size_t tag_size = strlen(tag_name);
+    XMLElement *element = current_element;
+    while (element != NULL) {
+        if (element->name_size == tag_size && memcmp(element->name, tag_name, tag_size) == 0) {
+            return element;
+        }
+        element = xml_element_next_in_subtree(element, current_element);
+    }
+
+    return NULL;
+}
+
+XMLElement* xml_element_get_child(XMLElement *start_element, const char *tag_name) {
+    if (start_element == NULL || tag_name == NULL) {
+        return NULL;
+    }
+
+    size_t tag_size = strlen(tag_name);
+    XMLElement *element = xml_element_children(start_element);
+    while (element != NULL) {
+        if (element->name_size == tag_size && memcmp(element->name, tag_name, tag_size) == 0) {
+            return element;
+        }
+        element = xml_element_next_in_subtree(element, start_element);
+    }
+    return NULL;
+}
+
+XMLElement* xml_element_children(XMLElement *element) {
+    if (element == NULL) {
+        return NULL;
+    }
+    if (element->children_pending) {
+        xml_lazy_build_children(element);
+    }
+    return element->children;
+}
+
+XMLAttribute* xml_attribute_get(XMLElement *current_element, const char *attr_name) {
+    if (current_element == NULL || attr_name == NULL) {
+        return NULL;
+    }
+
+    size_t attr_size = strlen(attr_name);
+    if (current_element->attributes_size >= XML_ATTRIBUTE_HASH_THRESHOLD) {
+        uint32_t slot = *xml_attribute_slot(current_element, attr_name, attr_size, xml_name_hash(attr_name, attr_size));
+        return slot != 0 ? &current_element->attributes[slot - 1] : NULL;
+    }
+
+    for (int i = 0; i < current_element->attributes_size; i++) {
+        XMLAttribute *child = &current_element->attributes[i];
+        if (child->name_size == attr_size && memcmp(child->name, attr_name, attr_size) == 0) {
+            return child;
+        }
+    }
+
+    return NULL;
+}
+
+XMLAttribute* xml_attribute_at(XMLElement *element, size_t index) {
+    if (element == NULL || index >= (size_t)element->attributes_size) {
+        return NULL;
+    }
+    return &element->attributes[index];
+}
+
+XMLAtom xml_atom_lookup(const XMLFile *file, const char *name) {
+    if (file == NULL) {
+        return XML_ATOM_NONE;
+    }
+    return xml_name_table_lookup(file->names, name);
+}
+
+const char *xml_atom_name(const XMLFile *file, XMLAtom atom) {
+    if (file == NULL) {
+        return NULL;
+    }
+    return xml_name_table_name(file->names, atom);
+}
+
+XMLElement* xml_element_get_child_atom(XMLElement *start_element, XMLAtom atom) {
+    if (start_element == NULL || atom == XML_ATOM_NONE) {
+        return NULL;
+    }
+
+    XMLElement *element = xml_element_children(start_element);
+    while (element != NULL) {
+        if (element->name_atom == atom) {
+            return element;
+        }
+        element = xml_element_next_in_subtree(element, start_element);
+    }
+    return NULL;
+}
+
+int xml_document_build_index(XMLFile *file) {
+    if (file == NULL || file->root == NULL) {
+        return -1;
+    }
+    if (file->index == NULL) {
+        xml_document_build_all(file);
+        file->index = xml_tag_index_build(file->arena, file->names, file->root);
+        if (file->index == NULL) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+XMLElementList xml_find_all(XMLFile *file, XMLElement *start_element, const char *tag_name) {
+    XMLElementList list = { NULL, 0 };
+    if (tag_name == NULL || xml_document_build_index(file) != 0) {
+        return list;
+    }
+
+    const XMLTagIndex *index = file->index;
+    XMLAtom atom = xml_atom_lookup(file, tag_name);
+    if (atom == XML_ATOM_NONE || atom >= index->atom_count) {
+        return list;
+    }
+
+    XMLElement **first = index->elements + index->offsets[atom];
+    XMLElement **last = index->elements + index->offsets[atom + 1];
+    if (start_element != NULL) {
+        // skip what comes before start_element in document order
+        size_t low = 0;
+        size_t high = (size_t)(last - first);
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (first[middle]->pre_order <= start_element->pre_order) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        first += low;
+
+        // then keep the descendants, which all leave before start_element does
+        low = 0;
+        high = (size_t)(last - first);
+        while (low < high) {
+            size_t middle = low + (high - low) / 2;
+            if (first[middle]->post_order < start_element->post_order) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        last = first + low;
+    }
+
+    list.items = first;
+    list.count = (size_t)(last - first);
+    return list;
+}
+
+XMLElement* xml_find_first(XMLFile *file, XMLElement *start_element, const char *tag_name) {
+    XMLElementList list = xml_find_all(file, start_element, tag_name);
+    return list.count > 0 ? list.items[0] : NULL;
+}
+
+XMLAttribute* xml_attribute_get_atom(XMLElement *current_element, XMLAtom atom) {
+    if (current_element == NULL || atom == XML_ATOM_NONE) {
+        return NULL;
+    }
+
+    // large elements probe their hash with the hash the name table keeps for
+    // the atom, a short array is scanned comparing integers
+    if (current_element->attributes_size >= XML_ATTRIBUTE_HASH_THRESHOLD) {
+        const XMLNameTable *names = *xml_attribute_hash_names(current_element);
+        if (atom >= names->count) {
+            return NULL;
+        }
+        const XMLNameEntry *entry = &names->entries[atom];
+        uint32_t slot = *xml_attribute_slot(current_element, entry->name, entry->size, entry->hash);
+        return slot != 0 ? &current_element->attributes[slot - 1] : NULL;
+    }
+    for (int i = 0; i < current_element->attributes_size; i++) {
+        if (current_element->attributes[i].name_atom == atom) {
+            return &current_element->attributes[i];
+        }
+    }
+    return NULL;
 }
 
 char* xml_attribute_get_value(XMLElement *current_element, const char *attr_name) {
@@ -597,4 +2992,206 @@ char* xml_attribute_get_value(XMLElement *current_element, const char *attr_name
         return attribute->value;
     }
     return NULL;
-}
\ No newline at end of file
+}
+XMLStringView xml_element_name_view(const XMLElement *element) {
+    XMLStringView view = { NULL, 0 };
+    if (element != NULL) {
+        view.data = element->name;
+        view.size = element->name_size;
+    }
+    return view;
+}
+
+XMLStringView xml_element_text_view(const XMLElement *element) {
+    XMLStringView view = { NULL, 0 };
+    if (element != NULL && element->text_content != NULL) {
+        view.data = element->text_content;
+        view.size = element->text_size;
+    }
+    return view;
+}
+
+XMLStringView xml_attribute_value_view(const XMLAttribute *attribute) {
+    XMLStringView view = { NULL, 0 };
+    if (attribute != NULL) {
+        view.data = attribute->value;
+        view.size = attribute->value_size;
+    }
+    return view;
+}
+
+XMLStringView xml_attribute_get_value_view(XMLElement *current_element, const char *attr_name) {
+    return xml_attribute_value_view(xml_attribute_get(current_element, attr_name));
+}
+
+int xml_attribute_needs_decoding(const XMLAttribute *attribute) {
+    return attribute != NULL && (attribute->value_flags & XML_VALUE_ENTITIES) != 0;
+}
+
+int xml_element_text_needs_decoding(const XMLElement *element) {
+    return element != NULL && (element->text_flags & XML_VALUE_ENTITIES) != 0;
+}
+
+// Longer references are kept as written
+#define XML_REFERENCE_MAX 32
+
+// The references of the predefined entities, by their name between '&' and ';'
+static const struct {
+    const char *name;
+    size_t size;
+    char value;
+} xml_predefined_entities[] = {
+    { "amp", 3, '&' }, { "lt", 2, '<' }, { "gt", 2, '>' }, { "quot", 4, '"' }, { "apos", 4, '\'' }
+};
+
+// Character reference body after "&#", up to the ';' at end. 0 when it is not
+// a valid one, or a character XML does not allow in a document.
+static uint32_t xml_character_reference(const char *cursor, const char *end) {
+    unsigned int base = 10;
+    if (*cursor == 'x') {
+        base = 16;
+        cursor++;
+    }
+    if (cursor == end) {
+        return 0;
+    }
+    uint32_t code = 0;
+    for (; cursor < end; cursor++) {
+        unsigned char c = (unsigned char)*cursor;
+        unsigned int digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (base == 16 && (c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            digit = (c | 0x20) - 'a' + 10;
+        } else {
+            return 0;
+        }
+        code = code * base + digit;
+        if (code > 0x10FFFF) {
+            return 0;
+        }
+    }
+    if (code < 0x20 && code != '\t' && code != '\n' && code != '\r') {
+        return 0;
+    }
+    if ((code >= 0xD800 && code <= 0xDFFF) || code == 0xFFFE || code == 0xFFFF) {
+        return 0;
+    }
+    return code;
+}
+
+// Decodes the reference starting with the '&' at cursor into out. Returns the
+// size of the reference, or 0 when it is not one this decoder knows.
+// A reference is never shorter than what it decodes to ("&#x10000;" gives 4
+// bytes), so decoding in place never overtakes the input.
+static size_t xml_decode_reference(const char *cursor, const char *end, char *out, size_t *out_size) {
+    // the longest known references are character references, leading zeros
+    // aside "&#1114111;"
+    const char *limit = end - cursor > XML_REFERENCE_MAX ? cursor + XML_REFERENCE_MAX : end;
+    const char *semicolon = memchr(cursor, ';', (size_t)(limit - cursor));
+    if (semicolon == NULL) {
+        return 0;
+    }
+    const char *body = cursor + 1;
+    size_t body_size = (size_t)(semicolon - body);
+    if (body_size > 1 && *body == '#') {
+        uint32_t code = xml_character_reference(body + 1, semicolon);
+        if (code == 0) {
+            return 0;
+        }
+        *out_size = xml_utf8_encode(code, out);
+        return body_size + 2;
+    }
+    for (size_t i = 0; i < sizeof(xml_predefined_entities) / sizeof(xml_predefined_entities[0]); i++) {
+        if (xml_predefined_entities[i].size == body_size && memcmp(xml_predefined_entities[i].name, body, body_size) == 0) {
+            out[0] = xml_predefined_entities[i].value;
+            *out_size = 1;
+            return body_size + 2;
+        }
+    }
+    return 0;
+}
+
+size_t xml_decode(const char *data, size_t size, char *out) {
+    const char *end = data + size;
+    char *written = out;
+    while (data < end) {
+        const char *amp = xml_scan_find_byte(data, end, '&');
+        // runs only move towards the start when decoding in place
+        memmove(written, data, (size_t)(amp - data));
+        written += amp - data;
+        if (amp == end) {
+            break;
+        }
+        char character[4];
+        size_t character_size;
+        size_t reference_size = xml_decode_reference(amp, end, character, &character_size);
+        if (reference_size == 0) {
+            *written++ = '&';
+            data = amp + 1;
+            continue;
+        }
+        memcpy(written, character, character_size);
+        written += character_size;
+        data = amp + reference_size;
+    }
+    *written = '\0';
+    return (size_t)(written - out);
+}
+
+char *xml_element_text_concat(const XMLElement *element, size_t *size) {
+    // decoding never grows a run, so the raw sizes bound the output
+    size_t capacity = 1;
+    for (const XMLText *text = element != NULL ? element->texts : NULL; text != NULL; text = text->next) {
+        capacity += text->size;
+    }
+    char *output = malloc(capacity);
+    if (output == NULL) {
+        return NULL;
+    }
+
+    size_t used = 0;
+    for (const XMLText *text = element != NULL ? element->texts : NULL; text != NULL; text = text->next) {
+        if (text->flags & XML_VALUE_ENTITIES) {
+            used += xml_decode(text->text, text->size, output + used);
+        } else {
+            memcpy(output + used, text->text, text->size);
+            used += text->size;
+        }
+    }
+    output[used] = '\0';
+    if (size != NULL) {
+        *size = used;
+    }
+    return output;
+}
+
+// The decoded copy of a value with XML_VALUE_ENTITIES, made on first use
+static XMLStringView xml_decoded_view(XMLFile *file, const char *value, size_t size, char **decoded, size_t *decoded_size) {
+    XMLStringView view = { NULL, 0 };
+    if (*decoded == NULL) {
+        char *copy = xml_arena_alloc_align(file->arena, size + 1, 1);
+        if (copy == NULL) {
+            return view;
+        }
+        *decoded_size = xml_decode(value, size, copy);
+        *decoded = copy;
+    }
+    view.data = *decoded;
+    view.size = *decoded_size;
+    return view;
+}
+
+XMLStringView xml_attribute_value_decoded(XMLFile *file, XMLAttribute *attribute) {
+    if (attribute == NULL || !(attribute->value_flags & XML_VALUE_ENTITIES)) {
+        return xml_attribute_value_view(attribute);
+    }
+    return xml_decoded_view(file, attribute->value, attribute->value_size, &attribute->decoded_value, &attribute->decoded_value_size);
+}
+
+XMLStringView xml_element_text_decoded(XMLFile *file, XMLElement *element) {
+    if (element == NULL || element->text_content == NULL || !(element->text_flags & XML_VALUE_ENTITIES)) {
+        return xml_element_text_view(element);
+    }
+    return xml_decoded_view(file, element->text_content, element->text_size, &element->decoded_text, &element->decoded_text_size);
+}
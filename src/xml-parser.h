@@ -1,31 +1,276 @@
 #ifndef __XML_PARSER__
 #define __XML_PARSER__
 
+#include <stddef.h>
+#include <stdint.h>
+
+// A length-delimited string that is not guaranteed to be NUL-terminated
+typedef struct XMLStringView {
+    const char *data;
+    size_t size;
+} XMLStringView;
+
+// Interned element or attribute name. Equal names share the same atom within a
+// name table, so searches by atom compare integers instead of strings.
+typedef unsigned int XMLAtom;
+// Never used for a name, xml_atom_lookup returns it for names not in the table
+#define XML_ATOM_NONE 0
+
+// Interned names of one or more documents (see xml_name_table_new)
+typedef struct XMLNameTable XMLNameTable;
+
+// Flags of an attribute value or element text. Values are kept as written in
+// the document; decoding them is left to xml_attribute_value_decoded and
+// xml_element_text_decoded, and only those with XML_VALUE_ENTITIES need it.
+// The value holds a '&', so entity or character references
+#define XML_VALUE_ENTITIES (1u << 0)
+// The element text is the content of a CDATA section, taken literally
+#define XML_VALUE_CDATA (1u << 1)
+
 typedef struct XMLAttribute {
     char *name;
+    size_t name_size;
+    XMLAtom name_atom;
+    unsigned int value_flags; // XML_VALUE_*
     char *value;
-    struct XMLAttribute *next;
+    size_t value_size;
+    // cached by the first xml_attribute_value_decoded of a value with
+    // XML_VALUE_ENTITIES, NULL until then
+    char *decoded_value;
+    size_t decoded_value_size;
 } XMLAttribute;
 
+// One run of text of an element, between two pieces of markup. CDATA sections
+// are runs of their own. The runs of an element and its child elements can
+// appear in any order, position tells where the run goes.
+typedef struct XMLText {
+    char *text;
+    size_t size;
+    unsigned int flags; // XML_VALUE_*
+    size_t position; // number of child elements before the run
+    struct XMLText *next;
+} XMLText;
+
 typedef struct XMLElement {
     char *name;
+    size_t name_size;
+    XMLAtom name_atom;
+    // text_content, text_size and text_flags repeat the first text run
+    unsigned int text_flags; // XML_VALUE_*
     char *text_content;
+    size_t text_size;
+    // cached by the first xml_element_text_decoded of text with
+    // XML_VALUE_ENTITIES, NULL until then
+    char *decoded_text;
+    size_t decoded_text_size;
+    // every text run in document order, NULL when there is none. The runs
+    // point into the document's storage like every other value.
+    XMLText *texts;
     
+    // array of attributes_size attributes, in document order
     XMLAttribute *attributes;
     int attributes_size;
+    // set while the children of an XML_LOAD_LAZY element are not built yet,
+    // children is NULL until then (see xml_element_children)
+    int children_pending;
     
     struct XMLElement *parent;
     struct XMLElement *children; 
     struct XMLElement *next_sibling;
+
+    // position in a pre-order and a post-order walk of the document, only set
+    // once the tag index has been built (see xml_find_all)
+    size_t pre_order;
+    size_t post_order;
 } XMLElement;
 
+// Elements in document order, see xml_find_all
+typedef struct XMLElementList {
+    XMLElement *const *items;
+    size_t count;
+} XMLElementList;
+
+// Document-wide index from tag names to elements (see xml_find_all)
+typedef struct XMLTagIndex XMLTagIndex;
+
+// Element ranges and parser state of an XML_LOAD_LAZY document
+typedef struct XMLLazyDocument XMLLazyDocument;
+
 typedef struct XMLFile {
     char *version;
     char *encoding;
     
     XMLElement *root;
+
+    // owns every element, attribute and string of the document
+    struct XMLArena *arena;
+    // the raw document, only kept by XML_LOAD_IN_SITU documents
+    struct XMLSource *source;
+    // interned element and attribute names, the document's own table unless
+    // one was shared through XMLLoadOptions (shared_names is then set)
+    XMLNameTable *names;
+    int shared_names;
+    // tag-name index, NULL until it is first needed
+    XMLTagIndex *index;
+    // what is left to build of an XML_LOAD_LAZY document, NULL otherwise
+    XMLLazyDocument *lazy;
 } XMLFile;
 
+// Flags for XMLLoadOptions
+#define XML_LOAD_DEFAULT 0
+// Read the file with read() instead of memory mapping it
+#define XML_LOAD_NO_MMAP (1u << 0)
+// Keep the source buffer and point every value and text into it instead of
+// copying them. The strings are NUL-terminated in place once parsing ends.
+// xml_load_buffer makes a single copy of the buffer to terminate in.
+#define XML_LOAD_IN_SITU (1u << 1)
+// xml_load_buffer only: parse the caller's buffer without copying any value or
+// text. The buffer must outlive the document. Attribute values and text
+// point into it and are NOT NUL-terminated, use the XMLStringView accessors.
+#define XML_LOAD_BORROW_BUFFER (1u << 2)
+// Build the tag-name index while loading instead of on the first xml_find_all
+#define XML_LOAD_BUILD_INDEX (1u << 3)
+// Parse the children of the root element on several threads. Pays off for
+// large, wide documents such as lists of records; the result is the same as
+// a serial parse. Needs linking with -pthread.
+#define XML_LOAD_PARALLEL (1u << 4)
+// Tokenize the content in two stages: vector code first indexes every '<',
+// '>' and quote of a block, then the tokens are read off that index. Pays off
+// for documents with long text and attribute values; the result is the same.
+#define XML_LOAD_STRUCTURAL_INDEX (1u << 5)
+// Build elements on demand. The load only pairs the start and end tags and
+// records where every element is, then builds the root. The children of an
+// element, with their attributes and text, are built the first time they are
+// reached through xml_element_children, xml_element_get_child,
+// find_element_by_name, a query or the tag index, so the parts of a large
+// document that are never read cost little more than that first scan.
+// Malformed tags and mismatched end tags below the root are only reported
+// once they are reached.
+// The document keeps its source and XML_LOAD_IN_SITU is ignored. Reading
+// builds elements, so a lazy document must not be read from several threads
+// at once. XML_LOAD_PARALLEL is ignored.
+#define XML_LOAD_LAZY (1u << 6)
+// Parse the bytes as they are. By default a byte order mark is dropped,
+// UTF-16 (told by its byte order mark or its zero bytes) and documents
+// declared ISO-8859-1 are transcoded to UTF-8, and UTF-8 documents are
+// validated; other declared encodings are only accepted for ASCII documents.
+#define XML_LOAD_SKIP_ENCODING (1u << 7)
+// Fill in the line and column of the error and of every warning of the load
+// (see xml_error_locate) while the source is still at hand
+#define XML_LOAD_ERROR_LOCATION (1u << 8)
+
+// What one load did and where its time went, filled in when XMLLoadOptions
+// has a stats pointer. Times are in nanoseconds of the monotonic clock.
+// Building with XML_DISABLE_PARSE_STATS compiles the collection out, the
+// struct is then only zeroed.
+typedef struct XMLParseStats {
+    size_t bytes_read; // size of the source document
+    // nodes parsed. A lazy load counts every element and the full depth from
+    // its skip pass, but the attributes and other nodes of the root only.
+    size_t elements;
+    size_t attributes;
+    size_t texts;
+    size_t comments;
+    size_t cdata_sections;
+    size_t max_depth; // the root element is at depth 1
+    // blocks the document allocated for its elements, attributes and
+    // strings. A document reused through xml_load_into allocates none until
+    // it outgrows the blocks it already has.
+    size_t allocations;
+    size_t allocated_bytes;
+
+    unsigned long long read_ns; // opening and mapping, reading or copying the source
+    unsigned long long declaration_ns; // the XML declaration
+    unsigned long long parse_ns; // tokenizing and building the elements
+    unsigned long long index_ns; // XML_LOAD_BUILD_INDEX
+    unsigned long long total_ns; // the whole call, releasing the source included
+} XMLParseStats;
+
+typedef enum XMLErrorCode {
+    XML_ERROR_NONE,
+    XML_ERROR_IO, // the source could not be opened or read, see system_error
+    XML_ERROR_MEMORY,
+    XML_ERROR_ENCODING, // bytes that are not valid UTF-8 or UTF-16
+    XML_ERROR_UNSUPPORTED_ENCODING, // a declared encoding that is not transcoded
+    XML_ERROR_DECLARATION, // missing or malformed XML declaration
+    XML_ERROR_SYNTAX, // malformed markup, the message says what is wrong
+    XML_ERROR_MISMATCHED_TAG,
+    XML_ERROR_MAX_DEPTH, // deeper than XMLLoadOptions.max_depth
+    XML_ERROR_UNEXPECTED_END, // the document ends inside an element or token
+    XML_ERROR_LIMIT, // more than a flat document can hold
+    XML_ERROR_TRAILING_CONTENT // text or elements after the root element
+} XMLErrorCode;
+
+// What stopped a load, or a warning about it. Recording one costs a few
+// stores, nothing is formatted or printed: the library never writes to
+// stderr.
+typedef struct XMLError {
+    XMLErrorCode code;
+    // static description of the problem, NULL with XML_ERROR_NONE
+    const char *message;
+    // byte offset of the problem in the document as it was passed in. Once
+    // a document has been transcoded from UTF-16 or ISO-8859-1, offsets are
+    // in its UTF-8 form.
+    size_t offset;
+    // errno when a system call failed (XML_ERROR_IO), 0 otherwise
+    int system_error;
+    // both 1-based, 0 until computed by xml_error_locate
+    size_t line;
+    size_t column;
+} XMLError;
+
+// Receives each warning of a load, on the thread doing the load. A warning
+// does not stop the load. The error is only valid during the call.
+typedef void (*XMLWarningCallback)(void *context, const XMLError *warning);
+
+typedef struct XMLLoadOptions {
+    unsigned int flags;
+    // deepest element nesting accepted, the root element is at depth 1.
+    // Deeper documents fail to load. 0 means no limit.
+    size_t max_depth;
+    // intern the names into this table instead of one owned by the document,
+    // so atoms can be compared across documents. NULL for a table per document.
+    XMLNameTable *names;
+    // threads used by XML_LOAD_PARALLEL, 0 for one per online CPU
+    size_t threads;
+    // filled in by the load when not NULL, whether it succeeds or not
+    XMLParseStats *stats;
+    // filled in when not NULL: XML_ERROR_NONE after a successful load,
+    // otherwise the first problem that stopped it, also when xml_load still
+    // returns a document without a root element
+    XMLError *error;
+    // called with each warning, NULL to ignore them. Warnings that take work
+    // to find, such as XML_ERROR_TRAILING_CONTENT, are only looked for when
+    // there is a callback.
+    XMLWarningCallback warning;
+    void *warning_context;
+} XMLLoadOptions;
+
+/**
+ * @brief Compute the line and column of an error from its offset
+ * 
+ * Lines are counted up to the offset, so the cost is only paid for errors
+ * that are shown to someone. Columns count bytes.
+ * 
+ * @param error The error, its line and column are filled in
+ * @param data The document the error was found in, as it was loaded
+ * @param size The number of bytes in data
+ */
+void xml_error_locate(XMLError *error, const char *data, size_t size);
+
+/**
+ * @brief Get the first error met building the elements of a lazy document
+ * 
+ * XML_LOAD_LAZY documents only check the markup below the root once it is
+ * built, after the load has returned. The elements built before the error
+ * are kept.
+ * 
+ * @param file The document
+ * @return The error, or NULL if there was none. Its offset is in the source
+ *         of the document.
+ */
+const XMLError *xml_document_error(const XMLFile *file);
+
 /**
  * @brief Parse filepath into a XMLFile
  * 
@@ -37,13 +282,174 @@ typedef struct XMLFile {
 
 XMLFile *xml_load(const char *filepath);
 
+/**
+ * @brief Parse filepath into a XMLFile using the given load options
+ * 
+ * Regular files are memory mapped (MADV_SEQUENTIAL) and parsed directly over
+ * the mapping, so the raw bytes are never copied. Pipes, devices and files that
+ * cannot be mapped are read in large blocks instead.
+ * 
+ * @param filepath The path to the XML file to be parsed. Must not be NULL.
+ * @param options The load options, or NULL for the defaults.
+ * @return Same as xml_load.
+ */
+XMLFile *xml_load_ex(const char *filepath, const XMLLoadOptions *options);
+
+/**
+ * @brief Parse an XML document held in memory into a XMLFile
+ * 
+ * @param data The document bytes, they do not need to be NUL-terminated.
+ * @param len The number of bytes in data.
+ * @return Same as xml_load.
+ */
+XMLFile *xml_load_buffer(const char *data, size_t len);
+
+/**
+ * @brief Parse an XML document held in memory using the given load options
+ * 
+ * By default the buffer is only read while this call runs and every string is
+ * copied into the document. With XML_LOAD_BORROW_BUFFER values and text are
+ * not copied and the document keeps pointing into data.
+ * 
+ * @param data The document bytes, they do not need to be NUL-terminated.
+ * @param len The number of bytes in data.
+ * @param options The load options, or NULL for the defaults.
+ * @return Same as xml_load.
+ */
+XMLFile *xml_load_buffer_ex(const char *data, size_t len, const XMLLoadOptions *options);
+
+/**
+ * @brief Parse the XML document read from an open file descriptor
+ * 
+ * Regular files are memory mapped, pipes and sockets are read until end of
+ * file. The descriptor is not closed.
+ * 
+ * @param fd The file descriptor to read.
+ * @return Same as xml_load.
+ */
+XMLFile *xml_load_fd(int fd);
+
+/**
+ * @brief Parse the XML document read from an open file descriptor using the
+ *        given load options
+ * 
+ * @param fd The file descriptor to read.
+ * @param options The load options, or NULL for the defaults.
+ * @return Same as xml_load.
+ */
+XMLFile *xml_load_fd_ex(int fd, const XMLLoadOptions *options);
+
 /**
  * @brief Free the XMLFile struct and all its child XMLElement structs
  * 
+ * All the elements, attributes and strings of a document are allocated from
+ * an arena owned by the XMLFile, so this releases a handful of large blocks
+ * instead of walking the tree.
+ * 
  * @param file_struct The given struct to free
  */
 void xml_unload(XMLFile *file_struct);
 
+/**
+ * @brief Create an empty XMLFile that can be filled with xml_load_into
+ * 
+ * @return A pointer to a dynamically allocated XMLFile, or NULL if an
+ *         allocation fails. Free it with xml_unload.
+ */
+XMLFile *xml_document_new(void);
+
+/**
+ * @brief Drop the contents of an XMLFile but keep its arena memory
+ * 
+ * Every XMLElement, XMLAttribute and string previously returned from the
+ * document becomes invalid. The arena blocks are kept so the next
+ * xml_load_into reuses them instead of going back to the allocator.
+ * 
+ * @param file The document to reset
+ */
+void xml_document_reset(XMLFile *file);
+
+/**
+ * @brief Parse filepath into an existing XMLFile, reusing its arena
+ * 
+ * The document is reset first (see xml_document_reset).
+ * 
+ * @param file The document to fill. Must not be NULL.
+ * @param filepath The path to the XML file to be parsed. Must not be NULL.
+ * @param options The load options, or NULL for the defaults.
+ * @return 0 on success, -1 if the file could not be read or parsed.
+ */
+int xml_load_into(XMLFile *file, const char *filepath, const XMLLoadOptions *options);
+
+/**
+ * @brief Parse an XML document held in memory into an existing XMLFile,
+ *        reusing its arena
+ * 
+ * @param file The document to fill. Must not be NULL.
+ * @param data The document bytes, they do not need to be NUL-terminated.
+ * @param len The number of bytes in data.
+ * @param options The load options, or NULL for the defaults.
+ * @return 0 on success, -1 if the buffer could not be parsed.
+ */
+int xml_load_buffer_into(XMLFile *file, const char *data, size_t len, const XMLLoadOptions *options);
+
+// Outcome of one file of xml_load_many
+typedef struct XMLLoadResult {
+    // the document, NULL if it failed or was handed to a handler
+    XMLFile *file;
+    // 0 once loaded, otherwise the errno of the failure: that of opening or
+    // reading the file, ENOMEM, or EINVAL for a document that is not
+    // well-formed
+    int error;
+} XMLLoadResult;
+
+/**
+ * @brief Called by xml_load_many for every file, on the calling thread
+ * 
+ * @param context XMLLoadManyOptions.context
+ * @param index The index of the file in paths
+ * @param file The document, NULL if it failed. It is only valid until the
+ *        handler returns, its memory is then reused for the next file.
+ * @param error Same as XMLLoadResult.error
+ */
+typedef void (*XMLLoadHandler)(void *context, size_t index, XMLFile *file, int error);
+
+typedef struct XMLLoadManyOptions {
+    // used for every file. threads sizes the pool, 0 for one worker per
+    // online CPU. XML_LOAD_PARALLEL, names, stats, error and warning are
+    // ignored: the files are loaded in parallel instead, each into its own
+    // name table, and each failure is told by its XMLLoadResult.error.
+    XMLLoadOptions load;
+    // with a handler, the most documents loaded and not yet handled at once,
+    // 0 for twice the number of workers. Memory then stays bounded by that
+    // many documents whatever the number of files.
+    size_t max_in_flight;
+    // called for each file as it completes, in no particular order. NULL to
+    // collect every document in results instead.
+    XMLLoadHandler handler;
+    void *context;
+} XMLLoadManyOptions;
+
+/**
+ * @brief Load many files on a pool of threads
+ * 
+ * The paths are split between the workers, and a worker that runs out
+ * steals half of what another one has left, so a few large files do not
+ * hold the rest up. Small regular files are read into a buffer each worker
+ * reuses instead of being mapped. With a handler, documents are recycled
+ * through xml_document_reset, so their arenas are reused from one file to
+ * the next.
+ * 
+ * @param paths The files to load
+ * @param count The number of paths
+ * @param options The options, or NULL for the defaults and no handler
+ * @param results count results, filled in for every file. May be NULL when
+ *        there is a handler. Without a handler each document belongs to the
+ *        caller, free it with xml_unload.
+ * @return The number of files that loaded.
+ */
+size_t xml_load_many(const char *const *paths, size_t count, const XMLLoadManyOptions *options, XMLLoadResult *results);
+
 /**
  * @brief search an XMLElement (only children) given its name
  * 
@@ -55,6 +461,14 @@ void xml_unload(XMLFile *file_struct);
  */
 XMLElement* xml_element_get_child(XMLElement *start_element, const char *tag_name);
 
+/**
+ * @brief first child of element, or NULL when it has none
+ *
+ * The same as element->children, except that it first builds the children of
+ * an XML_LOAD_LAZY element that has not been reached yet.
+ */
+XMLElement* xml_element_children(XMLElement *element);
+
 /**
  * @brief get child element of current_element from its name
  * 
@@ -77,6 +491,19 @@ XMLElement* xml_element_get_child(XMLElement *start_element, const char *tag_nam
  */
 XMLAttribute* xml_attribute_get(XMLElement *current_element, const char *attr_name);
 
+/**
+ * @brief get the attribute of an XMLElement at the given position
+ * 
+ * The attributes of an element are stored in one array, so iterating with
+ * increasing index walks memory in order.
+ * 
+ * @param element The element
+ * @param index Position of the attribute, from 0 to attributes_size - 1
+ * 
+ * @return The attribute, or NULL if index is out of range
+ */
+XMLAttribute* xml_attribute_at(XMLElement *element, size_t index);
+
 
 /**
  * @brief get the value of an attribute given the attr_name
@@ -89,4 +516,823 @@ XMLAttribute* xml_attribute_get(XMLElement *current_element, const char *attr_na
  */
 char* xml_attribute_get_value(XMLElement *current_element, const char *attr_name);
 
-#endif // __XML_PARSER__
\ No newline at end of file
+/**
+ * @brief get the value of an attribute given the attr_name as a string view
+ * 
+ * @param current_element The structure where the function will start to search its children
+ * @param attr_name The name of the attribute to search
+ * 
+ * @return A view of the attr_name value, data is NULL if theres isnt a XMLAttribute
+ *         that has attr_name as name. For XML_LOAD_IN_SITU documents the view
+ *         points into the source buffer.
+ */
+XMLStringView xml_attribute_get_value_view(XMLElement *current_element, const char *attr_name);
+
+/**
+ * @brief get the value of an attribute as a string view
+ * 
+ * @param attribute The attribute, may be NULL
+ * 
+ * @return A view of the value, data is NULL if attribute is NULL
+ */
+XMLStringView xml_attribute_value_view(const XMLAttribute *attribute);
+
+/**
+ * @brief get the name of an element as a string view
+ * 
+ * @param element The element, may be NULL
+ * 
+ * @return A view of the name, data is NULL if element is NULL
+ */
+XMLStringView xml_element_name_view(const XMLElement *element);
+
+/**
+ * @brief get the text of an element as a string view
+ * 
+ * Only the first text run, see XMLElement.texts and xml_element_text_concat
+ * for elements with mixed content.
+ * 
+ * @param element The element, may be NULL
+ * 
+ * @return A view of the text, data is NULL if the element has no text
+ */
+XMLStringView xml_element_text_view(const XMLElement *element);
+
+/**
+ * @brief whether the value of an attribute holds references to decode
+ *
+ * @param attribute The attribute, may be NULL
+ *
+ * @return 1 if the value has XML_VALUE_ENTITIES, 0 if it reads the same
+ *         decoded
+ */
+int xml_attribute_needs_decoding(const XMLAttribute *attribute);
+
+/**
+ * @brief whether the text of an element holds references to decode
+ *
+ * @param element The element, may be NULL
+ *
+ * @return 1 if the text has XML_VALUE_ENTITIES, 0 if it reads the same
+ *         decoded, which CDATA text always does
+ */
+int xml_element_text_needs_decoding(const XMLElement *element);
+
+/**
+ * @brief get the value of an attribute with its references decoded
+ *
+ * The predefined entities (&amp; &lt; &gt; &quot; &apos;) and character
+ * references are replaced, other references are kept as written. A value
+ * without any '&' is the raw value itself, nothing is copied. Otherwise the
+ * value is decoded into the document once, NUL-terminated, and later calls
+ * return that copy. Decoding writes to the attribute, so the first call for
+ * a given attribute must not race with another.
+ *
+ * @param file The document the attribute belongs to
+ * @param attribute The attribute, may be NULL
+ *
+ * @return A view of the decoded value, data is NULL if attribute is NULL or
+ *         the copy could not be allocated
+ */
+XMLStringView xml_attribute_value_decoded(XMLFile *file, XMLAttribute *attribute);
+
+/**
+ * @brief get the text of an element with its references decoded
+ *
+ * Same as xml_attribute_value_decoded, for the first text run of an element.
+ * CDATA text is returned as it is.
+ *
+ * @param file The document the element belongs to
+ * @param element The element, may be NULL
+ *
+ * @return A view of the decoded text, data is NULL if the element has no text
+ *         or the copy could not be allocated
+ */
+XMLStringView xml_element_text_decoded(XMLFile *file, XMLElement *element);
+
+/**
+ * @brief get all the text runs of an element as one decoded string
+ *
+ * The runs are joined in order without anything in between, their references
+ * decoded and CDATA taken as it is. The output is allocated once, from the
+ * total size of the runs.
+ *
+ * @param element The element, may be NULL
+ * @param size Receives the size of the string when not NULL
+ *
+ * @return A dynamically allocated NUL-terminated string to free with free(),
+ *         empty if the element has no text, or NULL if the allocation fails
+ */
+char *xml_element_text_concat(const XMLElement *element, size_t *size);
+
+/**
+ * @brief decode the references of any raw value, such as those reported by
+ *        the streaming reader
+ *
+ * @param data The raw value
+ * @param size The number of bytes in data
+ * @param out Receives the decoded value and a terminator, size + 1 bytes are
+ *        always enough. May be data itself to decode in place.
+ *
+ * @return The size of the decoded value
+ */
+size_t xml_decode(const char *data, size_t size, char *out);
+
+/**
+ * @brief Create a name table that several documents can share
+ * 
+ * Pass it in XMLLoadOptions.names so that every document loaded with it uses
+ * the same atom for the same name. The table only grows, and it is not
+ * thread-safe: documents sharing it must be loaded one at a time.
+ * 
+ * @return A pointer to a dynamically allocated table, or NULL if the
+ *         allocation fails. Free it with xml_name_table_free.
+ */
+XMLNameTable *xml_name_table_new(void);
+
+/**
+ * @brief Free a table created with xml_name_table_new
+ * 
+ * The names of documents loaded with the table are freed as well, unload
+ * those documents first.
+ * 
+ * @param table The table to free, may be NULL
+ */
+void xml_name_table_free(XMLNameTable *table);
+
+/**
+ * @brief get the atom of a name in a name table
+ * 
+ * @param table The table, may be NULL
+ * @param name The NUL-terminated name
+ * 
+ * @return The atom, or XML_ATOM_NONE if no document loaded with the table has
+ *         an element or attribute with that name
+ */
+XMLAtom xml_name_table_lookup(const XMLNameTable *table, const char *name);
+
+/**
+ * @brief get the atom of a name in a name table, adding the name if needed
+ *
+ * Lets the atoms of names be known before any element uses them, such as the
+ * elements of an XML_LOAD_LAZY document that are not built yet.
+ *
+ * @param table The table, must not be NULL
+ * @param name The NUL-terminated name
+ *
+ * @return The atom, or XML_ATOM_NONE if the name could not be added
+ */
+XMLAtom xml_name_table_add(XMLNameTable *table, const char *name);
+
+/**
+ * @brief same as xml_name_table_add for a name that is not NUL-terminated
+ *
+ * @param table The table, must not be NULL
+ * @param name The name
+ *
+ * @return The atom, or XML_ATOM_NONE if the name could not be added
+ */
+XMLAtom xml_name_table_add_view(XMLNameTable *table, XMLStringView name);
+
+/**
+ * @brief get the name of an atom in a name table
+ *
+ * @param table The table, may be NULL
+ * @param atom An atom of the table
+ *
+ * @return The NUL-terminated name, or NULL if atom is not in the table
+ */
+const char *xml_name_table_name(const XMLNameTable *table, XMLAtom atom);
+
+/**
+ * @brief get the atom of a name in a document
+ * 
+ * Resolve a name once and search with xml_element_get_child_atom or
+ * xml_attribute_get_atom, which compare atoms instead of strings.
+ * 
+ * @param file The document, may be NULL
+ * @param name The NUL-terminated name
+ * 
+ * @return The atom, or XML_ATOM_NONE if no element or attribute of the
+ *         document has that name
+ */
+XMLAtom xml_atom_lookup(const XMLFile *file, const char *name);
+
+/**
+ * @brief get the name of an atom
+ * 
+ * @param file The document
+ * @param atom An atom of the document's name table
+ * 
+ * @return The NUL-terminated name, or NULL if atom is not in the table
+ */
+const char *xml_atom_name(const XMLFile *file, XMLAtom atom);
+
+/**
+ * @brief search an XMLElement (only children) given the atom of its name
+ * 
+ * @param start_element The structure where the function will start to search its children
+ * @param atom The atom of the tag name to search, from xml_atom_lookup
+ * 
+ * @return The first XMLElement named atom, or NULL if there is none
+ */
+XMLElement* xml_element_get_child_atom(XMLElement *start_element, XMLAtom atom);
+
+/**
+ * @brief get an attribute from an XMLElement given the atom of its name
+ * 
+ * @param current_element The element whose attributes are searched
+ * @param atom The atom of the attribute name to search, from xml_atom_lookup
+ * 
+ * @return The XMLAttribute named atom, or NULL if there is none
+ */
+XMLAttribute* xml_attribute_get_atom(XMLElement *current_element, XMLAtom atom);
+
+/**
+ * @brief Build the tag-name index of a document if it does not have one yet
+ * 
+ * xml_find_all and xml_find_first build it on their first call. Build it up
+ * front when several threads will query the same document.
+ * 
+ * @param file The loaded document
+ * @return 0 on success, -1 if the document is empty or an allocation fails.
+ */
+int xml_document_build_index(XMLFile *file);
+
+/**
+ * @brief get every element named tag_name below start_element
+ * 
+ * The lookup goes through the tag-name index and two binary searches, the
+ * tree is never walked. The list points into the index and stays valid until
+ * the document is reset or unloaded.
+ * 
+ * @param file The document start_element belongs to
+ * @param start_element Only its descendants are returned, NULL for the whole
+ *        document including the root element
+ * @param tag_name The name of the tag to search
+ * 
+ * @return The matching elements in document order, count is 0 if there are
+ *         none or the index could not be built
+ */
+XMLElementList xml_find_all(XMLFile *file, XMLElement *start_element, const char *tag_name);
+
+/**
+ * @brief get the first element named tag_name below start_element
+ * 
+ * Same as xml_element_get_child, but through the tag-name index (see
+ * xml_find_all).
+ * 
+ * @param file The document start_element belongs to
+ * @param start_element Only its descendants are searched, NULL for the whole
+ *        document including the root element
+ * @param tag_name The name of the tag to search
+ * 
+ * @return The first matching element in document order, or NULL
+ */
+XMLElement* xml_find_first(XMLFile *file, XMLElement *start_element, const char *tag_name);
+
+// Compiled path query (see xml_query_compile)
+typedef struct XMLQuery XMLQuery;
+
+// Called for every element a query selects, return non-zero to stop the query
+typedef int (*XMLQueryCallback)(XMLElement *element, void *user_data);
+
+/**
+ * @brief Compile a path expression in a subset of XPath
+ * 
+ * Supported: absolute (/a/b) and relative (a/b) paths, the child (/) and
+ * descendant (//) axes, name tests and *, and any number of predicates per
+ * step: [@attr], [@attr='value'], [@attr!='value'] and positions such as [2],
+ * which count siblings from 1. For example //feed/item[@type='x']/price.
+ * At most 64 steps.
+ * 
+ * The compiled query does not depend on a document and can be run against
+ * any number of them, also from several threads at once.
+ * 
+ * @param expression The NUL-terminated path
+ * @return The compiled query, or NULL if the expression is invalid. Free it
+ *         with xml_query_free.
+ */
+XMLQuery *xml_query_compile(const char *expression);
+
+/**
+ * @brief xml_query_compile, telling what is wrong with an invalid expression
+ * 
+ * @param expression The NUL-terminated path
+ * @param error If not NULL, filled in: XML_ERROR_NONE when the query
+ *        compiles, otherwise XML_ERROR_SYNTAX and the offset in expression
+ *        where it stopped, or XML_ERROR_MEMORY.
+ * @return Same as xml_query_compile.
+ */
+XMLQuery *xml_query_compile_ex(const char *expression, XMLError *error);
+
+/**
+ * @brief Free a query created with xml_query_compile
+ * 
+ * @param query The query to free, may be NULL
+ */
+void xml_query_free(XMLQuery *query);
+
+/**
+ * @brief Run a compiled query and report the selected elements
+ * 
+ * The tree is walked once, in document order, and subtrees no step can match
+ * in are skipped, so each element is reported once and in document order.
+ * 
+ * @param file The document
+ * @param context Element relative paths start from, NULL for the document.
+ *        Absolute paths always start from the document.
+ * @param query The compiled query
+ * @param callback Called for every selected element, may be NULL to count them
+ * @param user_data Passed to callback
+ * @return The number of selected elements reported, or -1 on error.
+ */
+long xml_query_exec(const XMLFile *file, XMLElement *context, const XMLQuery *query, XMLQueryCallback callback, void *user_data);
+
+typedef enum XMLEventType {
+    XML_EVENT_START_ELEMENT, // name
+    XML_EVENT_ATTRIBUTE, // name and value, right after the START_ELEMENT
+    XML_EVENT_TEXT, // value, raw text including leading whitespace (see xml_decode)
+    XML_EVENT_CDATA, // value
+    XML_EVENT_COMMENT, // value
+    XML_EVENT_END_ELEMENT // name, also reported for self-closing tags
+} XMLEventType;
+
+typedef struct XMLEvent {
+    XMLEventType type;
+    XMLStringView name;
+    XMLStringView value;
+    // depth of the element the event belongs to, the root element is 1
+    int depth;
+} XMLEvent;
+
+typedef enum XMLReaderStatus {
+    XML_READER_EVENT, // the event was filled in
+    XML_READER_NEED_MORE, // feed more input or call xml_reader_finish
+    XML_READER_DONE, // the root element has been closed
+    XML_READER_ERROR // see xml_reader_error
+} XMLReaderStatus;
+
+// Pull parser for documents that do not fit in memory (see xml_reader_new)
+typedef struct XMLReader XMLReader;
+
+/**
+ * @brief Create a streaming reader
+ * 
+ * The reader takes the input in chunks of any size with xml_reader_feed and
+ * returns one event at a time from xml_reader_next. Tokens that cross chunk
+ * boundaries are kept until they are complete, so memory depends on the chunk
+ * size, the largest token and the nesting depth, not on the document size.
+ * It uses the same token rules as xml_load, but never builds a tree.
+ * 
+ * @return A pointer to a dynamically allocated reader, or NULL if the
+ *         allocation fails. Free it with xml_reader_free.
+ */
+XMLReader *xml_reader_new(void);
+
+/**
+ * @brief Free a reader created with xml_reader_new
+ * 
+ * @param reader The reader to free, may be NULL
+ */
+void xml_reader_free(XMLReader *reader);
+
+/**
+ * @brief Append the next chunk of input
+ * 
+ * The bytes are copied, buf can be reused once the call returns. Views from
+ * earlier events become invalid.
+ * 
+ * @param reader The reader
+ * @param buf The input bytes, not NUL-terminated
+ * @param len The number of bytes in buf
+ * @return 0 on success, -1 if the internal buffer could not grow.
+ */
+int xml_reader_feed(XMLReader *reader, const char *buf, size_t len);
+
+/**
+ * @brief Tell the reader that no more input will come
+ * 
+ * Tokens still incomplete at that point are reported as errors.
+ * 
+ * @param reader The reader
+ */
+void xml_reader_finish(XMLReader *reader);
+
+/**
+ * @brief Get the next event
+ * 
+ * @param reader The reader
+ * @param event Filled in when XML_READER_EVENT is returned. Its views point
+ *        into the reader and stay valid until the next call to
+ *        xml_reader_next or xml_reader_feed.
+ * @return XML_READER_EVENT, XML_READER_NEED_MORE when the buffered input has
+ *         no complete token left, XML_READER_DONE once the root element has
+ *         been closed or XML_READER_ERROR.
+ */
+XMLReaderStatus xml_reader_next(XMLReader *reader, XMLEvent *event);
+
+/**
+ * @brief Get the error that stopped the reader
+ * 
+ * @param reader The reader
+ * @param offset If not NULL, receives the byte offset of the error in the stream
+ * @return A description of the error, or NULL if the reader did not fail.
+ */
+const char *xml_reader_error(const XMLReader *reader, size_t *offset);
+
+/**
+ * @brief Get the error that stopped the reader, with its code
+ * 
+ * @param reader The reader
+ * @return The error, its offset in the stream, or NULL if the reader did not
+ *         fail.
+ */
+const XMLError *xml_reader_last_error(const XMLReader *reader);
+
+/**
+ * @brief Called by xml_load_records for every record
+ *
+ * @param context Passed through from xml_load_records
+ * @param file The scratch document the record was built in. Its root is
+ *        record, and it can be given to the functions that take an XMLFile.
+ * @param record The record with its attributes, text and every element
+ *        below it. The whole document is reset once the callback returns,
+ *        so nothing from it may be kept; copy what is needed.
+ * @return 0 to go on with the next record, any other value to stop.
+ */
+typedef int (*XMLRecordCallback)(void *context, XMLFile *file, XMLElement *record);
+
+/**
+ * @brief Split a large document into records and build each as a tree
+ *
+ * The file is read in blocks through the streaming reader, after the same
+ * encoding stage as xml_load (see XML_LOAD_SKIP_ENCODING). Every element
+ * that matches record_path is built into a scratch document and handed to
+ * callback, and the document's arena is reset before the next one, so
+ * memory depends on the largest record instead of the document.
+ * Everything outside the records is skipped, and a record is never looked
+ * for inside another one.
+ *
+ * record_path is either an absolute path of element names such as
+ * "/catalog/item", where a step may be "*" for any name, or a single name
+ * such as "item" (or "//item") that matches at any depth.
+ *
+ * Names are interned once for the whole call, in options->names when set,
+ * so atoms looked up in one record stay valid in the next ones.
+ *
+ * @param filepath The path to the XML file to be split. Must not be NULL.
+ * @param record_path The path of the records. Must not be NULL.
+ * @param options The load options, or NULL for the defaults. Only names,
+ *        max_depth, error, warning and the XML_LOAD_SKIP_ENCODING flag are
+ *        used.
+ * @param callback Called for every record, must not be NULL
+ * @param context Passed to callback
+ * @return The number of records handed to callback, or -1 if the path is not
+ *         valid or the file could not be read or parsed. Records before the
+ *         error have already been handed over by then.
+ */
+long xml_load_records(const char *filepath, const char *record_path, const XMLLoadOptions *options, XMLRecordCallback callback, void *context);
+
+/**
+ * @brief Split a document held in memory into records, see xml_load_records
+ *
+ * @param data The document bytes, they do not need to be NUL-terminated.
+ * @param len The number of bytes in data.
+ * @param record_path The path of the records. Must not be NULL.
+ * @param options The load options, or NULL for the defaults.
+ * @param callback Called for every record, must not be NULL
+ * @param context Passed to callback
+ * @return The number of records handed to callback, or -1 on error.
+ */
+long xml_load_records_buffer(const char *data, size_t len, const char *record_path, const XMLLoadOptions *options, XMLRecordCallback callback, void *context);
+
+// Flags for the writer (see xml_writer_new)
+#define XML_WRITE_DEFAULT 0
+// Start every element on a line of its own, indented by two spaces per level,
+// and end the document with a line break. No whitespace is added around
+// text, so elements with text keep it as it was.
+#define XML_WRITE_PRETTY (1u << 0)
+// Leave the XML declaration out of xml_writer_document, xml_write_fd and
+// xml_write_buffer
+#define XML_WRITE_NO_DECLARATION (1u << 1)
+
+// Receives the output of a writer in large blocks. Return 0 on success, any
+// other value fails the writer.
+typedef int (*XMLWriteCallback)(const char *data, size_t size, void *user_data);
+
+// Serializer for trees and for documents built call by call (see xml_writer_new)
+typedef struct XMLWriter XMLWriter;
+
+/**
+ * @brief Create a writer that passes its output to callback
+ * 
+ * Output collects in one large buffer and goes to callback once that is full
+ * and on xml_writer_flush, so no allocation is made for each node. Text and
+ * values that need no escaping are copied in bulk.
+ * 
+ * Once a call fails, every later call fails too.
+ * 
+ * @param callback Receives the output, must not be NULL
+ * @param user_data Passed to callback
+ * @param flags XML_WRITE_* flags
+ * @return A pointer to a dynamically allocated writer, or NULL if the
+ *         allocation fails. Free it with xml_writer_free.
+ */
+XMLWriter *xml_writer_new(XMLWriteCallback callback, void *user_data, unsigned int flags);
+
+/**
+ * @brief Free a writer created with xml_writer_new, without flushing it
+ * 
+ * @param writer The writer to free, may be NULL
+ */
+void xml_writer_free(XMLWriter *writer);
+
+/**
+ * @brief Pass everything written so far to the callback
+ * 
+ * @param writer The writer
+ * @return 0 on success, -1 if the writer has failed.
+ */
+int xml_writer_flush(XMLWriter *writer);
+
+/**
+ * @brief Write the XML declaration
+ * 
+ * @param writer The writer
+ * @param version The version, NULL for 1.0
+ * @param encoding The encoding, NULL for UTF-8
+ * @return 0 on success, -1 if the writer has failed.
+ */
+int xml_writer_declaration(XMLWriter *writer, const char *version, const char *encoding);
+
+/**
+ * @brief Open an element. Its attributes follow, then its content, then
+ *        xml_writer_end_element.
+ * 
+ * @param writer The writer
+ * @param name The element name, written as it is
+ * @return 0 on success, -1 if the writer has failed.
+ */
+int xml_writer_start_element(XMLWriter *writer, const char *name);
+
+/**
+ * @brief Add an attribute to the element just opened
+ * 
+ * @param writer The writer
+ * @param name The attribute name, written as it is
+ * @param value The plain value, escaped as needed. Not NUL-terminated.
+ * @param value_size The number of bytes in value
+ * @return 0 on success, -1 if the writer has failed or no start tag is open.
+ */
+int xml_writer_attribute(XMLWriter *writer, const char *name, const char *value, size_t value_size);
+
+/**
+ * @brief Write text inside the current element
+ * 
+ * @param writer The writer
+ * @param text The plain text, escaped as needed. Not NUL-terminated.
+ * @param size The number of bytes in text
+ * @return 0 on success, -1 if the writer has failed.
+ */
+int xml_writer_text(XMLWriter *writer, const char *text, size_t size);
+
+/**
+ * @brief Write text inside the current element as a CDATA section
+ * 
+ * The text is written as it is, a "]]>" inside it is split across two
+ * sections. An empty section is written as well.
+ * 
+ * @param writer The writer
+ * @param text The plain text. Not NUL-terminated.
+ * @param size The number of bytes in text
+ * @return 0 on success, -1 if the writer has failed.
+ */
+int xml_writer_cdata(XMLWriter *writer, const char *text, size_t size);
+
+/**
+ * @brief Close the innermost open element, as <name/> when it is empty
+ * 
+ * @param writer The writer
+ * @return 0 on success, -1 if the writer has failed or no element is open.
+ */
+int xml_writer_end_element(XMLWriter *writer);
+
+/**
+ * @brief Write element and its subtree inside the current element
+ * 
+ * Text and attribute values are kept as they were read, entity references
+ * included, so only what they cannot hold where they are written is
+ * escaped: '<', and '"' in attribute values.
+ * 
+ * @param writer The writer
+ * @param element The element to write
+ * @return 0 on success, -1 if the writer has failed.
+ */
+int xml_writer_element(XMLWriter *writer, XMLElement *element);
+
+/**
+ * @brief Write the declaration, unless XML_WRITE_NO_DECLARATION is set, and
+ *        the root element of file
+ * 
+ * @param writer The writer
+ * @param file The document
+ * @return 0 on success, -1 if the writer has failed.
+ */
+int xml_writer_document(XMLWriter *writer, XMLFile *file);
+
+/**
+ * @brief Serialize file to a file descriptor
+ * 
+ * @param file The document
+ * @param fd Descriptor open for writing, it is left open
+ * @param flags XML_WRITE_* flags
+ * @return 0 on success, -1 if writing fails (see errno).
+ */
+int xml_write_fd(XMLFile *file, int fd, unsigned int flags);
+
+/**
+ * @brief Serialize file to memory
+ * 
+ * @param file The document
+ * @param flags XML_WRITE_* flags
+ * @param size If not NULL, receives the length of the output
+ * @return A dynamically allocated, NUL-terminated buffer holding the
+ *         document, or NULL if the allocation fails. Free it with free().
+ */
+char *xml_write_buffer(XMLFile *file, unsigned int flags, size_t *size);
+
+// Flat documents (see xml_flat_load). The elements are one array in document
+// order, linked by 32-bit indices instead of pointers, so a walk over the
+// whole document is a sweep through memory and the subtree of node i is the
+// range [i, subtree_end). Attributes, text runs and strings sit in arrays of
+// their own. Offsets and indices are 32-bit, a flat document holds less than
+// 4 GiB of strings and 4G nodes.
+
+// No node, in parent, first_child and next_sibling
+#define XML_FLAT_NONE UINT32_MAX
+
+typedef struct XMLFlatNode {
+    XMLAtom name; // in the document's name table
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t next_sibling;
+    uint32_t subtree_end; // first node after the subtree
+    uint32_t attributes; // first attribute, in the attributes array
+    uint32_t attributes_size;
+    uint32_t texts; // first text run, in the texts array
+    uint32_t texts_size;
+} XMLFlatNode;
+
+typedef struct XMLFlatAttribute {
+    XMLAtom name;
+    uint32_t value; // offset in strings, NUL-terminated there
+    uint32_t value_size;
+    unsigned int flags; // XML_VALUE_*
+} XMLFlatAttribute;
+
+typedef struct XMLFlatText {
+    uint32_t node; // the element the run belongs to
+    uint32_t text; // offset in strings, NUL-terminated there
+    uint32_t size;
+    uint32_t position; // number of child elements before the run
+    unsigned int flags; // XML_VALUE_*
+} XMLFlatText;
+
+typedef struct XMLFlatDocument {
+    XMLFlatNode *nodes; // nodes[0] is the root element
+    size_t nodes_size;
+    XMLFlatAttribute *attributes; // grouped by node, in document order
+    size_t attributes_size;
+    XMLFlatText *texts; // grouped by node, in document order
+    size_t texts_size;
+    char *strings;
+    size_t strings_size;
+    XMLNameTable *names;
+    int shared_names;
+    // the snapshot the arrays and strings point into, NULL when they were
+    // allocated (see xml_load_snapshot)
+    void *mapping;
+    size_t mapping_size;
+} XMLFlatDocument;
+
+/**
+ * @brief Parse filepath into a flat document
+ * 
+ * The file is read in blocks through the streaming reader, so no tree of
+ * XMLElement is built on the way. The blocks go through the same encoding
+ * stage as xml_load (see XML_LOAD_SKIP_ENCODING). Values and text are copied
+ * into the document's strings as written, see xml_decode.
+ * 
+ * @param filepath The path to the XML file to be parsed. Must not be NULL.
+ * @param options The load options, or NULL for the defaults. Only names,
+ *        max_depth, stats, error, warning and the XML_LOAD_SKIP_ENCODING
+ *        flag are used; stats only gets the node counts, bytes_read and
+ *        total_ns.
+ * @return A pointer to a dynamically allocated document, or NULL if an error
+ *         occurs. Free it with xml_flat_free.
+ */
+XMLFlatDocument *xml_flat_load(const char *filepath, const XMLLoadOptions *options);
+
+/**
+ * @brief Parse an XML document held in memory into a flat document
+ * 
+ * @param data The document bytes, they do not need to be NUL-terminated.
+ * @param len The number of bytes in data.
+ * @param options Same as xml_flat_load.
+ * @return Same as xml_flat_load.
+ */
+XMLFlatDocument *xml_flat_load_buffer(const char *data, size_t len, const XMLLoadOptions *options);
+
+/**
+ * @brief Build the flat form of a loaded document
+ * 
+ * The children of an XML_LOAD_LAZY document are built on the way. The flat
+ * document copies what it needs, file may be unloaded afterwards.
+ * 
+ * @param file The document
+ * @return A pointer to a dynamically allocated document with its own name
+ *         table, or NULL if an error occurs. Free it with xml_flat_free.
+ */
+XMLFlatDocument *xml_flat_from_file(XMLFile *file);
+
+/**
+ * @brief Free a flat document and everything it holds
+ * 
+ * @param document The document to free, may be NULL
+ */
+void xml_flat_free(XMLFlatDocument *document);
+
+/**
+ * @brief get a string of a flat document
+ * 
+ * @param document The document
+ * @param offset The offset of an attribute value or text run
+ * @param size Its size
+ * @return A view of the string
+ */
+XMLStringView xml_flat_string(const XMLFlatDocument *document, uint32_t offset, uint32_t size);
+
+/**
+ * @brief get the first child of node named atom
+ * 
+ * @param document The document
+ * @param node The index of the parent node
+ * @param atom The atom of the tag name, from xml_name_table_lookup on
+ *        document->names
+ * @return The index of the child, or XML_FLAT_NONE if there is none
+ */
+uint32_t xml_flat_child(const XMLFlatDocument *document, uint32_t node, XMLAtom atom);
+
+/**
+ * @brief get the attribute of node named atom
+ * 
+ * @param document The document
+ * @param node The index of the node
+ * @param atom The atom of the attribute name
+ * @return The attribute, or NULL if node has none named atom
+ */
+const XMLFlatAttribute *xml_flat_attribute(const XMLFlatDocument *document, uint32_t node, XMLAtom atom);
+
+// Flags for xml_load_snapshot
+#define XML_SNAPSHOT_DEFAULT 0
+// Also hash the source and compare it with the hash taken when the snapshot
+// was saved, instead of trusting its size and modification time alone
+#define XML_SNAPSHOT_VERIFY_HASH (1u << 0)
+
+/**
+ * @brief Save the flat form of a loaded document to a snapshot file
+ * 
+ * The snapshot holds the node, attribute and text arrays of
+ * xml_flat_from_file, its strings and names, and the size, modification time
+ * and hash of the source, so that xml_load_snapshot can tell when it is
+ * stale. Call it right after loading file from source_path. The snapshot is
+ * written to a temporary file and renamed over snapshot_path, so readers
+ * never see it half written.
+ * 
+ * @param file The document
+ * @param source_path The file the document was loaded from
+ * @param snapshot_path Where to save the snapshot
+ * @return 0 on success, -1 on error
+ */
+int xml_save_snapshot(XMLFile *file, const char *source_path, const char *snapshot_path);
+
+/**
+ * @brief Map a snapshot saved by xml_save_snapshot
+ * 
+ * The snapshot is mapped and used in place: nothing is copied or relocated,
+ * only its names are interned into a new name table. Snapshots are only
+ * checked for their format and bounds, they must come from
+ * xml_save_snapshot on a machine of the same kind.
+ * 
+ * @param snapshot_path The snapshot
+ * @param source_path The document it was saved from, or NULL to skip the
+ *        staleness check
+ * @param flags XML_SNAPSHOT_DEFAULT or XML_SNAPSHOT_VERIFY_HASH
+ * @return The document, to be freed with xml_flat_free, or NULL when the
+ *         snapshot is missing, invalid or older than the source. The
+ *         document is then to be loaded again.
+ */
+XMLFlatDocument *xml_load_snapshot(const char *snapshot_path, const char *source_path, unsigned int flags);
+
+#endif // __XML_PARSER__
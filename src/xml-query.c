@@ -0,0 +1,486 @@
+#include "xml-parser.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every step is one bit of a uint64_t while the query runs
+#define XML_QUERY_MAX_STEPS 64
+
+typedef enum XMLQueryPredicateType {
+    XML_QUERY_PREDICATE_HAS_ATTRIBUTE, // [@name]
+    XML_QUERY_PREDICATE_ATTRIBUTE_EQUALS, // [@name='value']
+    XML_QUERY_PREDICATE_ATTRIBUTE_NOT_EQUALS, // [@name!='value']
+    XML_QUERY_PREDICATE_POSITION // [n]
+} XMLQueryPredicateType;
+
+typedef struct XMLQueryPredicate {
+    XMLQueryPredicateType type;
+    const char *name; // attribute name
+    const char *value;
+    size_t value_size;
+    size_t position; // 1 for the first match
+    size_t counter; // index of the sibling counter of a positional predicate
+} XMLQueryPredicate;
+
+typedef struct XMLQueryStep {
+    int descendant; // '//' before the step, otherwise the child axis
+    const char *name; // NULL for '*'
+    size_t first_predicate; // index into XMLQuery.predicates
+    size_t predicates_size;
+} XMLQueryStep;
+
+// Compiled form of a path. Names are kept as strings, they are resolved to the
+// atoms of each document when the query runs, so one query serves any number
+// of documents.
+struct XMLQuery {
+    int absolute;
+    XMLQueryStep steps[XML_QUERY_MAX_STEPS];
+    size_t steps_size;
+    XMLQueryPredicate *predicates; // of all steps, in order
+    size_t predicates_size;
+    size_t counters_size; // positional predicates
+    char *strings; // names and values, NUL-terminated
+};
+
+typedef struct XMLQueryCompiler {
+    const char *expression;
+    const char *cursor;
+    XMLQuery *query;
+    size_t predicates_capacity;
+    char *strings_end;
+    XMLError *error; // NULL when the caller does not want it
+} XMLQueryCompiler;
+
+static int xml_query_is_name_char(char c) {
+    return c != '\0' && strchr("/[]@=!'\" \t\r\n*", c) == NULL;
+}
+
+static void xml_query_skip_whitespace(XMLQueryCompiler *compiler) {
+    while (*compiler->cursor == ' ' || *compiler->cursor == '\t' || *compiler->cursor == '\r' || *compiler->cursor == '\n') {
+        compiler->cursor++;
+    }
+}
+
+static int xml_query_fail(XMLQueryCompiler *compiler, XMLErrorCode code, const char *message) {
+    if (compiler->error != NULL) {
+        compiler->error->code = code;
+        compiler->error->message = message;
+        compiler->error->offset = (size_t)(compiler->cursor - compiler->expression);
+    }
+    return -1;
+}
+
+static const char *xml_query_copy(XMLQueryCompiler *compiler, const char *start, size_t size) {
+    char *copy = compiler->strings_end;
+    memcpy(copy, start, size);
+    copy[size] = '\0';
+    compiler->strings_end += size + 1;
+    return copy;
+}
+
+static const char *xml_query_parse_name(XMLQueryCompiler *compiler) {
+    const char *start = compiler->cursor;
+    while (xml_query_is_name_char(*compiler->cursor)) {
+        compiler->cursor++;
+    }
+    if (compiler->cursor == start) {
+        return NULL;
+    }
+    return xml_query_copy(compiler, start, (size_t)(compiler->cursor - start));
+}
+
+static XMLQueryPredicate *xml_query_add_predicate(XMLQueryCompiler *compiler) {
+    XMLQuery *query = compiler->query;
+    if (query->predicates_size == compiler->predicates_capacity) {
+        size_t capacity = compiler->predicates_capacity > 0 ? compiler->predicates_capacity * 2 : 8;
+        XMLQueryPredicate *predicates = realloc(query->predicates, capacity * sizeof(XMLQueryPredicate));
+        if (predicates == NULL) {
+            return NULL;
+        }
+        query->predicates = predicates;
+        compiler->predicates_capacity = capacity;
+    }
+    XMLQueryPredicate *predicate = &query->predicates[query->predicates_size++];
+    memset(predicate, 0, sizeof(XMLQueryPredicate));
+    return predicate;
+}
+
+// Parses one [...] after the opening bracket
+static int xml_query_parse_predicate(XMLQueryCompiler *compiler) {
+    XMLQueryPredicate *predicate = xml_query_add_predicate(compiler);
+    if (predicate == NULL) {
+        return xml_query_fail(compiler, XML_ERROR_MEMORY, "Out of memory");
+    }
+
+    xml_query_skip_whitespace(compiler);
+    if (*compiler->cursor >= '0' && *compiler->cursor <= '9') {
+        size_t position = 0;
+        while (*compiler->cursor >= '0' && *compiler->cursor <= '9') {
+            position = position * 10 + (size_t)(*compiler->cursor - '0');
+            compiler->cursor++;
+        }
+        if (position == 0) {
+            return xml_query_fail(compiler, XML_ERROR_SYNTAX, "Positions start at 1");
+        }
+        predicate->type = XML_QUERY_PREDICATE_POSITION;
+        predicate->position = position;
+        predicate->counter = compiler->query->counters_size++;
+    } else if (*compiler->cursor == '@') {
+        compiler->cursor++;
+        predicate->name = xml_query_parse_name(compiler);
+        if (predicate->name == NULL) {
+            return xml_query_fail(compiler, XML_ERROR_SYNTAX, "Expected an attribute name");
+        }
+        xml_query_skip_whitespace(compiler);
+
+        predicate->type = XML_QUERY_PREDICATE_HAS_ATTRIBUTE;
+        if (*compiler->cursor == '!' && compiler->cursor[1] == '=') {
+            predicate->type = XML_QUERY_PREDICATE_ATTRIBUTE_NOT_EQUALS;
+            compiler->cursor += 2;
+        } else if (*compiler->cursor == '=') {
+            predicate->type = XML_QUERY_PREDICATE_ATTRIBUTE_EQUALS;
+            compiler->cursor++;
+        }
+
+        if (predicate->type != XML_QUERY_PREDICATE_HAS_ATTRIBUTE) {
+            xml_query_skip_whitespace(compiler);
+            char quote = *compiler->cursor;
+            if (quote != '\'' && quote != '"') {
+                return xml_query_fail(compiler, XML_ERROR_SYNTAX, "Expected a quoted value");
+            }
+            const char *start = ++compiler->cursor;
+            while (*compiler->cursor != quote) {
+                if (*compiler->cursor == '\0') {
+                    return xml_query_fail(compiler, XML_ERROR_SYNTAX, "Unterminated value");
+                }
+                compiler->cursor++;
+            }
+            predicate->value_size = (size_t)(compiler->cursor - start);
+            predicate->value = xml_query_copy(compiler, start, predicate->value_size);
+            compiler->cursor++;
+        }
+    } else {
+        return xml_query_fail(compiler, XML_ERROR_SYNTAX, "Expected @attribute or a position");
+    }
+
+    xml_query_skip_whitespace(compiler);
+    if (*compiler->cursor != ']') {
+        return xml_query_fail(compiler, XML_ERROR_SYNTAX, "Expected ]");
+    }
+    compiler->cursor++;
+    return 0;
+}
+
+static int xml_query_parse(XMLQueryCompiler *compiler) {
+    XMLQuery *query = compiler->query;
+
+    xml_query_skip_whitespace(compiler);
+    query->absolute = *compiler->cursor == '/';
+
+    int descendant = 0;
+    if (compiler->cursor[0] == '/' && compiler->cursor[1] == '/') {
+        descendant = 1;
+        compiler->cursor += 2;
+    } else if (compiler->cursor[0] == '/') {
+        compiler->cursor++;
+    }
+
+    while (1) {
+        if (query->steps_size == XML_QUERY_MAX_STEPS) {
+            return xml_query_fail(compiler, XML_ERROR_SYNTAX, "Too many steps");
+        }
+        XMLQueryStep *step = &query->steps[query->steps_size++];
+        step->descendant = descendant;
+
+        if (*compiler->cursor == '*') {
+            step->name = NULL;
+            compiler->cursor++;
+        } else {
+            step->name = xml_query_parse_name(compiler);
+            if (step->name == NULL) {
+                return xml_query_fail(compiler, XML_ERROR_SYNTAX, "Expected an element name or *");
+            }
+        }
+
+        step->first_predicate = query->predicates_size;
+        while (*compiler->cursor == '[') {
+            compiler->cursor++;
+            if (xml_query_parse_predicate(compiler) != 0) {
+                return -1;
+            }
+        }
+        step->predicates_size = query->predicates_size - step->first_predicate;
+
+        xml_query_skip_whitespace(compiler);
+        if (*compiler->cursor == '\0') {
+            break;
+        }
+        if (compiler->cursor[0] == '/' && compiler->cursor[1] == '/') {
+            descendant = 1;
+            compiler->cursor += 2;
+        } else if (compiler->cursor[0] == '/') {
+            descendant = 0;
+            compiler->cursor++;
+        } else {
+            return xml_query_fail(compiler, XML_ERROR_SYNTAX, "Expected / or the end of the query");
+        }
+    }
+    return 0;
+}
+
+XMLQuery *xml_query_compile(const char *expression) {
+    return xml_query_compile_ex(expression, NULL);
+}
+
+XMLQuery *xml_query_compile_ex(const char *expression, XMLError *error) {
+    if (error != NULL) {
+        memset(error, 0, sizeof(XMLError));
+    }
+    if (expression == NULL) {
+        return NULL;
+    }
+
+    XMLQuery *query = calloc(1, sizeof(XMLQuery));
+    // every name or value is a piece of the expression plus a terminator
+    size_t length = strlen(expression);
+    if (query != NULL) {
+        query->strings = malloc(length * 2 + 1);
+    }
+    if (query == NULL || query->strings == NULL) {
+        if (error != NULL) {
+            error->code = XML_ERROR_MEMORY;
+            error->message = "Out of memory";
+        }
+        free(query);
+        return NULL;
+    }
+
+    XMLQueryCompiler compiler;
+    compiler.expression = expression;
+    compiler.cursor = expression;
+    compiler.query = query;
+    compiler.predicates_capacity = 0;
+    compiler.strings_end = query->strings;
+    compiler.error = error;
+
+    if (xml_query_parse(&compiler) != 0) {
+        xml_query_free(query);
+        return NULL;
+    }
+    return query;
+}
+
+void xml_query_free(XMLQuery *query) {
+    if (query == NULL) {
+        return;
+    }
+    free(query->predicates);
+    free(query->strings);
+    free(query);
+}
+
+// Children of one element still to be visited, with the steps they can match
+typedef struct XMLQueryFrame {
+    XMLElement *next;
+    uint64_t child_ready; // child axis steps whose previous step matched the parent
+    uint64_t desc_ready; // descendant axis steps whose previous step matched
+                         // the parent or any of its ancestors
+} XMLQueryFrame;
+
+typedef struct XMLQueryRun {
+    const XMLQuery *query;
+    // atoms of the step names and predicate attribute names in this document
+    XMLAtom *step_atoms;
+    XMLAtom *predicate_atoms;
+    uint64_t child_steps; // steps on the child axis
+    uint64_t desc_steps; // steps on the descendant axis
+    uint64_t possible_steps; // steps whose names occur in the document
+
+    XMLQueryFrame *frames;
+    size_t *counters; // counters_size sibling counters per frame
+    size_t depth;
+    size_t capacity;
+} XMLQueryRun;
+
+static int xml_query_push(XMLQueryRun *run, XMLElement *first_child, uint64_t child_ready, uint64_t desc_ready) {
+    size_t counters_size = run->query->counters_size;
+    if (run->depth == run->capacity) {
+        size_t capacity = run->capacity > 0 ? run->capacity * 2 : 64;
+        XMLQueryFrame *frames = realloc(run->frames, capacity * sizeof(XMLQueryFrame));
+        if (frames == NULL) {
+            return -1;
+        }
+        run->frames = frames;
+        if (counters_size > 0) {
+            size_t *counters = realloc(run->counters, capacity * counters_size * sizeof(size_t));
+            if (counters == NULL) {
+                return -1;
+            }
+            run->counters = counters;
+        }
+        run->capacity = capacity;
+    }
+
+    XMLQueryFrame *frame = &run->frames[run->depth];
+    frame->next = first_child;
+    frame->child_ready = child_ready;
+    frame->desc_ready = desc_ready;
+    if (counters_size > 0) {
+        memset(run->counters + run->depth * counters_size, 0, counters_size * sizeof(size_t));
+    }
+    run->depth++;
+    return 0;
+}
+
+static int xml_query_match_step(XMLQueryRun *run, size_t index, XMLElement *element, size_t *counters) {
+    const XMLQueryStep *step = &run->query->steps[index];
+    if (step->name != NULL && element->name_atom != run->step_atoms[index]) {
+        return 0;
+    }
+
+    for (size_t i = step->first_predicate; i < step->first_predicate + step->predicates_size; i++) {
+        const XMLQueryPredicate *predicate = &run->query->predicates[i];
+        if (predicate->type == XML_QUERY_PREDICATE_POSITION) {
+            // counts the siblings that got this far
+            if (++counters[predicate->counter] != predicate->position) {
+                return 0;
+            }
+            continue;
+        }
+
+        XMLAttribute *attribute = xml_attribute_get_atom(element, run->predicate_atoms[i]);
+        if (attribute == NULL) {
+            return 0;
+        }
+        if (predicate->type != XML_QUERY_PREDICATE_HAS_ATTRIBUTE) {
+            int equal = attribute->value_size == predicate->value_size && memcmp(attribute->value, predicate->value, predicate->value_size) == 0;
+            if (equal != (predicate->type == XML_QUERY_PREDICATE_ATTRIBUTE_EQUALS)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Walks the subtree once in document order. Each open element carries the
+// set of steps its children can match, so every element is tested against
+// the steps that can apply to it, and subtrees where no step can match any
+// more are skipped.
+static long xml_query_run(XMLQueryRun *run, XMLElement *first, XMLQueryCallback callback, void *user_data) {
+    const XMLQuery *query = run->query;
+    uint64_t last_step = (uint64_t)1 << (query->steps_size - 1);
+    long matches = 0;
+
+    if (xml_query_push(run, first, 1 & run->child_steps, 1 & run->desc_steps) != 0) {
+        return -1;
+    }
+
+    while (run->depth > 0) {
+        XMLQueryFrame *frame = &run->frames[run->depth - 1];
+        XMLElement *element = frame->next;
+        if (element == NULL) {
+            run->depth--;
+            continue;
+        }
+        frame->next = element->next_sibling;
+
+        uint64_t candidates = frame->child_ready | frame->desc_ready;
+        size_t *counters = run->counters + (run->depth - 1) * query->counters_size;
+        uint64_t matched = 0;
+        while (candidates != 0) {
+            size_t index = (size_t)__builtin_ctzll(candidates);
+            candidates &= candidates - 1;
+            if (xml_query_match_step(run, index, element, counters)) {
+                matched |= (uint64_t)1 << index;
+            }
+        }
+
+        if (matched & last_step) {
+            matches++;
+            if (callback != NULL && callback(element, user_data) != 0) {
+                break;
+            }
+        }
+
+        uint64_t next_steps = (matched << 1) & run->possible_steps;
+        uint64_t child_ready = next_steps & run->child_steps;
+        uint64_t desc_ready = frame->desc_ready | (next_steps & run->desc_steps);
+        XMLElement *children = (child_ready | desc_ready) != 0 ? xml_element_children(element) : NULL;
+        if (children != NULL) {
+            if (xml_query_push(run, children, child_ready, desc_ready) != 0) {
+                return -1;
+            }
+        }
+    }
+    return matches;
+}
+
+static XMLAtom xml_query_lookup(XMLNameTable *names, const char *name) {
+    return xml_name_table_lookup(names, name);
+}
+
+long xml_query_exec(const XMLFile *file, XMLElement *context, const XMLQuery *query, XMLQueryCallback callback, void *user_data) {
+    if (file == NULL || query == NULL || file->root == NULL) {
+        return file != NULL && query != NULL ? 0 : -1;
+    }
+
+    XMLQueryRun run;
+    memset(&run, 0, sizeof(run));
+    run.query = query;
+    run.step_atoms = malloc((query->steps_size + query->predicates_size) * sizeof(XMLAtom));
+    if (run.step_atoms == NULL) {
+        return -1;
+    }
+    run.predicate_atoms = run.step_atoms + query->steps_size;
+
+    // resolve the names once, a name missing from the document rules its step
+    // out. Elements of a lazy document may not be built yet, their names are
+    // added so they get the same atoms when they are.
+    XMLAtom (*resolve)(XMLNameTable *, const char *) = file->lazy != NULL ? xml_name_table_add : xml_query_lookup;
+    for (size_t i = 0; i < query->steps_size; i++) {
+        const XMLQueryStep *step = &query->steps[i];
+        uint64_t bit = (uint64_t)1 << i;
+        int possible = 1;
+
+        if (step->name != NULL) {
+            run.step_atoms[i] = resolve(file->names, step->name);
+            possible = run.step_atoms[i] != XML_ATOM_NONE;
+        }
+        for (size_t index = step->first_predicate; index < step->first_predicate + step->predicates_size; index++) {
+            const XMLQueryPredicate *predicate = &query->predicates[index];
+            run.predicate_atoms[index] = XML_ATOM_NONE;
+            if (predicate->type != XML_QUERY_PREDICATE_POSITION) {
+                run.predicate_atoms[index] = resolve(file->names, predicate->name);
+                possible = possible && run.predicate_atoms[index] != XML_ATOM_NONE;
+            }
+        }
+
+        if (possible) {
+            run.possible_steps |= bit;
+        }
+        if (step->descendant) {
+            run.desc_steps |= bit;
+        } else {
+            run.child_steps |= bit;
+        }
+    }
+
+    // absolute paths start at the document, whose only child is the root
+    XMLElement *first = file->root;
+    if (context != NULL && !query->absolute) {
+        first = xml_element_children(context);
+    }
+
+    long matches = 0;
+    run.child_steps &= run.possible_steps;
+    run.desc_steps &= run.possible_steps;
+    if (run.possible_steps & 1) {
+        matches = xml_query_run(&run, first, callback, user_data);
+    }
+
+    free(run.step_atoms);
+    free(run.frames);
+    free(run.counters);
+    return matches;
+}
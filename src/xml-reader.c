@@ -0,0 +1,348 @@
+#include "xml-parser.h"
+#include "xml-tokenizer.h"
+#include "xml-scan.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define XML_READER_MIN_CAPACITY (64 * 1024)
+
+typedef enum XMLReaderState {
+    XML_READER_STATE_PROLOG, // before the root element
+    XML_READER_STATE_CONTENT,
+    XML_READER_STATE_DONE, // the root element is closed, the rest is ignored
+    XML_READER_STATE_ERROR
+} XMLReaderState;
+
+struct XMLReader {
+    // unconsumed input, buffer[position..size)
+    char *buffer;
+    size_t size;
+    size_t position;
+    size_t capacity;
+    size_t buffer_offset; // stream offset of buffer[0]
+    int finished;
+
+    XMLReaderState state;
+
+    // start tag whose attribute and self-closing end events are still pending.
+    // Its bytes stay in the buffer until they have been reported.
+    XMLToken pending;
+    XMLTokenAttributes attributes;
+    size_t next_attribute;
+    int pending_start;
+    int pending_end;
+
+    // an incomplete token is only retried once wait_byte shows up in new input
+    char wait_byte;
+    size_t wait_from;
+
+    // names of the open elements, back to back, to match the end tags
+    char *names;
+    size_t names_size;
+    size_t names_capacity;
+    size_t *name_offsets;
+    size_t depth;
+    size_t depth_capacity;
+
+    XMLError error;
+};
+
+XMLReader *xml_reader_new(void) {
+    XMLReader *reader = calloc(1, sizeof(XMLReader));
+    if (reader == NULL) {
+        return NULL;
+    }
+    reader->state = XML_READER_STATE_PROLOG;
+    return reader;
+}
+
+void xml_reader_free(XMLReader *reader) {
+    if (reader == NULL) {
+        return;
+    }
+    free(reader->buffer);
+    free(reader->names);
+    free(reader->name_offsets);
+    xml_token_attributes_free(&reader->attributes);
+    free(reader);
+}
+
+static int xml_reader_has_pending(const XMLReader *reader) {
+    return reader->pending_start || reader->pending_end || reader->next_attribute < reader->attributes.count;
+}
+
+// Moves every pointer into the buffer after it has been moved or reallocated
+static void xml_reader_rebase(XMLReader *reader, const char *old_buffer, char *new_buffer, size_t discarded) {
+    if (!xml_reader_has_pending(reader)) {
+        return;
+    }
+    ptrdiff_t delta = (new_buffer - old_buffer) - (ptrdiff_t)discarded;
+    reader->pending.start += delta;
+    reader->pending.end += delta;
+    reader->pending.name += delta;
+    for (size_t i = 0; i < reader->attributes.count; i++) {
+        reader->attributes.items[i].name += delta;
+        reader->attributes.items[i].value += delta;
+    }
+}
+
+int xml_reader_feed(XMLReader *reader, const char *buf, size_t len) {
+    if (reader->state == XML_READER_STATE_DONE || reader->state == XML_READER_STATE_ERROR || len == 0) {
+        return 0;
+    }
+
+    // drop what has been consumed, keeping a start tag that still has events
+    size_t keep_from = reader->position;
+    if (xml_reader_has_pending(reader)) {
+        keep_from = (size_t)(reader->pending.start - reader->buffer);
+    }
+    if (keep_from > 0) {
+        memmove(reader->buffer, reader->buffer + keep_from, reader->size - keep_from);
+        xml_reader_rebase(reader, reader->buffer, reader->buffer, keep_from);
+        reader->size -= keep_from;
+        reader->position -= keep_from;
+        reader->wait_from = reader->wait_from > keep_from ? reader->wait_from - keep_from : 0;
+        reader->buffer_offset += keep_from;
+    }
+
+    if (reader->capacity - reader->size < len) {
+        size_t capacity = reader->capacity > 0 ? reader->capacity : XML_READER_MIN_CAPACITY;
+        while (capacity - reader->size < len) {
+            capacity *= 2;
+        }
+        // not realloc: the pending pointers are rebased against the old block
+        char *buffer = malloc(capacity);
+        if (buffer == NULL) {
+            return -1;
+        }
+        if (reader->size > 0) {
+            memcpy(buffer, reader->buffer, reader->size);
+        }
+        xml_reader_rebase(reader, reader->buffer, buffer, 0);
+        free(reader->buffer);
+        reader->buffer = buffer;
+        reader->capacity = capacity;
+    }
+
+    memcpy(reader->buffer + reader->size, buf, len);
+    reader->size += len;
+    return 0;
+}
+
+void xml_reader_finish(XMLReader *reader) {
+    reader->finished = 1;
+}
+
+static XMLReaderStatus xml_reader_fail(XMLReader *reader, XMLErrorCode code, const char *message, const char *position) {
+    reader->state = XML_READER_STATE_ERROR;
+    reader->error.code = code;
+    reader->error.message = message;
+    reader->error.offset = reader->buffer_offset + (size_t)(position - reader->buffer);
+    return XML_READER_ERROR;
+}
+
+static XMLReaderStatus xml_reader_fail_token(XMLReader *reader, XMLTokenError error, const char *position) {
+    return xml_reader_fail(reader, xml_token_error_code(error), xml_token_error_string(error), position);
+}
+
+static int xml_reader_push(XMLReader *reader, const char *name, size_t name_size) {
+    if (reader->depth == reader->depth_capacity) {
+        size_t capacity = reader->depth_capacity > 0 ? reader->depth_capacity * 2 : 64;
+        size_t *offsets = realloc(reader->name_offsets, capacity * sizeof(size_t));
+        if (offsets == NULL) {
+            return -1;
+        }
+        reader->name_offsets = offsets;
+        reader->depth_capacity = capacity;
+    }
+    if (reader->names_capacity - reader->names_size < name_size) {
+        size_t capacity = reader->names_capacity > 0 ? reader->names_capacity : 1024;
+        while (capacity - reader->names_size < name_size) {
+            capacity *= 2;
+        }
+        char *names = realloc(reader->names, capacity);
+        if (names == NULL) {
+            return -1;
+        }
+        reader->names = names;
+        reader->names_capacity = capacity;
+    }
+
+    reader->name_offsets[reader->depth++] = reader->names_size;
+    memcpy(reader->names + reader->names_size, name, name_size);
+    reader->names_size += name_size;
+    return 0;
+}
+
+// Reports the events of reader->pending: start, then attributes, then the end
+// of a self-closing tag
+static XMLReaderStatus xml_reader_next_pending(XMLReader *reader, XMLEvent *event) {
+    event->name.data = reader->pending.name;
+    event->name.size = reader->pending.name_size;
+    event->value.data = NULL;
+    event->value.size = 0;
+    event->depth = (int)reader->depth;
+
+    if (reader->pending_start) {
+        reader->pending_start = 0;
+        event->type = XML_EVENT_START_ELEMENT;
+        return XML_READER_EVENT;
+    }
+
+    if (reader->next_attribute < reader->attributes.count) {
+        const XMLTokenAttribute *attribute = &reader->attributes.items[reader->next_attribute++];
+        event->type = XML_EVENT_ATTRIBUTE;
+        event->name.data = attribute->name;
+        event->name.size = attribute->name_size;
+        event->value.data = attribute->value;
+        event->value.size = attribute->value_size;
+        return XML_READER_EVENT;
+    }
+
+    // self-closing tag
+    reader->pending_end = 0;
+    event->type = XML_EVENT_END_ELEMENT;
+    reader->depth--;
+    reader->names_size = reader->name_offsets[reader->depth];
+    if (reader->depth == 0) {
+        reader->state = XML_READER_STATE_DONE;
+    }
+    return XML_READER_EVENT;
+}
+
+XMLReaderStatus xml_reader_next(XMLReader *reader, XMLEvent *event) {
+    while (1) {
+        if (reader->state == XML_READER_STATE_ERROR) {
+            return XML_READER_ERROR;
+        }
+
+        if (xml_reader_has_pending(reader)) {
+            return xml_reader_next_pending(reader, event);
+        }
+        reader->attributes.count = 0;
+        reader->next_attribute = 0;
+
+        if (reader->state == XML_READER_STATE_DONE) {
+            return XML_READER_DONE;
+        }
+
+        if (reader->wait_byte != 0 && !reader->finished) {
+            const char *scan_end = reader->buffer + reader->size;
+            if (xml_scan_find_byte(reader->buffer + reader->wait_from, scan_end, reader->wait_byte) == scan_end) {
+                reader->wait_from = reader->size;
+                return XML_READER_NEED_MORE;
+            }
+        }
+        reader->wait_byte = 0;
+
+        const char *cursor = reader->buffer + reader->position;
+        const char *end = reader->buffer + reader->size;
+        XMLToken token;
+        XMLTokenStatus status = xml_tokenize_content(cursor, end, &token, &reader->attributes);
+        if (status != XML_TOKEN_OK) {
+            // drop the attributes of a partial start tag, they are not pending
+            reader->attributes.count = 0;
+        }
+
+        if (status == XML_TOKEN_INCOMPLETE) {
+            if (reader->finished) {
+                if (reader->state == XML_READER_STATE_PROLOG && token.error == XML_TOKEN_ERROR_UNEXPECTED_END && token.start == end) {
+                    return xml_reader_fail_token(reader, XML_TOKEN_ERROR_EXPECTED_ELEMENT, token.start);
+                }
+                return xml_reader_fail_token(reader, token.error, token.error_position);
+            }
+            // every markup token ends with '>' and text ends at the next '<'
+            const char *first = xml_scan_skip_whitespace(cursor, end);
+            reader->wait_byte = (first < end && *first == '<') ? '>' : '<';
+            reader->wait_from = reader->size;
+            return XML_READER_NEED_MORE;
+        }
+        if (status == XML_TOKEN_ERROR) {
+            return xml_reader_fail_token(reader, token.error, token.error_position);
+        }
+
+        event->name.data = NULL;
+        event->name.size = 0;
+        event->value.data = token.value;
+        event->value.size = token.value_size;
+        event->depth = (int)reader->depth;
+
+        switch (token.type) {
+            case XML_TOKEN_START_TAG:
+                if (xml_reader_push(reader, token.name, token.name_size) != 0) {
+                    return xml_reader_fail_token(reader, XML_TOKEN_ERROR_MEMORY, token.start);
+                }
+                reader->state = XML_READER_STATE_CONTENT;
+                reader->pending = token;
+                reader->pending_start = 1;
+                reader->pending_end = token.self_closing;
+                reader->position = (size_t)(token.end - reader->buffer);
+                return xml_reader_next_pending(reader, event);
+
+            case XML_TOKEN_END_TAG: {
+                if (reader->state == XML_READER_STATE_PROLOG) {
+                    return xml_reader_fail_token(reader, XML_TOKEN_ERROR_EXPECTED_ELEMENT, token.start);
+                }
+                const char *open_name = reader->names + reader->name_offsets[reader->depth - 1];
+                size_t open_size = reader->names_size - reader->name_offsets[reader->depth - 1];
+                if (token.name_size != open_size || memcmp(open_name, token.name, open_size) != 0) {
+                    return xml_reader_fail(reader, XML_ERROR_MISMATCHED_TAG, "Mismatch in closing tag", token.start);
+                }
+                reader->position = (size_t)(token.end - reader->buffer);
+                reader->depth--;
+                reader->names_size = reader->name_offsets[reader->depth];
+                if (reader->depth == 0) {
+                    reader->state = XML_READER_STATE_DONE;
+                }
+                // the popped name stays in place until the next push
+                event->type = XML_EVENT_END_ELEMENT;
+                event->name.data = open_name;
+                event->name.size = open_size;
+                event->value.data = NULL;
+                event->depth = (int)reader->depth + 1;
+                return XML_READER_EVENT;
+            }
+
+            case XML_TOKEN_TEXT:
+                if (reader->state == XML_READER_STATE_PROLOG) {
+                    return xml_reader_fail_token(reader, XML_TOKEN_ERROR_EXPECTED_ELEMENT, token.start);
+                }
+                reader->position = (size_t)(token.end - reader->buffer);
+                event->type = XML_EVENT_TEXT;
+                return XML_READER_EVENT;
+
+            case XML_TOKEN_CDATA:
+                if (reader->state == XML_READER_STATE_PROLOG) {
+                    return xml_reader_fail_token(reader, XML_TOKEN_ERROR_EXPECTED_ELEMENT, token.start);
+                }
+                reader->position = (size_t)(token.end - reader->buffer);
+                event->type = XML_EVENT_CDATA;
+                return XML_READER_EVENT;
+
+            case XML_TOKEN_COMMENT:
+                reader->position = (size_t)(token.end - reader->buffer);
+                event->type = XML_EVENT_COMMENT;
+                return XML_READER_EVENT;
+
+            case XML_TOKEN_PROCESSING_INSTRUCTION:
+                // the XML declaration and other processing instructions
+                reader->position = (size_t)(token.end - reader->buffer);
+                continue;
+        }
+    }
+}
+
+const char *xml_reader_error(const XMLReader *reader, size_t *offset) {
+    if (reader->state != XML_READER_STATE_ERROR) {
+        return NULL;
+    }
+    if (offset != NULL) {
+        *offset = reader->error.offset;
+    }
+    return reader->error.message;
+}
+
+const XMLError *xml_reader_last_error(const XMLReader *reader) {
+    return reader->state == XML_READER_STATE_ERROR ? &reader->error : NULL;
+}
@@ -0,0 +1,726 @@
+#include "xml-scan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(XML_SCAN_DISABLE_SIMD)
+#define XML_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static int xml_is_whitespace(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int xml_is_name_end(unsigned char c) {
+    return xml_is_whitespace(c) || c == '>' || c == '/' || c == '=' || c == '\0';
+}
+
+// Portable fallback, also used for the tail shorter than one vector
+
+static const char *xml_scan_skip_whitespace_scalar(const char *cursor, const char *end) {
+    while (cursor < end && xml_is_whitespace((unsigned char)*cursor)) {
+        cursor++;
+    }
+    return cursor;
+}
+
+static const char *xml_scan_find_byte_scalar(const char *cursor, const char *end, char value) {
+    if (cursor >= end) {
+        return end;
+    }
+    const char *found = memchr(cursor, value, (size_t)(end - cursor));
+    return found != NULL ? found : end;
+}
+
+static const char *xml_scan_find_name_end_scalar(const char *cursor, const char *end) {
+    while (cursor < end && !xml_is_name_end((unsigned char)*cursor)) {
+        cursor++;
+    }
+    return cursor;
+}
+
+static const char *xml_scan_find_any_scalar(const char *cursor, const char *end, const XMLScanSet *set) {
+    while (cursor < end && !set->table[(unsigned char)*cursor]) {
+        cursor++;
+    }
+    return cursor;
+}
+
+static int xml_is_structural(unsigned char c) {
+    return c == '<' || c == '>' || c == '"' || c == '\'';
+}
+
+// offsets are relative to start, cursor is where the scan resumes
+static size_t xml_scan_structural_tail(const char *start, const char *cursor, const char *end, uint32_t *offsets, size_t count) {
+    for (; cursor < end; cursor++) {
+        if (xml_is_structural((unsigned char)*cursor)) {
+            offsets[count++] = (uint32_t)(cursor - start);
+        }
+    }
+    return count;
+}
+
+static size_t xml_scan_structural_scalar(const char *start, const char *end, uint32_t *offsets) {
+    return xml_scan_structural_tail(start, start, end, offsets, 0);
+}
+
+static const char *xml_scan_find_non_ascii_scalar(const char *cursor, const char *end) {
+    while (cursor < end && (unsigned char)*cursor < 0x80) {
+        cursor++;
+    }
+    return cursor;
+}
+
+// End of the UTF-8 sequence that starts with the non-ASCII byte at cursor,
+// NULL if it is not valid (RFC 3629)
+static const char *xml_utf8_sequence_end(const char *cursor, const char *end) {
+    const unsigned char *bytes = (const unsigned char *)cursor;
+    size_t available = (size_t)(end - cursor);
+    unsigned char lead = bytes[0];
+    // the range of the second byte depends on the lead, the others are plain
+    // continuation bytes
+    unsigned char low = 0x80, high = 0xBF;
+    size_t size;
+    if (lead < 0xC2) {
+        return NULL;
+    } else if (lead < 0xE0) {
+        size = 2;
+    } else if (lead < 0xF0) {
+        size = 3;
+        low = lead == 0xE0 ? 0xA0 : 0x80; // overlong
+        high = lead == 0xED ? 0x9F : 0xBF; // surrogates
+    } else if (lead < 0xF5) {
+        size = 4;
+        low = lead == 0xF0 ? 0x90 : 0x80; // overlong
+        high = lead == 0xF4 ? 0x8F : 0xBF; // above U+10FFFF
+    } else {
+        return NULL;
+    }
+    if (available < size || bytes[1] < low || bytes[1] > high) {
+        return NULL;
+    }
+    for (size_t i = 2; i < size; i++) {
+        if ((bytes[i] & 0xC0) != 0x80) {
+            return NULL;
+        }
+    }
+    return cursor + size;
+}
+
+// Checks the non-ASCII run at cursor a sequence at a time, returns where the
+// run ends or the invalid byte
+static const char *xml_utf8_run_end(const char *cursor, const char *end, int *valid) {
+    while (cursor < end && (unsigned char)*cursor >= 0x80) {
+        const char *next = xml_utf8_sequence_end(cursor, end);
+        if (next == NULL) {
+            *valid = 0;
+            return cursor;
+        }
+        cursor = next;
+    }
+    *valid = 1;
+    return cursor;
+}
+
+static const char *xml_scan_validate_utf8_scalar(const char *cursor, const char *end) {
+    int valid = 1;
+    while (valid && (cursor = xml_scan_find_non_ascii_scalar(cursor, end)) < end) {
+        cursor = xml_utf8_run_end(cursor, end, &valid);
+    }
+    return cursor;
+}
+
+static size_t xml_scan_utf16_ascii_scalar(const char *input, size_t units, char *output, int big_endian) {
+    const unsigned char *bytes = (const unsigned char *)input;
+    size_t high = big_endian ? 0 : 1;
+    size_t i = 0;
+    for (; i < units; i++) {
+        unsigned char low = bytes[2 * i + 1 - high];
+        if (bytes[2 * i + high] != 0 || low >= 0x80) {
+            break;
+        }
+        output[i] = (char)low;
+    }
+    return i;
+}
+
+#ifdef XML_SCAN_X86
+
+// SSE2: 16 bytes per step. Each helper returns a bitmask with one bit per byte
+// of the block that belongs to the class.
+
+__attribute__((target("sse2")))
+static unsigned int xml_sse2_whitespace_mask(__m128i block) {
+    __m128i match = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\t'))),
+        _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\r'))));
+    return (unsigned int)_mm_movemask_epi8(match);
+}
+
+__attribute__((target("sse2")))
+static const char *xml_scan_skip_whitespace_sse2(const char *cursor, const char *end) {
+    // most calls skip nothing or a single separator, avoid the vector setup
+    if (cursor >= end || !xml_is_whitespace((unsigned char)*cursor)) {
+        return cursor;
+    }
+    while (end - cursor >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)cursor);
+        unsigned int mask = ~xml_sse2_whitespace_mask(block) & 0xFFFFu;
+        if (mask != 0) {
+            return cursor + __builtin_ctz(mask);
+        }
+        cursor += 16;
+    }
+    return xml_scan_skip_whitespace_scalar(cursor, end);
+}
+
+__attribute__((target("sse2")))
+static const char *xml_scan_find_byte_sse2(const char *cursor, const char *end, char value) {
+    __m128i needle = _mm_set1_epi8(value);
+    while (end - cursor >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)cursor);
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask != 0) {
+            return cursor + __builtin_ctz(mask);
+        }
+        cursor += 16;
+    }
+    return xml_scan_find_byte_scalar(cursor, end, value);
+}
+
+__attribute__((target("sse2")))
+static const char *xml_scan_find_name_end_sse2(const char *cursor, const char *end) {
+    while (end - cursor >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)cursor);
+        __m128i match = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('>')), _mm_cmpeq_epi8(block, _mm_set1_epi8('/'))),
+            _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('=')), _mm_cmpeq_epi8(block, _mm_setzero_si128())));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(match) | xml_sse2_whitespace_mask(block);
+        if (mask != 0) {
+            return cursor + __builtin_ctz(mask);
+        }
+        cursor += 16;
+    }
+    return xml_scan_find_name_end_scalar(cursor, end);
+}
+
+// The needles of find_any come from set->bytes, which repeats its first byte
+// up to XML_SCAN_SET_MAX so every compare can run unconditionally. The tail
+// shorter than a vector goes through the byte table.
+
+__attribute__((target("sse2")))
+static const char *xml_scan_find_any_sse2(const char *cursor, const char *end, const XMLScanSet *set) {
+    if (end - cursor >= 16) {
+        __m128i n0 = _mm_set1_epi8(set->bytes[0]), n1 = _mm_set1_epi8(set->bytes[1]);
+        __m128i n2 = _mm_set1_epi8(set->bytes[2]), n3 = _mm_set1_epi8(set->bytes[3]);
+        do {
+            __m128i block = _mm_loadu_si128((const __m128i *)cursor);
+            __m128i match = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, n0), _mm_cmpeq_epi8(block, n1)),
+                                         _mm_or_si128(_mm_cmpeq_epi8(block, n2), _mm_cmpeq_epi8(block, n3)));
+            if (set->size > 4) {
+                match = _mm_or_si128(match, _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(set->bytes[4])), _mm_cmpeq_epi8(block, _mm_set1_epi8(set->bytes[5]))),
+                    _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(set->bytes[6])), _mm_cmpeq_epi8(block, _mm_set1_epi8(set->bytes[7])))));
+            }
+            unsigned int mask = (unsigned int)_mm_movemask_epi8(match);
+            if (mask != 0) {
+                return cursor + __builtin_ctz(mask);
+            }
+            cursor += 16;
+        } while (end - cursor >= 16);
+    }
+    return xml_scan_find_any_scalar(cursor, end, set);
+}
+
+// Appends the offset of every set bit of mask, block being the offset of bit 0
+static size_t xml_scan_flatten(uint32_t block, uint64_t mask, uint32_t *offsets, size_t count) {
+    while (mask != 0) {
+        offsets[count++] = block + (uint32_t)__builtin_ctzll(mask);
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+__attribute__((target("sse2")))
+static unsigned int xml_sse2_structural_mask(__m128i block) {
+    __m128i match = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('<')), _mm_cmpeq_epi8(block, _mm_set1_epi8('>'))),
+        _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('"')), _mm_cmpeq_epi8(block, _mm_set1_epi8('\''))));
+    return (unsigned int)_mm_movemask_epi8(match);
+}
+
+// 64 bytes per step, so the bitmask of a step fills one 64-bit word
+__attribute__((target("sse2")))
+static size_t xml_scan_structural_sse2(const char *start, const char *end, uint32_t *offsets) {
+    const char *cursor = start;
+    size_t count = 0;
+    while (end - cursor >= 64) {
+        uint64_t mask = (uint64_t)xml_sse2_structural_mask(_mm_loadu_si128((const __m128i *)cursor))
+            | (uint64_t)xml_sse2_structural_mask(_mm_loadu_si128((const __m128i *)(cursor + 16))) << 16
+            | (uint64_t)xml_sse2_structural_mask(_mm_loadu_si128((const __m128i *)(cursor + 32))) << 32
+            | (uint64_t)xml_sse2_structural_mask(_mm_loadu_si128((const __m128i *)(cursor + 48))) << 48;
+        count = xml_scan_flatten((uint32_t)(cursor - start), mask, offsets, count);
+        cursor += 64;
+    }
+    return xml_scan_structural_tail(start, cursor, end, offsets, count);
+}
+
+__attribute__((target("sse2")))
+static const char *xml_scan_find_non_ascii_sse2(const char *cursor, const char *end) {
+    while (end - cursor >= 16) {
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)cursor));
+        if (mask != 0) {
+            return cursor + __builtin_ctz(mask);
+        }
+        cursor += 16;
+    }
+    return xml_scan_find_non_ascii_scalar(cursor, end);
+}
+
+// SSE2 has no byte shuffle for the lookup tables of the AVX2 validator, so
+// it only skips ASCII 16 bytes at a time and checks the rest a sequence at a
+// time
+__attribute__((target("sse2")))
+static const char *xml_scan_validate_utf8_sse2(const char *cursor, const char *end) {
+    int valid = 1;
+    while (valid && (cursor = xml_scan_find_non_ascii_sse2(cursor, end)) < end) {
+        cursor = xml_utf8_run_end(cursor, end, &valid);
+    }
+    return cursor;
+}
+
+// A code unit is ASCII when its high byte is 0 and its low byte below 0x80.
+// Big endian units read as little endian 16-bit lanes have the bytes swapped.
+__attribute__((target("sse2")))
+static size_t xml_scan_utf16_ascii_sse2(const char *input, size_t units, char *output, int big_endian) {
+    __m128i mask = _mm_set1_epi16(big_endian ? (short)0x80FF : (short)0xFF80);
+    size_t i = 0;
+    for (; units - i >= 8; i += 8) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(input + 2 * i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(block, mask), _mm_setzero_si128())) != 0xFFFF) {
+            break;
+        }
+        if (big_endian) {
+            block = _mm_srli_epi16(block, 8);
+        }
+        _mm_storel_epi64((__m128i *)(output + i), _mm_packus_epi16(block, block));
+    }
+    return i + xml_scan_utf16_ascii_scalar(input + 2 * i, units - i, output + i, big_endian);
+}
+
+#ifndef XML_SCAN_DISABLE_AVX2
+
+// AVX2: the same kernels 32 bytes per step, finishing with SSE2 for the tail
+
+__attribute__((target("avx2")))
+static unsigned int xml_avx2_whitespace_mask(__m256i block) {
+    __m256i match = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\r'))));
+    return (unsigned int)_mm256_movemask_epi8(match);
+}
+
+__attribute__((target("avx2")))
+static const char *xml_scan_skip_whitespace_avx2(const char *cursor, const char *end) {
+    if (cursor >= end || !xml_is_whitespace((unsigned char)*cursor)) {
+        return cursor;
+    }
+    while (end - cursor >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)cursor);
+        unsigned int mask = ~xml_avx2_whitespace_mask(block);
+        if (mask != 0) {
+            return cursor + __builtin_ctz(mask);
+        }
+        cursor += 32;
+    }
+    return xml_scan_skip_whitespace_sse2(cursor, end);
+}
+
+__attribute__((target("avx2")))
+static const char *xml_scan_find_byte_avx2(const char *cursor, const char *end, char value) {
+    __m256i needle = _mm256_set1_epi8(value);
+    while (end - cursor >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)cursor);
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask != 0) {
+            return cursor + __builtin_ctz(mask);
+        }
+        cursor += 32;
+    }
+    return xml_scan_find_byte_sse2(cursor, end, value);
+}
+
+__attribute__((target("avx2")))
+static const char *xml_scan_find_name_end_avx2(const char *cursor, const char *end) {
+    while (end - cursor >= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)cursor);
+        __m256i match = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('>')), _mm256_cmpeq_epi8(block, _mm256_set1_epi8('/'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('=')), _mm256_cmpeq_epi8(block, _mm256_setzero_si256())));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(match) | xml_avx2_whitespace_mask(block);
+        if (mask != 0) {
+            return cursor + __builtin_ctz(mask);
+        }
+        cursor += 32;
+    }
+    return xml_scan_find_name_end_sse2(cursor, end);
+}
+
+// Unlike the other AVX2 kernels this one does not hand its tail to the SSE2
+// kernel: that one is too large to inline, and calling legacy SSE code with
+// the upper halves of the registers in use stalls on every short value.
+__attribute__((target("avx2")))
+static const char *xml_scan_find_any_avx2(const char *cursor, const char *end, const XMLScanSet *set) {
+    if (end - cursor >= 32) {
+        __m256i n0 = _mm256_set1_epi8(set->bytes[0]), n1 = _mm256_set1_epi8(set->bytes[1]);
+        __m256i n2 = _mm256_set1_epi8(set->bytes[2]), n3 = _mm256_set1_epi8(set->bytes[3]);
+        do {
+            __m256i block = _mm256_loadu_si256((const __m256i *)cursor);
+            __m256i match = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, n0), _mm256_cmpeq_epi8(block, n1)),
+                                            _mm256_or_si256(_mm256_cmpeq_epi8(block, n2), _mm256_cmpeq_epi8(block, n3)));
+            if (set->size > 4) {
+                match = _mm256_or_si256(match, _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(set->bytes[4])), _mm256_cmpeq_epi8(block, _mm256_set1_epi8(set->bytes[5]))),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(set->bytes[6])), _mm256_cmpeq_epi8(block, _mm256_set1_epi8(set->bytes[7])))));
+            }
+            unsigned int mask = (unsigned int)_mm256_movemask_epi8(match);
+            if (mask != 0) {
+                return cursor + __builtin_ctz(mask);
+            }
+            cursor += 32;
+        } while (end - cursor >= 32);
+    }
+    return xml_scan_find_any_scalar(cursor, end, set);
+}
+
+__attribute__((target("avx2")))
+static uint32_t xml_avx2_structural_mask(__m256i block) {
+    __m256i match = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('<')), _mm256_cmpeq_epi8(block, _mm256_set1_epi8('>'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('"')), _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\''))));
+    return (uint32_t)_mm256_movemask_epi8(match);
+}
+
+__attribute__((target("avx2")))
+static size_t xml_scan_structural_avx2(const char *start, const char *end, uint32_t *offsets) {
+    const char *cursor = start;
+    size_t count = 0;
+    while (end - cursor >= 64) {
+        uint64_t mask = (uint64_t)xml_avx2_structural_mask(_mm256_loadu_si256((const __m256i *)cursor))
+            | (uint64_t)xml_avx2_structural_mask(_mm256_loadu_si256((const __m256i *)(cursor + 32))) << 32;
+        count = xml_scan_flatten((uint32_t)(cursor - start), mask, offsets, count);
+        cursor += 64;
+    }
+    return xml_scan_structural_tail(start, cursor, end, offsets, count);
+}
+
+__attribute__((target("avx2")))
+static const char *xml_scan_find_non_ascii_avx2(const char *cursor, const char *end) {
+    while (end - cursor >= 32) {
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)cursor));
+        if (mask != 0) {
+            return cursor + __builtin_ctz(mask);
+        }
+        cursor += 32;
+    }
+    return xml_scan_find_non_ascii_sse2(cursor, end);
+}
+
+// UTF-8 validation by lookup tables (Keiser and Lemire, "Validating UTF-8 In
+// Less Than One Instruction Per Byte"). Each byte is classified by the high
+// and low nibble of the byte before it and the high nibble of its own; the
+// three tables give a bit per kind of error and a valid pair leaves none set
+// in all three. Third and fourth bytes of a sequence are checked separately
+// from the bytes two and three positions back.
+#define XML_UTF8_TOO_SHORT (1 << 0)
+#define XML_UTF8_TOO_LONG (1 << 1)
+#define XML_UTF8_OVERLONG_3 (1 << 2)
+#define XML_UTF8_TOO_LARGE (1 << 3)
+#define XML_UTF8_SURROGATE (1 << 4)
+#define XML_UTF8_OVERLONG_2 (1 << 5)
+#define XML_UTF8_TOO_LARGE_1000 (1 << 6)
+#define XML_UTF8_OVERLONG_4 (1 << 6)
+#define XML_UTF8_TWO_CONTS (1 << 7)
+#define XML_UTF8_CARRY (XML_UTF8_TOO_SHORT | XML_UTF8_TOO_LONG | XML_UTF8_TWO_CONTS)
+
+// A table entry from 0 to 0xFF as the char _mm256_setr_epi8 takes, with the
+// high bit turned into the sign by arithmetic instead of an out of range
+// conversion
+#define XML_AVX2_BYTE(x) ((char)((x) - (((x) & 0x80) << 1)))
+
+// the same 16 entries in both lanes, for _mm256_shuffle_epi8
+#define XML_AVX2_TABLE(a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p) \
+    _mm256_setr_epi8(XML_AVX2_BYTE(a), XML_AVX2_BYTE(b), XML_AVX2_BYTE(c), XML_AVX2_BYTE(d), \
+        XML_AVX2_BYTE(e), XML_AVX2_BYTE(f), XML_AVX2_BYTE(g), XML_AVX2_BYTE(h), \
+        XML_AVX2_BYTE(i), XML_AVX2_BYTE(j), XML_AVX2_BYTE(k), XML_AVX2_BYTE(l), \
+        XML_AVX2_BYTE(m), XML_AVX2_BYTE(n), XML_AVX2_BYTE(o), XML_AVX2_BYTE(p), \
+        XML_AVX2_BYTE(a), XML_AVX2_BYTE(b), XML_AVX2_BYTE(c), XML_AVX2_BYTE(d), \
+        XML_AVX2_BYTE(e), XML_AVX2_BYTE(f), XML_AVX2_BYTE(g), XML_AVX2_BYTE(h), \
+        XML_AVX2_BYTE(i), XML_AVX2_BYTE(j), XML_AVX2_BYTE(k), XML_AVX2_BYTE(l), \
+        XML_AVX2_BYTE(m), XML_AVX2_BYTE(n), XML_AVX2_BYTE(o), XML_AVX2_BYTE(p))
+
+__attribute__((target("avx2")))
+static __m256i xml_avx2_utf8_errors(__m256i input, __m256i previous) {
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i byte_1_high_table = XML_AVX2_TABLE(
+        // ASCII
+        XML_UTF8_TOO_LONG, XML_UTF8_TOO_LONG, XML_UTF8_TOO_LONG, XML_UTF8_TOO_LONG,
+        XML_UTF8_TOO_LONG, XML_UTF8_TOO_LONG, XML_UTF8_TOO_LONG, XML_UTF8_TOO_LONG,
+        // continuation
+        XML_UTF8_TWO_CONTS, XML_UTF8_TWO_CONTS, XML_UTF8_TWO_CONTS, XML_UTF8_TWO_CONTS,
+        // leads of 2, 2, 3 and 4 bytes
+        XML_UTF8_TOO_SHORT | XML_UTF8_OVERLONG_2,
+        XML_UTF8_TOO_SHORT,
+        XML_UTF8_TOO_SHORT | XML_UTF8_OVERLONG_3 | XML_UTF8_SURROGATE,
+        XML_UTF8_TOO_SHORT | XML_UTF8_TOO_LARGE | XML_UTF8_TOO_LARGE_1000 | XML_UTF8_OVERLONG_4);
+    const __m256i byte_1_low_table = XML_AVX2_TABLE(
+        XML_UTF8_CARRY | XML_UTF8_OVERLONG_3 | XML_UTF8_OVERLONG_2 | XML_UTF8_OVERLONG_4,
+        XML_UTF8_CARRY | XML_UTF8_OVERLONG_2,
+        XML_UTF8_CARRY,
+        XML_UTF8_CARRY,
+        XML_UTF8_CARRY | XML_UTF8_TOO_LARGE,
+        XML_UTF8_CARRY | XML_UTF8_TOO_LARGE | XML_UTF8_TOO_LARGE_1000,
+        XML_UTF8_CARRY | XML_UTF8_TOO_LARGE | XML_UTF8_TOO_LARGE_1000,
+        XML_UTF8_CARRY | XML_UTF8_TOO_LARGE | XML_UTF8_TOO_LARGE_1000,
+        XML_UTF8_CARRY | XML_UTF8_TOO_LARGE | XML_UTF8_TOO_LARGE_1000,
+        XML_UTF8_CARRY | XML_UTF8_TOO_LARGE | XML_UTF8_TOO_LARGE_1000,
+        XML_UTF8_CARRY | XML_UTF8_TOO_LARGE | XML_UTF8_TOO_LARGE_1000,
+        XML_UTF8_CARRY | XML_UTF8_TOO_LARGE | XML_UTF8_TOO_LARGE_1000,
+        XML_UTF8_CARRY | XML_UTF8_TOO_LARGE | XML_UTF8_TOO_LARGE_1000,
+        XML_UTF8_CARRY | XML_UTF8_TOO_LARGE | XML_UTF8_TOO_LARGE_1000 | XML_UTF8_SURROGATE,
+        XML_UTF8_CARRY | XML_UTF8_TOO_LARGE | XML_UTF8_TOO_LARGE_1000,
+        XML_UTF8_CARRY | XML_UTF8_TOO_LARGE | XML_UTF8_TOO_LARGE_1000);
+    const __m256i byte_2_high_table = XML_AVX2_TABLE(
+        // ASCII
+        XML_UTF8_TOO_SHORT, XML_UTF8_TOO_SHORT, XML_UTF8_TOO_SHORT, XML_UTF8_TOO_SHORT,
+        XML_UTF8_TOO_SHORT, XML_UTF8_TOO_SHORT, XML_UTF8_TOO_SHORT, XML_UTF8_TOO_SHORT,
+        // continuations 0x80, 0x90 and 0xA0 to 0xBF
+        XML_UTF8_TOO_LONG | XML_UTF8_OVERLONG_2 | XML_UTF8_TWO_CONTS | XML_UTF8_OVERLONG_3 | XML_UTF8_TOO_LARGE_1000 | XML_UTF8_OVERLONG_4,
+        XML_UTF8_TOO_LONG | XML_UTF8_OVERLONG_2 | XML_UTF8_TWO_CONTS | XML_UTF8_OVERLONG_3 | XML_UTF8_TOO_LARGE,
+        XML_UTF8_TOO_LONG | XML_UTF8_OVERLONG_2 | XML_UTF8_TWO_CONTS | XML_UTF8_SURROGATE | XML_UTF8_TOO_LARGE,
+        XML_UTF8_TOO_LONG | XML_UTF8_OVERLONG_2 | XML_UTF8_TWO_CONTS | XML_UTF8_SURROGATE | XML_UTF8_TOO_LARGE,
+        // leads
+        XML_UTF8_TOO_SHORT, XML_UTF8_TOO_SHORT, XML_UTF8_TOO_SHORT, XML_UTF8_TOO_SHORT);
+
+    // the last bytes of previous followed by the first ones of input
+    __m256i shifted = _mm256_permute2x128_si256(previous, input, 0x21);
+    __m256i previous_1 = _mm256_alignr_epi8(input, shifted, 15);
+    __m256i previous_2 = _mm256_alignr_epi8(input, shifted, 14);
+    __m256i previous_3 = _mm256_alignr_epi8(input, shifted, 13);
+
+    __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table, _mm256_and_si256(_mm256_srli_epi16(previous_1, 4), nibble));
+    __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table, _mm256_and_si256(previous_1, nibble));
+    __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    // 0x80 where the byte must be the third or fourth one of a sequence
+    __m256i third = _mm256_subs_epu8(previous_2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(previous_3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must_continue, special);
+}
+
+// Where to restart a precise check after a block reported an error: the
+// first sequence that starts in the 3 bytes before the block, it may cross
+// into the block. Everything before it was valid, so skipping continuation
+// bytes lands on the start of a sequence.
+static const char *xml_utf8_block_restart(const char *start, const char *block) {
+    const char *cursor = block - start > 3 ? block - 3 : start;
+    while (cursor < block && ((unsigned char)*cursor & 0xC0) == 0x80) {
+        cursor++;
+    }
+    return cursor;
+}
+
+// 32 bytes per step, ASCII blocks only check that no sequence was left
+// open. The vector check only tells whether a block has an error, the
+// scalar one then finds where.
+__attribute__((target("avx2")))
+static const char *xml_scan_validate_utf8_avx2(const char *cursor, const char *end) {
+    // a lead byte in the last 3 positions needs bytes from the next block
+    const __m256i incomplete_limit = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    const char *start = cursor;
+    __m256i previous = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    while (cursor < end) {
+        __m256i input;
+        if (end - cursor >= 32) {
+            input = _mm256_loadu_si256((const __m256i *)cursor);
+        } else {
+            // zero padding is ASCII, a sequence cut short by end shows up as
+            // too short
+            char tail[32] = {0};
+            memcpy(tail, cursor, (size_t)(end - cursor));
+            input = _mm256_loadu_si256((const __m256i *)tail);
+        }
+        __m256i error;
+        if (_mm256_movemask_epi8(input) == 0) {
+            error = incomplete;
+        } else {
+            error = xml_avx2_utf8_errors(input, previous);
+            incomplete = _mm256_subs_epu8(input, incomplete_limit);
+        }
+        if (!_mm256_testz_si256(error, error)) {
+            return xml_scan_validate_utf8_scalar(xml_utf8_block_restart(start, cursor), end);
+        }
+        previous = input;
+        cursor += 32;
+    }
+    if (!_mm256_testz_si256(incomplete, incomplete)) {
+        // only a block the loop went through sets incomplete, the last one
+        // started at cursor - 32
+        return xml_scan_validate_utf8_scalar(xml_utf8_block_restart(start, cursor - 32), end);
+    }
+    return end;
+}
+
+__attribute__((target("avx2")))
+static size_t xml_scan_utf16_ascii_avx2(const char *input, size_t units, char *output, int big_endian) {
+    __m256i mask = _mm256_set1_epi16(big_endian ? (short)0x80FF : (short)0xFF80);
+    size_t i = 0;
+    for (; units - i >= 16; i += 16) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(input + 2 * i));
+        if ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(block, mask), _mm256_setzero_si256())) != 0xFFFFFFFFu) {
+            break;
+        }
+        if (big_endian) {
+            block = _mm256_srli_epi16(block, 8);
+        }
+        // packs within each lane, the two low quarters hold the 16 bytes
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(block, block), 0xD8);
+        _mm_storeu_si128((__m128i *)(output + i), _mm256_castsi256_si128(packed));
+    }
+    return i + xml_scan_utf16_ascii_scalar(input + 2 * i, units - i, output + i, big_endian);
+}
+
+#endif // XML_SCAN_DISABLE_AVX2
+
+#endif // XML_SCAN_X86
+
+// Runtime dispatch. The kernels are picked from CPUID on the first call;
+// concurrent first calls all store the same pointer, so no locking is needed.
+// Build with XML_SCAN_DISABLE_AVX2 or XML_SCAN_DISABLE_SIMD to force a slower
+// path.
+
+typedef struct XMLScanKernels {
+    const char *(*skip_whitespace)(const char *, const char *);
+    const char *(*find_byte)(const char *, const char *, char);
+    const char *(*find_name_end)(const char *, const char *);
+    size_t (*structural)(const char *, const char *, uint32_t *);
+    const char *(*find_any)(const char *, const char *, const XMLScanSet *);
+    const char *(*find_non_ascii)(const char *, const char *);
+    const char *(*validate_utf8)(const char *, const char *);
+    size_t (*utf16_ascii)(const char *, size_t, char *, int);
+    const char *name;
+} XMLScanKernels;
+
+static const XMLScanKernels xml_scan_scalar_kernels = {
+    xml_scan_skip_whitespace_scalar, xml_scan_find_byte_scalar, xml_scan_find_name_end_scalar, xml_scan_structural_scalar,
+    xml_scan_find_any_scalar, xml_scan_find_non_ascii_scalar, xml_scan_validate_utf8_scalar, xml_scan_utf16_ascii_scalar, "scalar"
+};
+
+#ifdef XML_SCAN_X86
+static const XMLScanKernels xml_scan_sse2_kernels = {
+    xml_scan_skip_whitespace_sse2, xml_scan_find_byte_sse2, xml_scan_find_name_end_sse2, xml_scan_structural_sse2,
+    xml_scan_find_any_sse2, xml_scan_find_non_ascii_sse2, xml_scan_validate_utf8_sse2, xml_scan_utf16_ascii_sse2, "sse2"
+};
+
+#ifndef XML_SCAN_DISABLE_AVX2
+static const XMLScanKernels xml_scan_avx2_kernels = {
+    xml_scan_skip_whitespace_avx2, xml_scan_find_byte_avx2, xml_scan_find_name_end_avx2, xml_scan_structural_avx2,
+    xml_scan_find_any_avx2, xml_scan_find_non_ascii_avx2, xml_scan_validate_utf8_avx2, xml_scan_utf16_ascii_avx2, "avx2"
+};
+#endif
+#endif
+
+static const XMLScanKernels *xml_scan_select(void) {
+#ifdef XML_SCAN_X86
+    __builtin_cpu_init();
+#ifndef XML_SCAN_DISABLE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        return &xml_scan_avx2_kernels;
+    }
+#endif
+    if (__builtin_cpu_supports("sse2")) {
+        return &xml_scan_sse2_kernels;
+    }
+#endif
+    return &xml_scan_scalar_kernels;
+}
+
+static const XMLScanKernels *xml_scan_kernels = NULL;
+
+static const XMLScanKernels *xml_scan_get_kernels(void) {
+    const XMLScanKernels *kernels = __atomic_load_n(&xml_scan_kernels, __ATOMIC_RELAXED);
+    if (kernels == NULL) {
+        kernels = xml_scan_select();
+        __atomic_store_n(&xml_scan_kernels, kernels, __ATOMIC_RELAXED);
+    }
+    return kernels;
+}
+
+const char *xml_scan_skip_whitespace(const char *cursor, const char *end) {
+    return xml_scan_get_kernels()->skip_whitespace(cursor, end);
+}
+
+const char *xml_scan_find_byte(const char *cursor, const char *end, char value) {
+    return xml_scan_get_kernels()->find_byte(cursor, end, value);
+}
+
+const char *xml_scan_find_name_end(const char *cursor, const char *end) {
+    return xml_scan_get_kernels()->find_name_end(cursor, end);
+}
+
+size_t xml_scan_structural(const char *cursor, const char *end, uint32_t *offsets) {
+    return xml_scan_get_kernels()->structural(cursor, end, offsets);
+}
+
+void xml_scan_set_init(XMLScanSet *set, const char *bytes) {
+    size_t size = strlen(bytes);
+    memset(set->table, 0, sizeof(set->table));
+    for (size_t i = 0; i < XML_SCAN_SET_MAX; i++) {
+        set->bytes[i] = bytes[i < size ? i : 0];
+        if (i < size) {
+            set->table[(unsigned char)bytes[i]] = 1;
+        }
+    }
+    set->size = size;
+}
+
+const char *xml_scan_find_any(const char *cursor, const char *end, const XMLScanSet *set) {
+    return xml_scan_get_kernels()->find_any(cursor, end, set);
+}
+
+const char *xml_scan_find_sequence(const char *cursor, const char *end, const char *needle, size_t needle_size) {
+    const XMLScanKernels *kernels = xml_scan_get_kernels();
+    while ((size_t)(end - cursor) >= needle_size) {
+        cursor = kernels->find_byte(cursor, end - needle_size + 1, needle[0]);
+        if ((size_t)(end - cursor) < needle_size) {
+            break;
+        }
+        if (memcmp(cursor, needle, needle_size) == 0) {
+            return cursor;
+        }
+        cursor++;
+    }
+    return end;
+}
+
+const char *xml_scan_find_non_ascii(const char *cursor, const char *end) {
+    return xml_scan_get_kernels()->find_non_ascii(cursor, end);
+}
+
+const char *xml_scan_validate_utf8(const char *cursor, const char *end) {
+    return xml_scan_get_kernels()->validate_utf8(cursor, end);
+}
+
+size_t xml_scan_utf16_ascii(const char *input, size_t units, char *output, int big_endian) {
+    return xml_scan_get_kernels()->utf16_ascii(input, units, output, big_endian);
+}
+
+const char *xml_scan_implementation(void) {
+    return xml_scan_get_kernels()->name;
+}
@@ -0,0 +1,90 @@
+#ifndef __XML_SCAN__
+#define __XML_SCAN__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Character-class scanners used by the tokenizer hot loops. Every function
+// looks at the bytes in [cursor, end) only and returns end when nothing
+// matches. The implementation (AVX2, SSE2 or scalar) is picked on first use
+// from what the CPU supports.
+
+/**
+ * @brief find the first byte that is not XML whitespace (space, tab, CR, LF)
+ */
+const char *xml_scan_skip_whitespace(const char *cursor, const char *end);
+
+/**
+ * @brief find the first occurrence of value
+ */
+const char *xml_scan_find_byte(const char *cursor, const char *end, char value);
+
+/**
+ * @brief find the end of an element or attribute name: whitespace, '>', '/',
+ *        '=' or a NUL byte
+ */
+const char *xml_scan_find_name_end(const char *cursor, const char *end);
+
+/**
+ * @brief stage one of the structural index: the offsets from cursor of every
+ *        '<', '>', '"' and '\'' in [cursor, end), in order
+ *
+ * offsets needs room for one entry per byte in the worst case, and the range
+ * must be shorter than 4 GiB. Returns the number of offsets written.
+ */
+size_t xml_scan_structural(const char *cursor, const char *end, uint32_t *offsets);
+
+#define XML_SCAN_SET_MAX 8
+
+// A set of up to XML_SCAN_SET_MAX bytes for xml_scan_find_any, prepared once
+// by xml_scan_set_init and reused for every search
+typedef struct XMLScanSet {
+    unsigned char table[256]; // non-zero for the bytes of the set
+    char bytes[XML_SCAN_SET_MAX]; // padded with the first byte
+    size_t size;
+} XMLScanSet;
+
+/**
+ * @brief prepare the set of the bytes of the NUL-terminated string bytes,
+ *        which holds between 1 and XML_SCAN_SET_MAX of them
+ */
+void xml_scan_set_init(XMLScanSet *set, const char *bytes);
+
+/**
+ * @brief find the first byte that belongs to set
+ */
+const char *xml_scan_find_any(const char *cursor, const char *end, const XMLScanSet *set);
+
+/**
+ * @brief find the first occurrence of the byte sequence needle
+ */
+const char *xml_scan_find_sequence(const char *cursor, const char *end, const char *needle, size_t needle_size);
+
+/**
+ * @brief find the first byte that is not ASCII (0x80 and above)
+ */
+const char *xml_scan_find_non_ascii(const char *cursor, const char *end);
+
+/**
+ * @brief find the first byte that is not part of a valid UTF-8 sequence
+ *
+ * Overlong forms, surrogates, code points above U+10FFFF and sequences cut
+ * short by end are all invalid. Returns end when the whole range is valid.
+ */
+const char *xml_scan_validate_utf8(const char *cursor, const char *end);
+
+/**
+ * @brief copy the leading ASCII code units of UTF-16 input to output, one
+ *        byte each
+ *
+ * input holds units code units, little or big endian. Returns the number of
+ * units copied, output needs room for units bytes.
+ */
+size_t xml_scan_utf16_ascii(const char *input, size_t units, char *output, int big_endian);
+
+/**
+ * @brief name of the implementation in use ("avx2", "sse2" or "scalar")
+ */
+const char *xml_scan_implementation(void);
+
+#endif // __XML_SCAN__
@@ -0,0 +1,324 @@
+#define _DEFAULT_SOURCE
+
+#include "xml-parser.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Snapshot files: a header, then the nodes, attributes, texts, strings and
+// names of a flat document, each section 8-byte aligned. The arrays are
+// stored exactly as XMLFlatDocument holds them, so a mapped snapshot is used
+// as it is.
+#define XML_SNAPSHOT_MAGIC "XMLSNAP"
+#define XML_SNAPSHOT_FORMAT 1
+// written in native byte order, reads back differently on other machines
+#define XML_SNAPSHOT_BYTE_ORDER 0x01020304u
+#define XML_SNAPSHOT_ALIGN 8
+#define XML_SNAPSHOT_BLOCK_SIZE (1 << 20)
+
+typedef struct XMLSnapshotSection {
+    uint64_t offset; // from the start of the file
+    uint64_t count; // items, or bytes for strings and names
+} XMLSnapshotSection;
+
+typedef struct XMLSnapshotHeader {
+    char magic[8];
+    uint32_t format;
+    uint32_t byte_order;
+    // sizes of the records, they differ between ABIs
+    uint32_t node_size;
+    uint32_t attribute_size;
+    uint32_t text_size;
+    uint32_t names_count; // atoms, the first one is 1
+
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t source_hash;
+
+    XMLSnapshotSection nodes;
+    XMLSnapshotSection attributes;
+    XMLSnapshotSection texts;
+    XMLSnapshotSection strings;
+    XMLSnapshotSection names; // NUL-terminated, in atom order
+} XMLSnapshotHeader;
+
+// FNV-1a, 64-bit
+static uint64_t xml_snapshot_hash(uint64_t hash, const char *data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Size, modification time and hash of the source. The hash is only taken
+// when hash is not NULL.
+static int xml_snapshot_source(const char *source_path, struct stat *info, uint64_t *hash) {
+    int fd = open(source_path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, info) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (hash == NULL) {
+        close(fd);
+        return 0;
+    }
+    char *block = malloc(XML_SNAPSHOT_BLOCK_SIZE);
+    if (block == NULL) {
+        close(fd);
+        return -1;
+    }
+    *hash = 14695981039346656037ull;
+    ssize_t count;
+    while ((count = read(fd, block, XML_SNAPSHOT_BLOCK_SIZE)) != 0) {
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            break;
+        }
+        *hash = xml_snapshot_hash(*hash, block, (size_t)count);
+    }
+    free(block);
+    close(fd);
+    return count == 0 ? 0 : -1;
+}
+
+static uint64_t xml_snapshot_align(uint64_t offset) {
+    return (offset + XML_SNAPSHOT_ALIGN - 1) & ~(uint64_t)(XML_SNAPSHOT_ALIGN - 1);
+}
+
+// Places a section of count items of item_size bytes at *offset
+static void xml_snapshot_place(XMLSnapshotSection *section, uint64_t *offset, uint64_t count, size_t item_size) {
+    section->offset = xml_snapshot_align(*offset);
+    section->count = count;
+    *offset = section->offset + count * item_size;
+}
+
+static int xml_snapshot_write(int fd, const void *data, size_t size) {
+    const char *cursor = data;
+    while (size > 0) {
+        ssize_t written = write(fd, cursor, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            return -1;
+        }
+        cursor += written;
+        size -= (size_t)written;
+    }
+    return 0;
+}
+
+// Writes size bytes of data at offset, padding from *position up to it
+static int xml_snapshot_write_section(int fd, uint64_t *position, const XMLSnapshotSection *section, const void *data, size_t size) {
+    static const char padding[XML_SNAPSHOT_ALIGN];
+    if (xml_snapshot_write(fd, padding, (size_t)(section->offset - *position)) != 0
+        || xml_snapshot_write(fd, data, size) != 0) {
+        return -1;
+    }
+    *position = section->offset + size;
+    return 0;
+}
+
+// The names of the document's table, one after the other
+static char *xml_snapshot_names(const XMLFlatDocument *document, uint32_t *count, size_t *size) {
+    *count = 0;
+    *size = 0;
+    const char *name;
+    while ((name = xml_name_table_name(document->names, *count + 1)) != NULL) {
+        *size += strlen(name) + 1;
+        (*count)++;
+    }
+    char *names = malloc(*size > 0 ? *size : 1);
+    if (names == NULL) {
+        return NULL;
+    }
+    char *cursor = names;
+    for (uint32_t atom = 1; atom <= *count; atom++) {
+        name = xml_name_table_name(document->names, atom);
+        size_t name_size = strlen(name) + 1;
+        memcpy(cursor, name, name_size);
+        cursor += name_size;
+    }
+    return names;
+}
+
+int xml_save_snapshot(XMLFile *file, const char *source_path, const char *snapshot_path) {
+    struct stat source;
+    XMLSnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    if (xml_snapshot_source(source_path, &source, &header.source_hash) != 0) {
+        return -1;
+    }
+    XMLFlatDocument *document = xml_flat_from_file(file);
+    if (document == NULL) {
+        return -1;
+    }
+    size_t names_size;
+    char *names = xml_snapshot_names(document, &header.names_count, &names_size);
+    if (names == NULL) {
+        xml_flat_free(document);
+        return -1;
+    }
+
+    memcpy(header.magic, XML_SNAPSHOT_MAGIC, sizeof(XML_SNAPSHOT_MAGIC));
+    header.format = XML_SNAPSHOT_FORMAT;
+    header.byte_order = XML_SNAPSHOT_BYTE_ORDER;
+    header.node_size = sizeof(XMLFlatNode);
+    header.attribute_size = sizeof(XMLFlatAttribute);
+    header.text_size = sizeof(XMLFlatText);
+    header.source_size = (uint64_t)source.st_size;
+    header.source_mtime_sec = (int64_t)source.st_mtim.tv_sec;
+    header.source_mtime_nsec = (int64_t)source.st_mtim.tv_nsec;
+    uint64_t offset = sizeof(header);
+    xml_snapshot_place(&header.nodes, &offset, document->nodes_size, sizeof(XMLFlatNode));
+    xml_snapshot_place(&header.attributes, &offset, document->attributes_size, sizeof(XMLFlatAttribute));
+    xml_snapshot_place(&header.texts, &offset, document->texts_size, sizeof(XMLFlatText));
+    xml_snapshot_place(&header.strings, &offset, document->strings_size, 1);
+    xml_snapshot_place(&header.names, &offset, names_size, 1);
+
+    // written next to snapshot_path, then renamed over it
+    size_t path_size = strlen(snapshot_path);
+    char *temporary = malloc(path_size + sizeof(".XXXXXX"));
+    int fd = -1;
+    if (temporary != NULL) {
+        memcpy(temporary, snapshot_path, path_size);
+        memcpy(temporary + path_size, ".XXXXXX", sizeof(".XXXXXX"));
+        fd = mkstemp(temporary);
+    }
+    int result = -1;
+    if (fd >= 0) {
+        uint64_t position = sizeof(header);
+        if (xml_snapshot_write(fd, &header, sizeof(header)) == 0
+            && xml_snapshot_write_section(fd, &position, &header.nodes, document->nodes, document->nodes_size * sizeof(XMLFlatNode)) == 0
+            && xml_snapshot_write_section(fd, &position, &header.attributes, document->attributes, document->attributes_size * sizeof(XMLFlatAttribute)) == 0
+            && xml_snapshot_write_section(fd, &position, &header.texts, document->texts, document->texts_size * sizeof(XMLFlatText)) == 0
+            && xml_snapshot_write_section(fd, &position, &header.strings, document->strings, document->strings_size) == 0
+            && xml_snapshot_write_section(fd, &position, &header.names, names, names_size) == 0
+            && fchmod(fd, 0644) == 0) {
+            result = 0;
+        }
+        if (close(fd) != 0 || (result == 0 && rename(temporary, snapshot_path) != 0)) {
+            result = -1;
+        }
+        if (result != 0) {
+            // errno stays that of the failed write
+            int error = errno;
+            unlink(temporary);
+            errno = error;
+        }
+    }
+    free(temporary);
+    free(names);
+    xml_flat_free(document);
+    return result;
+}
+
+// Whether section lies inside a file of size bytes
+static int xml_snapshot_section_valid(const XMLSnapshotSection *section, size_t item_size, uint64_t size) {
+    return section->offset % XML_SNAPSHOT_ALIGN == 0 && section->offset <= size
+        && section->count <= (size - section->offset) / item_size;
+}
+
+static int xml_snapshot_header_valid(const XMLSnapshotHeader *header, uint64_t size) {
+    return memcmp(header->magic, XML_SNAPSHOT_MAGIC, sizeof(XML_SNAPSHOT_MAGIC)) == 0
+        && header->format == XML_SNAPSHOT_FORMAT
+        && header->byte_order == XML_SNAPSHOT_BYTE_ORDER
+        && header->node_size == sizeof(XMLFlatNode)
+        && header->attribute_size == sizeof(XMLFlatAttribute)
+        && header->text_size == sizeof(XMLFlatText)
+        && header->nodes.count > 0
+        && xml_snapshot_section_valid(&header->nodes, sizeof(XMLFlatNode), size)
+        && xml_snapshot_section_valid(&header->attributes, sizeof(XMLFlatAttribute), size)
+        && xml_snapshot_section_valid(&header->texts, sizeof(XMLFlatText), size)
+        && xml_snapshot_section_valid(&header->strings, 1, size)
+        && xml_snapshot_section_valid(&header->names, 1, size);
+}
+
+static int xml_snapshot_fresh(const XMLSnapshotHeader *header, const char *source_path, unsigned int flags) {
+    struct stat source;
+    uint64_t hash = 0;
+    if (xml_snapshot_source(source_path, &source, (flags & XML_SNAPSHOT_VERIFY_HASH) ? &hash : NULL) != 0) {
+        return 0;
+    }
+    return (uint64_t)source.st_size == header->source_size
+        && (int64_t)source.st_mtim.tv_sec == header->source_mtime_sec
+        && (int64_t)source.st_mtim.tv_nsec == header->source_mtime_nsec
+        && (!(flags & XML_SNAPSHOT_VERIFY_HASH) || hash == header->source_hash);
+}
+
+// Interns the names in atom order, so the atoms of the snapshot stay valid
+static XMLNameTable *xml_snapshot_name_table(const XMLSnapshotHeader *header, const char *names) {
+    XMLNameTable *table = xml_name_table_new();
+    const char *cursor = names;
+    const char *end = names + header->names.count;
+    for (uint32_t atom = 1; table != NULL && atom <= header->names_count; atom++) {
+        const char *name_end = cursor < end ? memchr(cursor, '\0', (size_t)(end - cursor)) : NULL;
+        if (name_end == NULL || xml_name_table_add(table, cursor) != atom) {
+            xml_name_table_free(table);
+            return NULL;
+        }
+        cursor = name_end + 1;
+    }
+    return table;
+}
+
+XMLFlatDocument *xml_load_snapshot(const char *snapshot_path, const char *source_path, unsigned int flags) {
+    int fd = open(snapshot_path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (uint64_t)info.st_size < sizeof(XMLSnapshotHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)info.st_size;
+    // private and writable, pages are only copied if the document is changed
+    char *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    const XMLSnapshotHeader *header = (const XMLSnapshotHeader *)mapping;
+    XMLFlatDocument *document = NULL;
+    // a file that is not a snapshot of this build is as good as a stale one
+    if (xml_snapshot_header_valid(header, size) && (source_path == NULL || xml_snapshot_fresh(header, source_path, flags))) {
+        document = calloc(1, sizeof(XMLFlatDocument));
+    }
+    if (document == NULL) {
+        munmap(mapping, size);
+        return NULL;
+    }
+    document->names = xml_snapshot_name_table(header, mapping + header->names.offset);
+    if (document->names == NULL) {
+        free(document);
+        munmap(mapping, size);
+        return NULL;
+    }
+    document->nodes = (XMLFlatNode *)(mapping + header->nodes.offset);
+    document->nodes_size = (size_t)header->nodes.count;
+    document->attributes = (XMLFlatAttribute *)(mapping + header->attributes.offset);
+    document->attributes_size = (size_t)header->attributes.count;
+    document->texts = (XMLFlatText *)(mapping + header->texts.offset);
+    document->texts_size = (size_t)header->texts.count;
+    document->strings = mapping + header->strings.offset;
+    document->strings_size = (size_t)header->strings.count;
+    document->mapping = mapping;
+    document->mapping_size = size;
+    return document;
+}
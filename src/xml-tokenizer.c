@@ -0,0 +1,372 @@
+#include "xml-tokenizer.h"
+#include "xml-scan.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define XML_TOKEN_ATTRIBUTES_MIN_CAPACITY 16
+
+static XMLTokenStatus xml_token_fail(XMLToken *token, XMLTokenStatus status, XMLTokenError error, const char *position) {
+    token->error = error;
+    token->error_position = position;
+    return status;
+}
+
+static int xml_token_add_attribute(XMLTokenAttributes *attributes, const char *name, size_t name_size, const char *value, size_t value_size) {
+    if (attributes->count == attributes->capacity) {
+        size_t capacity = attributes->capacity > 0 ? attributes->capacity * 2 : XML_TOKEN_ATTRIBUTES_MIN_CAPACITY;
+        XMLTokenAttribute *items = realloc(attributes->items, capacity * sizeof(XMLTokenAttribute));
+        if (items == NULL) {
+            return -1;
+        }
+        attributes->items = items;
+        attributes->capacity = capacity;
+    }
+
+    XMLTokenAttribute *attribute = &attributes->items[attributes->count++];
+    attribute->name = name;
+    attribute->name_size = name_size;
+    attribute->value = value;
+    attribute->value_size = value_size;
+    return 0;
+}
+
+// Bytes of input indexed at a time, small enough for the offsets to stay in cache
+#define XML_STRUCTURAL_BLOCK_SIZE (16 * 1024)
+
+int xml_structural_index_init(XMLStructuralIndex *index, const char *end) {
+    index->offsets = malloc(XML_STRUCTURAL_BLOCK_SIZE * sizeof(uint32_t));
+    if (index->offsets == NULL) {
+        return -1;
+    }
+    index->block = end;
+    index->block_end = end;
+    index->end = end;
+    index->count = 0;
+    index->next = 0;
+    return 0;
+}
+
+void xml_structural_index_free(XMLStructuralIndex *index) {
+    free(index->offsets);
+    index->offsets = NULL;
+}
+
+static void xml_structural_index_fill(XMLStructuralIndex *index, const char *cursor) {
+    size_t size = (size_t)(index->end - cursor);
+    index->block = cursor;
+    index->block_end = cursor + (size < XML_STRUCTURAL_BLOCK_SIZE ? size : XML_STRUCTURAL_BLOCK_SIZE);
+    index->count = xml_scan_structural(cursor, index->block_end, index->offsets);
+    index->next = 0;
+}
+
+const char *xml_structural_index_find(XMLStructuralIndex *index, const char *cursor, char value) {
+    while (cursor < index->end) {
+        if (cursor < index->block || cursor >= index->block_end) {
+            xml_structural_index_fill(index, cursor);
+        }
+
+        const char *block = index->block;
+        const uint32_t *offsets = index->offsets;
+        uint32_t offset = (uint32_t)(cursor - block);
+        size_t next = index->next;
+        if (next > 0 && offsets[next - 1] >= offset) {
+            next = 0;
+        }
+        for (; next < index->count; next++) {
+            uint32_t found = offsets[next];
+            if (found >= offset && (value == 0 || block[found] == value)) {
+                index->next = next;
+                return block + found;
+            }
+        }
+        index->next = next;
+        cursor = index->block_end;
+    }
+    return index->end;
+}
+
+// The attribute values end at the next matching quote, found in the index
+// when there is one
+static XMLTokenStatus xml_tokenize_start_tag_indexed(XMLStructuralIndex *index, const char *cursor, const char *end, XMLToken *token, XMLTokenAttributes *attributes) {
+    const char *current_pos = xml_scan_skip_whitespace(cursor, end);
+    attributes->count = 0;
+
+    token->type = XML_TOKEN_START_TAG;
+    token->start = current_pos;
+    token->self_closing = 0;
+    token->value = NULL;
+    token->value_size = 0;
+    token->error = XML_TOKEN_ERROR_NONE;
+
+    if (current_pos == end) {
+        return xml_token_fail(token, XML_TOKEN_INCOMPLETE, XML_TOKEN_ERROR_EXPECTED_ELEMENT, current_pos);
+    }
+    if (*current_pos != '<') {
+        return xml_token_fail(token, XML_TOKEN_ERROR, XML_TOKEN_ERROR_EXPECTED_ELEMENT, current_pos);
+    }
+
+    current_pos = xml_scan_skip_whitespace(current_pos + 1, end);
+
+    const char *name_start = current_pos;
+    current_pos = xml_scan_find_name_end(current_pos, end);
+    if (current_pos == end) {
+        return xml_token_fail(token, XML_TOKEN_INCOMPLETE, XML_TOKEN_ERROR_UNTERMINATED_TAG, current_pos);
+    }
+    if (current_pos == name_start) {
+        return xml_token_fail(token, XML_TOKEN_ERROR, XML_TOKEN_ERROR_EMPTY_NAME, current_pos);
+    }
+    token->name = name_start;
+    token->name_size = (size_t)(current_pos - name_start);
+
+    current_pos = xml_scan_skip_whitespace(current_pos, end);
+
+    while (current_pos < end && *current_pos != '/' && *current_pos != '>' && *current_pos != '\0') {
+        const char *attr_name_start = current_pos;
+        current_pos = xml_scan_find_name_end(current_pos, end);
+        if (current_pos == end) {
+            return xml_token_fail(token, XML_TOKEN_INCOMPLETE, XML_TOKEN_ERROR_UNTERMINATED_TAG, current_pos);
+        }
+        size_t size_attr_name = (size_t)(current_pos - attr_name_start);
+        if (size_attr_name == 0) {
+            return xml_token_fail(token, XML_TOKEN_ERROR, XML_TOKEN_ERROR_EMPTY_ATTRIBUTE_NAME, current_pos);
+        }
+
+        current_pos = xml_scan_skip_whitespace(current_pos, end);
+        if (current_pos == end) {
+            return xml_token_fail(token, XML_TOKEN_INCOMPLETE, XML_TOKEN_ERROR_EXPECTED_EQUALS, current_pos);
+        }
+        if (*current_pos != '=') {
+            return xml_token_fail(token, XML_TOKEN_ERROR, XML_TOKEN_ERROR_EXPECTED_EQUALS, current_pos);
+        }
+
+        current_pos = xml_scan_skip_whitespace(current_pos + 1, end);
+        if (current_pos == end) {
+            return xml_token_fail(token, XML_TOKEN_INCOMPLETE, XML_TOKEN_ERROR_EXPECTED_QUOTE, current_pos);
+        }
+        if (*current_pos != '\"' && *current_pos != '\'') {
+            return xml_token_fail(token, XML_TOKEN_ERROR, XML_TOKEN_ERROR_EXPECTED_QUOTE, current_pos);
+        }
+        char quote_char = *current_pos;
+        current_pos++;
+
+        const char *attr_value_start = current_pos;
+        // TODO: handle escaped quotes within the value
+        if (index != NULL) {
+            current_pos = xml_structural_index_find(index, current_pos, quote_char);
+        } else {
+            current_pos = xml_scan_find_byte(current_pos, end, quote_char);
+        }
+        if (current_pos == end) {
+            return xml_token_fail(token, XML_TOKEN_INCOMPLETE, XML_TOKEN_ERROR_UNTERMINATED_VALUE, current_pos);
+        }
+
+        if (xml_token_add_attribute(attributes, attr_name_start, size_attr_name, attr_value_start, (size_t)(current_pos - attr_value_start)) != 0) {
+            return xml_token_fail(token, XML_TOKEN_ERROR, XML_TOKEN_ERROR_MEMORY, current_pos);
+        }
+
+        current_pos = xml_scan_skip_whitespace(current_pos + 1, end);
+    }
+
+    if (current_pos == end) {
+        return xml_token_fail(token, XML_TOKEN_INCOMPLETE, XML_TOKEN_ERROR_UNTERMINATED_TAG, current_pos);
+    }
+
+    if (*current_pos == '/') {
+        current_pos++;
+        if (current_pos == end) {
+            return xml_token_fail(token, XML_TOKEN_INCOMPLETE, XML_TOKEN_ERROR_EXPECTED_SELF_CLOSE, current_pos);
+        }
+        if (*current_pos != '>') {
+            return xml_token_fail(token, XML_TOKEN_ERROR, XML_TOKEN_ERROR_EXPECTED_SELF_CLOSE, current_pos);
+        }
+        token->self_closing = 1;
+    } else if (*current_pos != '>') {
+        return xml_token_fail(token, XML_TOKEN_ERROR, XML_TOKEN_ERROR_UNTERMINATED_TAG, current_pos);
+    }
+
+    token->end = current_pos + 1;
+    return XML_TOKEN_OK;
+}
+
+XMLTokenStatus xml_tokenize_start_tag(const char *cursor, const char *end, XMLToken *token, XMLTokenAttributes *attributes) {
+    return xml_tokenize_start_tag_indexed(NULL, cursor, end, token, attributes);
+}
+
+// Comments, CDATA sections and processing instructions: content up to a
+// terminator sequence
+static XMLTokenStatus xml_tokenize_section(const char *markup, size_t open_size, const char *close, const char *end, XMLTokenType type, XMLTokenError error, XMLToken *token) {
+    const char *content = markup + open_size;
+    const char *close_pos = xml_scan_find_sequence(content, end, close, strlen(close));
+    if (close_pos == end) {
+        return xml_token_fail(token, XML_TOKEN_INCOMPLETE, error, markup);
+    }
+
+    token->type = type;
+    token->value = content;
+    token->value_size = (size_t)(close_pos - content);
+    token->end = close_pos + strlen(close);
+    return XML_TOKEN_OK;
+}
+
+XMLTokenStatus xml_tokenize_content(const char *cursor, const char *end, XMLToken *token, XMLTokenAttributes *attributes) {
+    const char *current_pos = xml_scan_skip_whitespace(cursor, end);
+
+    token->start = current_pos;
+    token->name = NULL;
+    token->name_size = 0;
+    token->value = NULL;
+    token->value_size = 0;
+    token->self_closing = 0;
+    token->error = XML_TOKEN_ERROR_NONE;
+
+    if (current_pos == end || *current_pos == '\0') {
+        return xml_token_fail(token, XML_TOKEN_INCOMPLETE, XML_TOKEN_ERROR_UNEXPECTED_END, current_pos);
+    }
+
+    if (*current_pos != '<') {
+        // text keeps the whitespace that was skipped above
+        const char *text_end = xml_scan_find_byte(current_pos, end, '<');
+        if (text_end == end) {
+            return xml_token_fail(token, XML_TOKEN_INCOMPLETE, XML_TOKEN_ERROR_UNEXPECTED_END, text_end);
+        }
+        token->type = XML_TOKEN_TEXT;
+        token->start = cursor;
+        token->value = cursor;
+        token->value_size = (size_t)(text_end - cursor);
+        token->end = text_end;
+        return XML_TOKEN_OK;
+    }
+
+    size_t available = (size_t)(end - current_pos);
+    if (available < 2) {
+        return xml_token_fail(token, XML_TOKEN_INCOMPLETE, XML_TOKEN_ERROR_UNEXPECTED_END, current_pos);
+    }
+
+    if (current_pos[1] == '/') {
+        const char *name_start = xml_scan_skip_whitespace(current_pos + 2, end);
+        const char *name_end = xml_scan_find_byte(name_start, end, '>');
+        if (name_end == end) {
+            return xml_token_fail(token, XML_TOKEN_INCOMPLETE, XML_TOKEN_ERROR_UNTERMINATED_END_TAG, name_end);
+        }
+        // Optional: trim trailing whitespace from the name to be more lenient
+        token->type = XML_TOKEN_END_TAG;
+        token->name = name_start;
+        token->name_size = (size_t)(name_end - name_start);
+        token->end = name_end + 1;
+        return XML_TOKEN_OK;
+    }
+
+    if (current_pos[1] == '!') {
+        // wait until there are enough bytes to tell "<!--" and "<![CDATA[" apart
+        if (available >= 4 && strncmp(current_pos, "<!--", 4) == 0) {
+            return xml_tokenize_section(current_pos, 4, "-->", end, XML_TOKEN_COMMENT, XML_TOKEN_ERROR_UNTERMINATED_COMMENT, token);
+        }
+        if (available >= 9 && strncmp(current_pos, "<![CDATA[", 9) == 0) {
+            return xml_tokenize_section(current_pos, 9, "]]>", end, XML_TOKEN_CDATA, XML_TOKEN_ERROR_UNTERMINATED_CDATA, token);
+        }
+        size_t prefix = available < 9 ? available : 9;
+        if (strncmp(current_pos, "<!--", prefix < 4 ? prefix : 4) == 0 || strncmp(current_pos, "<![CDATA[", prefix) == 0) {
+            return xml_token_fail(token, XML_TOKEN_INCOMPLETE, XML_TOKEN_ERROR_UNEXPECTED_END, current_pos);
+        }
+        return xml_token_fail(token, XML_TOKEN_ERROR, XML_TOKEN_ERROR_UNSUPPORTED_MARKUP, current_pos);
+    }
+
+    if (current_pos[1] == '?') {
+        XMLTokenStatus status = xml_tokenize_section(current_pos, 2, "?>", end, XML_TOKEN_PROCESSING_INSTRUCTION, XML_TOKEN_ERROR_UNTERMINATED_PROCESSING_INSTRUCTION, token);
+        if (status == XML_TOKEN_OK) {
+            token->name = token->value;
+            token->name_size = (size_t)(xml_scan_find_name_end(token->value, token->value + token->value_size) - token->value);
+        }
+        return status;
+    }
+
+    return xml_tokenize_start_tag(current_pos, end, token, attributes);
+}
+
+XMLTokenStatus xml_tokenize_content_indexed(XMLStructuralIndex *index, const char *cursor, XMLToken *token, XMLTokenAttributes *attributes) {
+    const char *end = index->end;
+    const char *current_pos = xml_scan_skip_whitespace(cursor, end);
+    if (current_pos == end || *current_pos == '\0') {
+        return xml_tokenize_content(cursor, end, token, attributes);
+    }
+
+    if (*current_pos != '<') {
+        const char *text_end = xml_structural_index_find(index, current_pos, '<');
+        if (text_end == end) {
+            return xml_tokenize_content(cursor, end, token, attributes);
+        }
+        token->type = XML_TOKEN_TEXT;
+        token->start = cursor;
+        token->end = text_end;
+        token->name = NULL;
+        token->name_size = 0;
+        token->value = cursor;
+        token->value_size = (size_t)(text_end - cursor);
+        token->self_closing = 0;
+        token->error = XML_TOKEN_ERROR_NONE;
+        return XML_TOKEN_OK;
+    }
+
+    if (end - current_pos < 2 || current_pos[1] == '!' || current_pos[1] == '?') {
+        return xml_tokenize_content(cursor, end, token, attributes);
+    }
+
+    if (current_pos[1] == '/') {
+        const char *name_end = xml_structural_index_find(index, current_pos + 2, 0);
+        if (name_end == end || *name_end != '>') {
+            return xml_tokenize_content(cursor, end, token, attributes);
+        }
+        const char *name_start = xml_scan_skip_whitespace(current_pos + 2, name_end);
+        token->type = XML_TOKEN_END_TAG;
+        token->start = current_pos;
+        token->end = name_end + 1;
+        token->name = name_start;
+        token->name_size = (size_t)(name_end - name_start);
+        token->value = NULL;
+        token->value_size = 0;
+        token->self_closing = 0;
+        token->error = XML_TOKEN_ERROR_NONE;
+        return XML_TOKEN_OK;
+    }
+
+    return xml_tokenize_start_tag_indexed(index, current_pos, end, token, attributes);
+}
+
+const char *xml_token_error_string(XMLTokenError error) {
+    switch (error) {
+        case XML_TOKEN_ERROR_NONE: return "No error";
+        case XML_TOKEN_ERROR_MEMORY: return "Out of memory";
+        case XML_TOKEN_ERROR_EXPECTED_ELEMENT: return "Expected '<' to start an element";
+        case XML_TOKEN_ERROR_EMPTY_NAME: return "Element name is empty";
+        case XML_TOKEN_ERROR_EMPTY_ATTRIBUTE_NAME: return "Attribute name is empty";
+        case XML_TOKEN_ERROR_EXPECTED_EQUALS: return "Expected '=' after attribute name";
+        case XML_TOKEN_ERROR_EXPECTED_QUOTE: return "Attribute value must start with '\"' or \"'\"";
+        case XML_TOKEN_ERROR_UNTERMINATED_VALUE: return "Attribute value not terminated";
+        case XML_TOKEN_ERROR_EXPECTED_SELF_CLOSE: return "Expected '>' after '/' in self-closing tag";
+        case XML_TOKEN_ERROR_UNTERMINATED_TAG: return "Expected '>' or '/>' to end tag";
+        case XML_TOKEN_ERROR_UNTERMINATED_END_TAG: return "Closing tag not terminated with '>'";
+        case XML_TOKEN_ERROR_UNTERMINATED_COMMENT: return "Unterminated comment";
+        case XML_TOKEN_ERROR_UNTERMINATED_CDATA: return "Unterminated CDATA section";
+        case XML_TOKEN_ERROR_UNTERMINATED_PROCESSING_INSTRUCTION: return "Unterminated processing instruction";
+        case XML_TOKEN_ERROR_UNSUPPORTED_MARKUP: return "Unsupported XML construct starting with '<!'";
+        case XML_TOKEN_ERROR_UNEXPECTED_END: return "Unexpected end of input";
+    }
+    return "Unknown error";
+}
+
+XMLErrorCode xml_token_error_code(XMLTokenError error) {
+    switch (error) {
+        case XML_TOKEN_ERROR_NONE: return XML_ERROR_NONE;
+        case XML_TOKEN_ERROR_MEMORY: return XML_ERROR_MEMORY;
+        case XML_TOKEN_ERROR_UNEXPECTED_END: return XML_ERROR_UNEXPECTED_END;
+        default: return XML_ERROR_SYNTAX;
+    }
+}
+
+void xml_token_attributes_free(XMLTokenAttributes *attributes) {
+    free(attributes->items);
+    attributes->items = NULL;
+    attributes->count = 0;
+    attributes->capacity = 0;
+}
@@ -0,0 +1,144 @@
+#ifndef __XML_TOKENIZER__
+#define __XML_TOKENIZER__
+
+#include "xml-parser.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Tokenizer shared by the tree parser (xml-parser.c) and the streaming reader
+// (xml-reader.c). It only looks at [cursor, end) and never needs a terminator,
+// so it works on a mapped file as well as on a partial chunk of input.
+
+typedef enum XMLTokenType {
+    XML_TOKEN_START_TAG, // <name attr="value"> or <name/>
+    XML_TOKEN_END_TAG, // </name>
+    XML_TOKEN_TEXT,
+    XML_TOKEN_COMMENT,
+    XML_TOKEN_CDATA,
+    XML_TOKEN_PROCESSING_INSTRUCTION // <?target ... ?>
+} XMLTokenType;
+
+typedef enum XMLTokenStatus {
+    XML_TOKEN_OK,
+    // the token runs past end, more input is needed to finish it. The error
+    // field says what was missing in case no more input will come.
+    XML_TOKEN_INCOMPLETE,
+    XML_TOKEN_ERROR
+} XMLTokenStatus;
+
+typedef enum XMLTokenError {
+    XML_TOKEN_ERROR_NONE,
+    XML_TOKEN_ERROR_MEMORY,
+    XML_TOKEN_ERROR_EXPECTED_ELEMENT,
+    XML_TOKEN_ERROR_EMPTY_NAME,
+    XML_TOKEN_ERROR_EMPTY_ATTRIBUTE_NAME,
+    XML_TOKEN_ERROR_EXPECTED_EQUALS,
+    XML_TOKEN_ERROR_EXPECTED_QUOTE,
+    XML_TOKEN_ERROR_UNTERMINATED_VALUE,
+    XML_TOKEN_ERROR_EXPECTED_SELF_CLOSE,
+    XML_TOKEN_ERROR_UNTERMINATED_TAG,
+    XML_TOKEN_ERROR_UNTERMINATED_END_TAG,
+    XML_TOKEN_ERROR_UNTERMINATED_COMMENT,
+    XML_TOKEN_ERROR_UNTERMINATED_CDATA,
+    XML_TOKEN_ERROR_UNTERMINATED_PROCESSING_INSTRUCTION,
+    XML_TOKEN_ERROR_UNSUPPORTED_MARKUP,
+    XML_TOKEN_ERROR_UNEXPECTED_END
+} XMLTokenError;
+
+typedef struct XMLTokenAttribute {
+    const char *name;
+    size_t name_size;
+    const char *value;
+    size_t value_size;
+} XMLTokenAttribute;
+
+// Attributes of the last start tag, reused from one tag to the next
+typedef struct XMLTokenAttributes {
+    XMLTokenAttribute *items;
+    size_t count;
+    size_t capacity;
+} XMLTokenAttributes;
+
+typedef struct XMLToken {
+    XMLTokenType type;
+    const char *start; // first byte of the token (after skipped whitespace for markup)
+    const char *end; // first byte after the token
+
+    const char *name; // tag name or processing instruction target
+    size_t name_size;
+    const char *value; // text, comment or CDATA content
+    size_t value_size;
+    int self_closing;
+
+    XMLTokenError error;
+    const char *error_position;
+} XMLToken;
+
+/**
+ * @brief tokenize the start tag at cursor, after any leading whitespace
+ */
+XMLTokenStatus xml_tokenize_start_tag(const char *cursor, const char *end, XMLToken *token, XMLTokenAttributes *attributes);
+
+/**
+ * @brief tokenize the next piece of element content at cursor
+ *
+ * Whitespace before markup is skipped. Anything else up to the next '<' is a
+ * text token that keeps its leading whitespace, and it is only complete once
+ * that '<' has been seen.
+ */
+XMLTokenStatus xml_tokenize_content(const char *cursor, const char *end, XMLToken *token, XMLTokenAttributes *attributes);
+
+// Structural index of the input: the offsets of every '<', '>' and quote,
+// found by xml_scan_structural one block at a time. Content tokenized through
+// it jumps from one structural byte to the next instead of scanning the text
+// and the tags for their delimiters. The walk must move forward.
+typedef struct XMLStructuralIndex {
+    const char *block; // start of the indexed block
+    const char *block_end;
+    const char *end; // end of the input
+    uint32_t *offsets; // from block, of the structural bytes in [block, block_end)
+    size_t count;
+    size_t next; // first offset that may still be at or after the cursor
+} XMLStructuralIndex;
+
+/**
+ * @brief prepare an index of the input ending at end. Blocks are scanned on
+ *        demand, starting at the first lookup.
+ *
+ * @return 0 on success, -1 when the block buffer cannot be allocated
+ */
+int xml_structural_index_init(XMLStructuralIndex *index, const char *end);
+
+void xml_structural_index_free(XMLStructuralIndex *index);
+
+/**
+ * @brief the first indexed byte at or after cursor that is value, or any
+ *        '<', '>' or quote when value is 0. Returns the end of the input when
+ *        there is none.
+ */
+const char *xml_structural_index_find(XMLStructuralIndex *index, const char *cursor, char value);
+
+/**
+ * @brief xml_tokenize_content driven by the structural index
+ *
+ * Text ends at the next indexed '<', an end tag at the next indexed '>' and an
+ * attribute value at the next indexed quote of its kind. Comments, CDATA
+ * sections, processing instructions and anything the index cannot decide go
+ * through xml_tokenize_content, so the tokens are the same.
+ */
+XMLTokenStatus xml_tokenize_content_indexed(XMLStructuralIndex *index, const char *cursor, XMLToken *token, XMLTokenAttributes *attributes);
+
+/**
+ * @brief human readable description of a tokenizer error
+ */
+const char *xml_token_error_string(XMLTokenError error);
+
+/**
+ * @brief the XMLError code of a tokenizer error
+ */
+XMLErrorCode xml_token_error_code(XMLTokenError error);
+
+void xml_token_attributes_free(XMLTokenAttributes *attributes);
+
+#endif // __XML_TOKENIZER__
@@ -0,0 +1,533 @@
+#include "xml-parser.h"
+#include "xml-scan.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define XML_WRITER_BUFFER_SIZE (256 * 1024)
+#define XML_WRITER_INDENT 2
+
+// Bytes escaped in plain strings passed to the writer calls
+#define XML_WRITER_TEXT_ESCAPES "&<>"
+#define XML_WRITER_ATTRIBUTE_ESCAPES "&<>\"\t\n\r"
+// Bytes escaped in tree values, which already hold their entity references
+#define XML_WRITER_RAW_TEXT_ESCAPES "<"
+#define XML_WRITER_RAW_ATTRIBUTE_ESCAPES "<\""
+
+typedef struct XMLWriterFrame {
+    size_t name_offset; // into names
+    size_t name_size;
+    int has_children;
+    int has_text;
+    // tree elements only: the next of their text runs to write, and the
+    // number of children written so far
+    const XMLText *text;
+    size_t children;
+} XMLWriterFrame;
+
+struct XMLWriter {
+    char *buffer;
+    size_t size;
+    size_t capacity;
+    // NULL for xml_write_buffer, the buffer then grows instead of being flushed
+    XMLWriteCallback callback;
+    void *user_data;
+    unsigned int flags;
+    int failed;
+
+    int open_tag; // the start tag of the innermost element still needs its '>'
+    int started; // something has been written, pretty lines break from here on
+
+    // names of the open elements, back to back, for their end tags
+    char *names;
+    size_t names_size;
+    size_t names_capacity;
+    XMLWriterFrame *frames;
+    size_t depth;
+    size_t frames_capacity;
+
+    XMLScanSet text_escapes;
+    XMLScanSet attribute_escapes;
+    XMLScanSet raw_text_escapes;
+    XMLScanSet raw_attribute_escapes;
+};
+
+static XMLWriter *xml_writer_create(XMLWriteCallback callback, void *user_data, unsigned int flags) {
+    XMLWriter *writer = calloc(1, sizeof(XMLWriter));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->buffer = malloc(XML_WRITER_BUFFER_SIZE);
+    if (writer->buffer == NULL) {
+        free(writer);
+        return NULL;
+    }
+    writer->capacity = XML_WRITER_BUFFER_SIZE;
+    xml_scan_set_init(&writer->text_escapes, XML_WRITER_TEXT_ESCAPES);
+    xml_scan_set_init(&writer->attribute_escapes, XML_WRITER_ATTRIBUTE_ESCAPES);
+    xml_scan_set_init(&writer->raw_text_escapes, XML_WRITER_RAW_TEXT_ESCAPES);
+    xml_scan_set_init(&writer->raw_attribute_escapes, XML_WRITER_RAW_ATTRIBUTE_ESCAPES);
+    writer->callback = callback;
+    writer->user_data = user_data;
+    writer->flags = flags;
+    return writer;
+}
+
+XMLWriter *xml_writer_new(XMLWriteCallback callback, void *user_data, unsigned int flags) {
+    if (callback == NULL) {
+        return NULL;
+    }
+    return xml_writer_create(callback, user_data, flags);
+}
+
+void xml_writer_free(XMLWriter *writer) {
+    if (writer == NULL) {
+        return;
+    }
+    free(writer->buffer);
+    free(writer->names);
+    free(writer->frames);
+    free(writer);
+}
+
+static int xml_writer_fail(XMLWriter *writer) {
+    writer->failed = 1;
+    return -1;
+}
+
+static int xml_writer_pass(XMLWriter *writer, const char *data, size_t size) {
+    if (size > 0 && writer->callback(data, size, writer->user_data) != 0) {
+        return xml_writer_fail(writer);
+    }
+    return 0;
+}
+
+int xml_writer_flush(XMLWriter *writer) {
+    if (writer->failed) {
+        return -1;
+    }
+    if (writer->callback != NULL) {
+        if (xml_writer_pass(writer, writer->buffer, writer->size) != 0) {
+            return -1;
+        }
+        writer->size = 0;
+    }
+    return 0;
+}
+
+// Slow path of xml_writer_append: flushes the buffer, or grows it for
+// xml_write_buffer. Blocks larger than the whole buffer go straight to the
+// callback.
+static int xml_writer_append_slow(XMLWriter *writer, const char *data, size_t size) {
+    if (writer->callback != NULL) {
+        if (xml_writer_flush(writer) != 0) {
+            return -1;
+        }
+        if (size > writer->capacity) {
+            return xml_writer_pass(writer, data, size);
+        }
+    } else {
+        size_t capacity = writer->capacity * 2;
+        while (capacity - writer->size < size) {
+            capacity *= 2;
+        }
+        char *buffer = realloc(writer->buffer, capacity);
+        if (buffer == NULL) {
+            return xml_writer_fail(writer);
+        }
+        writer->buffer = buffer;
+        writer->capacity = capacity;
+    }
+    memcpy(writer->buffer + writer->size, data, size);
+    writer->size += size;
+    return 0;
+}
+
+static int xml_writer_append(XMLWriter *writer, const char *data, size_t size) {
+    if (writer->capacity - writer->size < size) {
+        return xml_writer_append_slow(writer, data, size);
+    }
+    memcpy(writer->buffer + writer->size, data, size);
+    writer->size += size;
+    return 0;
+}
+
+static const char *xml_writer_reference(char c) {
+    switch (c) {
+        case '&': return "&amp;";
+        case '<': return "&lt;";
+        case '>': return "&gt;";
+        case '"': return "&quot;";
+        case '\t': return "&#9;";
+        case '\n': return "&#10;";
+        default: return "&#13;"; // '\r'
+    }
+}
+
+// Copies data, replacing the bytes of set with their references. The runs in
+// between are found with the vector scanner and copied in one piece.
+static int xml_writer_escaped(XMLWriter *writer, const char *data, size_t size, const XMLScanSet *set) {
+    const char *end = data + size;
+    while (data < end) {
+        const char *found = xml_scan_find_any(data, end, set);
+        if (xml_writer_append(writer, data, (size_t)(found - data)) != 0) {
+            return -1;
+        }
+        if (found == end) {
+            break;
+        }
+        const char *reference = xml_writer_reference(*found);
+        if (xml_writer_append(writer, reference, strlen(reference)) != 0) {
+            return -1;
+        }
+        data = found + 1;
+    }
+    return 0;
+}
+
+// Line break and indentation for markup at depth, pretty mode only
+static int xml_writer_indent(XMLWriter *writer, size_t depth) {
+    static const char spaces[] = "                                ";
+    if (xml_writer_append(writer, "\n", 1) != 0) {
+        return -1;
+    }
+    size_t size = depth * XML_WRITER_INDENT;
+    while (size > 0) {
+        size_t chunk = size < sizeof(spaces) - 1 ? size : sizeof(spaces) - 1;
+        if (xml_writer_append(writer, spaces, chunk) != 0) {
+            return -1;
+        }
+        size -= chunk;
+    }
+    return 0;
+}
+
+static int xml_writer_close_tag(XMLWriter *writer) {
+    if (writer->open_tag) {
+        writer->open_tag = 0;
+        return xml_writer_append(writer, ">", 1);
+    }
+    return 0;
+}
+
+static int xml_writer_push(XMLWriter *writer, const char *name, size_t name_size) {
+    if (writer->depth == writer->frames_capacity) {
+        size_t capacity = writer->frames_capacity > 0 ? writer->frames_capacity * 2 : 64;
+        XMLWriterFrame *frames = realloc(writer->frames, capacity * sizeof(XMLWriterFrame));
+        if (frames == NULL) {
+            return xml_writer_fail(writer);
+        }
+        writer->frames = frames;
+        writer->frames_capacity = capacity;
+    }
+    if (writer->names_capacity - writer->names_size < name_size) {
+        size_t capacity = writer->names_capacity > 0 ? writer->names_capacity : 1024;
+        while (capacity - writer->names_size < name_size) {
+            capacity *= 2;
+        }
+        char *names = realloc(writer->names, capacity);
+        if (names == NULL) {
+            return xml_writer_fail(writer);
+        }
+        writer->names = names;
+        writer->names_capacity = capacity;
+    }
+
+    XMLWriterFrame *frame = &writer->frames[writer->depth++];
+    frame->name_offset = writer->names_size;
+    frame->name_size = name_size;
+    frame->has_children = 0;
+    frame->has_text = 0;
+    frame->text = NULL;
+    frame->children = 0;
+    memcpy(writer->names + writer->names_size, name, name_size);
+    writer->names_size += name_size;
+    return 0;
+}
+
+static int xml_writer_start(XMLWriter *writer, const char *name, size_t name_size) {
+    if (writer->failed || xml_writer_close_tag(writer) != 0) {
+        return -1;
+    }
+
+    XMLWriterFrame *parent = writer->depth > 0 ? &writer->frames[writer->depth - 1] : NULL;
+    if (parent != NULL) {
+        parent->has_children = 1;
+    }
+    // mixed content keeps its whitespace as it is
+    if ((writer->flags & XML_WRITE_PRETTY) && writer->started && (parent == NULL || !parent->has_text)) {
+        if (xml_writer_indent(writer, writer->depth) != 0) {
+            return -1;
+        }
+    }
+
+    if (xml_writer_append(writer, "<", 1) != 0 || xml_writer_append(writer, name, name_size) != 0) {
+        return -1;
+    }
+    writer->open_tag = 1;
+    writer->started = 1;
+    return xml_writer_push(writer, name, name_size);
+}
+
+static int xml_writer_write_attribute(XMLWriter *writer, const char *name, size_t name_size, const char *value, size_t value_size, const XMLScanSet *escapes) {
+    if (writer->failed) {
+        return -1;
+    }
+    if (!writer->open_tag) {
+        return xml_writer_fail(writer);
+    }
+    if (xml_writer_append(writer, " ", 1) != 0
+        || xml_writer_append(writer, name, name_size) != 0
+        || xml_writer_append(writer, "=\"", 2) != 0
+        || xml_writer_escaped(writer, value, value_size, escapes) != 0) {
+        return -1;
+    }
+    return xml_writer_append(writer, "\"", 1);
+}
+
+// Whether text may be written at all
+static int xml_writer_check_text(XMLWriter *writer) {
+    if (writer->failed) {
+        return -1;
+    }
+    if (writer->depth == 0) {
+        return xml_writer_fail(writer);
+    }
+    return 0;
+}
+
+// Closes the start tag before the text
+static int xml_writer_open_text(XMLWriter *writer) {
+    if (xml_writer_check_text(writer) != 0 || xml_writer_close_tag(writer) != 0) {
+        return -1;
+    }
+    writer->frames[writer->depth - 1].has_text = 1;
+    return 0;
+}
+
+static int xml_writer_write_text(XMLWriter *writer, const char *text, size_t size, const XMLScanSet *escapes) {
+    if (size == 0) {
+        // nothing to write, the element may still self-close
+        return xml_writer_check_text(writer);
+    }
+    if (xml_writer_open_text(writer) != 0) {
+        return -1;
+    }
+    return xml_writer_escaped(writer, text, size, escapes);
+}
+
+// A "]]>" in the text would end the section, it is split across two
+int xml_writer_cdata(XMLWriter *writer, const char *text, size_t size) {
+    const char *end = text + size;
+    if (xml_writer_open_text(writer) != 0 || xml_writer_append(writer, "<![CDATA[", 9) != 0) {
+        return -1;
+    }
+    while (1) {
+        const char *found = xml_scan_find_sequence(text, end, "]]>", 3);
+        if (found == end) {
+            break;
+        }
+        if (xml_writer_append(writer, text, (size_t)(found - text) + 2) != 0
+            || xml_writer_append(writer, "]]><![CDATA[", 12) != 0) {
+            return -1;
+        }
+        text = found + 2;
+    }
+    if (xml_writer_append(writer, text, (size_t)(end - text)) != 0) {
+        return -1;
+    }
+    return xml_writer_append(writer, "]]>", 3);
+}
+
+int xml_writer_declaration(XMLWriter *writer, const char *version, const char *encoding) {
+    if (writer->failed) {
+        return -1;
+    }
+    if (version == NULL) {
+        version = "1.0";
+    }
+    if (encoding == NULL) {
+        encoding = "UTF-8";
+    }
+    if (xml_writer_append(writer, "<?xml version=\"", 15) != 0
+        || xml_writer_escaped(writer, version, strlen(version), &writer->attribute_escapes) != 0
+        || xml_writer_append(writer, "\" encoding=\"", 12) != 0
+        || xml_writer_escaped(writer, encoding, strlen(encoding), &writer->attribute_escapes) != 0
+        || xml_writer_append(writer, "\"?>", 3) != 0) {
+        return -1;
+    }
+    writer->started = 1;
+    return 0;
+}
+
+int xml_writer_start_element(XMLWriter *writer, const char *name) {
+    return xml_writer_start(writer, name, strlen(name));
+}
+
+int xml_writer_attribute(XMLWriter *writer, const char *name, const char *value, size_t value_size) {
+    return xml_writer_write_attribute(writer, name, strlen(name), value, value_size, &writer->attribute_escapes);
+}
+
+int xml_writer_text(XMLWriter *writer, const char *text, size_t size) {
+    return xml_writer_write_text(writer, text, size, &writer->text_escapes);
+}
+
+int xml_writer_end_element(XMLWriter *writer) {
+    if (writer->failed) {
+        return -1;
+    }
+    if (writer->depth == 0) {
+        return xml_writer_fail(writer);
+    }
+
+    XMLWriterFrame *frame = &writer->frames[writer->depth - 1];
+    int pretty = (writer->flags & XML_WRITE_PRETTY) != 0;
+    if (writer->open_tag) {
+        writer->open_tag = 0;
+        if (xml_writer_append(writer, "/>", 2) != 0) {
+            return -1;
+        }
+    } else {
+        if (pretty && frame->has_children && !frame->has_text && xml_writer_indent(writer, writer->depth - 1) != 0) {
+            return -1;
+        }
+        if (xml_writer_append(writer, "</", 2) != 0
+            || xml_writer_append(writer, writer->names + frame->name_offset, frame->name_size) != 0
+            || xml_writer_append(writer, ">", 1) != 0) {
+            return -1;
+        }
+    }
+
+    writer->names_size = frame->name_offset;
+    writer->depth--;
+    if (pretty && writer->depth == 0) {
+        return xml_writer_append(writer, "\n", 1);
+    }
+    return 0;
+}
+
+// Writes the text runs of the innermost tree element that go before its
+// child number position, SIZE_MAX for all that are left
+static int xml_writer_texts(XMLWriter *writer, size_t position) {
+    XMLWriterFrame *frame = &writer->frames[writer->depth - 1];
+    while (frame->text != NULL && frame->text->position <= position) {
+        const XMLText *text = frame->text;
+        int status = (text->flags & XML_VALUE_CDATA)
+            ? xml_writer_cdata(writer, text->text, text->size)
+            : xml_writer_write_text(writer, text->text, text->size, &writer->raw_text_escapes);
+        if (status != 0) {
+            return -1;
+        }
+        frame->text = text->next;
+    }
+    return 0;
+}
+
+// Start tag, attributes and the text before the first child of a tree element
+static int xml_writer_open_element(XMLWriter *writer, const XMLElement *element) {
+    if (xml_writer_start(writer, element->name, element->name_size) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < element->attributes_size; i++) {
+        const XMLAttribute *attr = &element->attributes[i];
+        if (xml_writer_write_attribute(writer, attr->name, attr->name_size, attr->value, attr->value_size, &writer->raw_attribute_escapes) != 0) {
+            return -1;
+        }
+    }
+    writer->frames[writer->depth - 1].text = element->texts;
+    return xml_writer_texts(writer, 0);
+}
+
+// Walks the subtree through the parent links, like the parser it needs no
+// recursion however deep the tree is
+int xml_writer_element(XMLWriter *writer, XMLElement *element) {
+    XMLElement *current = element;
+    while (1) {
+        if (xml_writer_open_element(writer, current) != 0) {
+            return -1;
+        }
+        XMLElement *children = xml_element_children(current);
+        if (children != NULL) {
+            current = children;
+            continue;
+        }
+
+        // close the leaf and every ancestor it is the last child of, with
+        // the text runs that follow each of them
+        while (1) {
+            if (xml_writer_texts(writer, SIZE_MAX) != 0 || xml_writer_end_element(writer) != 0) {
+                return -1;
+            }
+            if (current == element) {
+                return 0;
+            }
+            if (xml_writer_texts(writer, ++writer->frames[writer->depth - 1].children) != 0) {
+                return -1;
+            }
+            if (current->next_sibling != NULL) {
+                current = current->next_sibling;
+                break;
+            }
+            current = current->parent;
+        }
+    }
+}
+
+int xml_writer_document(XMLWriter *writer, XMLFile *file) {
+    if (!(writer->flags & XML_WRITE_NO_DECLARATION) && xml_writer_declaration(writer, file->version, file->encoding) != 0) {
+        return -1;
+    }
+    if (file->root != NULL) {
+        return xml_writer_element(writer, file->root);
+    }
+    return writer->failed ? -1 : 0;
+}
+
+static int xml_write_fd_callback(const char *data, size_t size, void *user_data) {
+    int fd = *(int *)user_data;
+    while (size > 0) {
+        ssize_t count = write(fd, data, size);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += count;
+        size -= (size_t)count;
+    }
+    return 0;
+}
+
+int xml_write_fd(XMLFile *file, int fd, unsigned int flags) {
+    XMLWriter *writer = xml_writer_new(xml_write_fd_callback, &fd, flags);
+    if (writer == NULL) {
+        return -1;
+    }
+    int result = xml_writer_document(writer, file);
+    if (result == 0) {
+        result = xml_writer_flush(writer);
+    }
+    xml_writer_free(writer);
+    return result;
+}
+
+char *xml_write_buffer(XMLFile *file, unsigned int flags, size_t *size) {
+    XMLWriter *writer = xml_writer_create(NULL, NULL, flags);
+    if (writer == NULL) {
+        return NULL;
+    }
+    char *buffer = NULL;
+    if (xml_writer_document(writer, file) == 0 && xml_writer_append(writer, "", 1) == 0) {
+        buffer = writer->buffer;
+        writer->buffer = NULL;
+        if (size != NULL) {
+            *size = writer->size - 1;
+        }
+    }
+    xml_writer_free(writer);
+    return buffer;
+}